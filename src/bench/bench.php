@@ -0,0 +1,165 @@
+<?php
+
+/**
+ * Benchmark suite for the profiler's hot paths.
+ *
+ * Runs every workload under each profiling mode and reports how much the
+ * profiler adds per intercepted call, plus the C level microbenchmarks of
+ * xhprof_microbench() when the extension was configured with
+ * --enable-md_xhprof_bench. Output is one JSON object per line.
+ *
+ * Usage: php [-d extension=modules/md_xhprof.so] bench/bench.php
+ *            [--runs=N] [--workload=name] [--mode=name] [--iterations=N]
+ */
+
+$options = getopt('', array('runs::', 'workload::', 'mode::', 'iterations::'));
+$runs       = isset($options['runs']) ? max(1, (int)$options['runs']) : 5;
+$iterations = isset($options['iterations'])
+              ? max(1, (int)$options['iterations']) : 100000;
+
+foreach (glob(__DIR__ . '/workloads/*.php') as $file) {
+  require_once $file;
+}
+
+$workloads = array('recursion', 'tiny_functions', 'builtins', 'includes');
+
+$modes = array(
+  'off'          => null,
+  'hierarchical' => 0,
+  'cpu'          => XHPROF_FLAGS_CPU,
+  'memory'       => XHPROF_FLAGS_MEMORY,
+  'no_builtins'  => XHPROF_FLAGS_NO_BUILTINS,
+  'sampled'      => 'sampled',
+);
+
+if (isset($options['workload'])) {
+  $workloads = array_intersect($workloads, explode(',', $options['workload']));
+}
+if (isset($options['mode'])) {
+  $modes = array_intersect_key($modes,
+                               array_flip(explode(',', $options['mode'])));
+}
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+function bench_now() {
+  if (function_exists('hrtime')) {
+    return hrtime(true);
+  }
+  return (int)(microtime(true) * 1e9);
+}
+
+/**
+ * Run a workload once under the given mode.
+ *
+ * @return array  elapsed nanoseconds and the profile, if any
+ */
+function bench_run($workload, $mode) {
+  $fn = "workload_$workload";
+
+  $start = bench_now();
+  if ($mode === null) {
+    $fn();
+    $profile = null;
+  } else if ($mode === 'sampled') {
+    xhprof_sample_enable();
+    $fn();
+    $profile = xhprof_sample_disable();
+  } else {
+    xhprof_enable($mode);
+    $fn();
+    $profile = xhprof_disable();
+  }
+  return array(bench_now() - $start, $profile);
+}
+
+/**
+ * Number of calls the profiler intercepts for a workload, taken from the
+ * call counts of a hierarchical profile.
+ */
+function bench_calls($workload, $flags) {
+  list(, $profile) = bench_run($workload, $flags);
+  $calls = 0;
+  foreach ($profile as $metrics) {
+    $calls += $metrics['ct'];
+  }
+  return $calls;
+}
+
+function bench_median($values) {
+  sort($values);
+  $n = count($values);
+  return $n % 2 ? $values[($n - 1) / 2]
+                : ($values[$n / 2 - 1] + $values[$n / 2]) / 2;
+}
+
+function bench_emit($record) {
+  echo json_encode($record), "\n";
+}
+
+foreach ($workloads as $workload) {
+  $baseline = null;
+
+  foreach ($modes as $mode_name => $mode) {
+    /* warm up */
+    bench_run($workload, $mode);
+
+    $times = array();
+    for ($i = 0; $i < $runs; $i++) {
+      list($elapsed) = bench_run($workload, $mode);
+      $times[] = $elapsed;
+    }
+    $median = bench_median($times);
+
+    if ($mode === null) {
+      $baseline = $median;
+    }
+
+    $calls = bench_calls($workload,
+                         $mode === null || $mode === 'sampled' ? 0 : $mode);
+
+    $record = array(
+      'type'     => 'workload',
+      'workload' => $workload,
+      'mode'     => $mode_name,
+      'runs'     => $runs,
+      'ns'       => $median,
+      'calls'    => $calls,
+    );
+    if ($baseline !== null && $mode !== null && $calls > 0) {
+      $record['overhead_ns_per_call'] = round(($median - $baseline) / $calls, 1);
+    }
+    bench_emit($record);
+  }
+}
+
+if (function_exists('xhprof_microbench')) {
+  foreach ($modes as $mode_name => $mode) {
+    if ($mode === null) {
+      $result = xhprof_microbench($iterations);
+    } else if ($mode === 'sampled') {
+      xhprof_sample_enable();
+      $result = xhprof_microbench($iterations);
+      xhprof_sample_disable();
+    } else {
+      xhprof_enable($mode);
+      $result = xhprof_microbench($iterations);
+      xhprof_disable();
+    }
+
+    foreach ($result as $op => $ns) {
+      /* only a whole profiled call depends on the mode */
+      if ($mode !== null && $op !== 'call') {
+        continue;
+      }
+      bench_emit(array(
+        'type'        => 'micro',
+        'op'          => $op,
+        'mode'        => $mode_name,
+        'iterations'  => $iterations,
+        'ns_per_call' => round($ns, 2),
+      ));
+    }
+  }
+}
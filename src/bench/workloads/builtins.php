@@ -0,0 +1,17 @@
+<?php
+
+/**
+ * Heavy use of cheap builtins, the case XHPROF_FLAGS_NO_BUILTINS is for.
+ */
+function workload_builtins() {
+  $data = array('alpha' => 1, 'beta' => 2, 'gamma' => 3);
+  $n    = 0;
+  for ($i = 0; $i < 10000; $i++) {
+    $n += strlen('benchmark') + count($data);
+    if (array_key_exists('beta', $data)) {
+      $n += abs(-1);
+    }
+    $n += ord(substr('xhprof', $i % 6, 1));
+  }
+  return $n;
+}
@@ -0,0 +1,32 @@
+<?php
+
+/**
+ * Many includes: exercises the compile file proxy and the run_init names.
+ */
+function bench_include_files() {
+  static $files = null;
+
+  if ($files === null) {
+    $dir = sys_get_temp_dir() . '/md_xhprof_bench_' . getmypid();
+    @mkdir($dir);
+    $files = array();
+    for ($i = 0; $i < 50; $i++) {
+      $file = "$dir/inc_$i.php";
+      file_put_contents($file, "<?php\n\$bench_value = $i * 2;\n");
+      $files[] = $file;
+    }
+    register_shutdown_function(function () use ($dir, $files) {
+      foreach ($files as $file) {
+        @unlink($file);
+      }
+      @rmdir($dir);
+    });
+  }
+  return $files;
+}
+
+function workload_includes() {
+  foreach (bench_include_files() as $file) {
+    include $file;
+  }
+}
@@ -0,0 +1,18 @@
+<?php
+
+/**
+ * Deep recursion: one long chain of user function calls, so every call
+ * walks the stack for its recursion level.
+ */
+function bench_recurse($depth) {
+  if ($depth > 0) {
+    return bench_recurse($depth - 1) + 1;
+  }
+  return 0;
+}
+
+function workload_recursion() {
+  for ($i = 0; $i < 20; $i++) {
+    bench_recurse(500);
+  }
+}
@@ -0,0 +1,24 @@
+<?php
+
+/**
+ * Many tiny user functions: the profiler cost dominates the call itself.
+ */
+function bench_tiny_a($x) {
+  return $x + 1;
+}
+
+function bench_tiny_b($x) {
+  return bench_tiny_a($x) * 2;
+}
+
+function bench_tiny_c($x) {
+  return bench_tiny_b($x) - bench_tiny_a($x);
+}
+
+function workload_tiny_functions() {
+  $sum = 0;
+  for ($i = 0; $i < 10000; $i++) {
+    $sum += bench_tiny_c($i);
+  }
+  return $sum;
+}
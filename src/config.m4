@@ -11,6 +11,9 @@ PHP_ARG_WITH(md_xhprof, for md_xhprof support,
 Make sure that the comment is aligned:
 [  --with-md_xhprof             Include md_xhprof support])
 
+PHP_ARG_ENABLE(md_xhprof_bench, whether to build md_xhprof microbenchmarks,
+[  --enable-md_xhprof_bench     Build xhprof_microbench() for bench/bench.php], no, no)
+
 dnl Otherwise use enable:
 
 dnl PHP_ARG_ENABLE(md_xhprof, whether to enable md_xhprof support,
@@ -59,8 +62,14 @@ if test "$PHP_MD_XHPROF" != "no"; then
   dnl
   dnl PHP_SUBST(MD_XHPROF_SHARED_LIBADD)
 
+  if test "$PHP_MD_XHPROF_BENCH" != "no"; then
+    AC_DEFINE(XHPROF_BENCH, 1, [Build xhprof_microbench() for bench/bench.php])
+  fi
+
   md_xhprof_source="md_xhprof.c \
-        xhprof.c"
+        xhprof.c \
+        xhprof_format.c \
+        xhprof_report.c"
 
-  PHP_NEW_EXTENSION(md_xhprof, $md_xhprof_source, $ext_shared)
+  PHP_NEW_EXTENSION(md_xhprof, $md_xhprof_source, $ext_shared,, -DZEND_ENABLE_STATIC_TSRMLS_CACHE=1)
 fi
@@ -24,119 +24,26 @@
 
 #include "php.h"
 #include "php_ini.h"
+#include "SAPI.h"
 #include "ext/standard/info.h"
 #include "ext/standard/php_var.h"
+#if PHP_VERSION_ID >= 70100
+#include "ext/standard/php_mt_rand.h"
+#endif
 #include "Zend/zend_portability.h"
 
 #include "php_md_xhprof.h"
 #include "xhprof.h"
+#include "xhprof_format.h"
+#include "xhprof_report.h"
 
+#include "Zend/zend_extensions.h"
 
+#if PHP_VERSION_ID >= 80100
+#include "Zend/zend_observer.h"
+#include "Zend/zend_fibers.h"
+#endif
 
-/**
- * *****************************
- * GLOBAL DATATYPES AND TYPEDEFS
- * *****************************
- */
-
-/* XHProf maintains a stack of entries being profiled. The memory for the entry
- * is passed by the layer that invokes BEGIN_PROFILING(), e.g. the hp_execute()
- * function. Often, this is just C-stack memory.
- *
- * This structure is a convenient place to track start time of a particular
- * profile operation, recursion depth, and the name of the function being
- * profiled. */
-typedef struct hp_entry_t {
-  char                   *name_hprof;                       /* function name */
-  int                     rlvl_hprof;        /* recursion level for function */
-  uint64                  tsc_start;         /* start value for TSC counter  */
-  long int                mu_start_hprof;                    /* memory usage */
-  long int                pmu_start_hprof;              /* peak memory usage */
-  struct rusage           ru_start_hprof;             /* user/sys time start */
-  struct hp_entry_t      *prev_hprof;    /* ptr to prev entry being profiled */
-  uint8                   hash_code;     /* hash_code for the function name  */
-} hp_entry_t;
-
-/* Various types for XHPROF callbacks       */
-typedef void (*hp_init_cb)           (TSRMLS_D);
-typedef void (*hp_exit_cb)           (TSRMLS_D);
-typedef void (*hp_begin_function_cb) (hp_entry_t **entries,
-                                      hp_entry_t *current   TSRMLS_DC);
-typedef void (*hp_end_function_cb)   (hp_entry_t **entries  TSRMLS_DC);
-
-/* Struct to hold the various callbacks for a single xhprof mode */
-typedef struct hp_mode_cb {
-  hp_init_cb             init_cb;
-  hp_exit_cb             exit_cb;
-  hp_begin_function_cb   begin_fn_cb;
-  hp_end_function_cb     end_fn_cb;
-} hp_mode_cb;
-
-/* Xhprof's global state.
- *
- * This structure is instantiated once.  Initialize defaults for attributes in
- * hp_init_profiler_state() Cleanup/free attributes in
- * hp_clean_profiler_state() */
-typedef struct hp_global_t {
-
-  /*       ----------   Global attributes:  -----------       */
-
-  /* Indicates if xhprof is currently enabled */
-  int               enabled;
-
-  /* Indicates if xhprof was ever enabled during this request */
-  int               ever_enabled;
-
-  /* Holds all the xhprof statistics */
-  zval              stats_count;
-
-  /* Indicates the current xhprof mode or level */
-  int               profiler_level;
-
-  /* Top of the profile stack */
-  hp_entry_t        *entries;
-
-  /* freelist of hp_entry_t chunks for reuse... */
-  hp_entry_t        *entry_free_list;
-
-  /* Callbacks for various xhprof modes */
-  hp_mode_cb        mode_cb;
-
-  /*       ----------   Mode specific attributes:  -----------       */
-
-  /* Global to track the time of the last sample in time and ticks */
-  struct timeval    last_sample_time;
-  uint64            last_sample_tsc;
-  /* XHPROF_SAMPLING_INTERVAL in ticks */
-  uint64            sampling_interval_tsc;
-
-  /* This array is used to store cpu frequencies for all available logical
-   * cpus.  For now, we assume the cpu frequencies will not change for power
-   * saving or other reasons. If we need to worry about that in the future, we
-   * can use a periodical timer to re-calculate this arrary every once in a
-   * while (for example, every 1 or 5 seconds). */
-  double *cpu_frequencies;
-
-  /* The number of logical CPUs this machine has. */
-  uint32 cpu_num;
-
-  /* The saved cpu affinity. */
-  cpu_set_t prev_mask;
-
-  /* The cpu id current process is bound to. (default 0) */
-  uint32 cur_cpu_id;
-
-  /* XHProf flags */
-  uint32 xhprof_flags;
-
-  /* counter table indexed by hash value of function names. */
-  uint8  func_hash_counters[256];
-
-  /* Table of ignored function names and their filter */
-  char  **ignored_function_names;
-  uint8   ignored_function_filter[XHPROF_IGNORED_FUNCTION_FILTER_SIZE];
-
-} hp_global_t;
 
 
 /**
@@ -144,8 +51,12 @@ typedef struct hp_global_t {
  * GLOBAL STATIC VARIABLES
  * ***********************
  */
-/* XHProf global state */
-static hp_global_t        hp_globals;
+/* XHProf per-thread state, see php_md_xhprof.h */
+ZEND_DECLARE_MODULE_GLOBALS(md_xhprof)
+
+/* The proxies below are installed by hp_begin(), or once at MINIT with ZTS
+ * (see hp_install_hooks()); each of them checks XHPROF_G(enabled) before
+ * doing any work. */
 
 /* Pointer to the original execute function */
 static void (*_zend_execute_ex) (zend_execute_data *execute_data TSRMLS_DC);
@@ -157,7 +68,63 @@ static void (*_zend_execute_internal) (zend_execute_data *execute_data, zval *re
 static zend_op_array * (*_zend_compile_file) (zend_file_handle *file_handle, int type TSRMLS_DC);
 
 /* Pointer to the original compile string function (used by eval) */
+#if PHP_VERSION_ID >= 80200
+static zend_op_array * (*_zend_compile_string) (zend_string *source_string, const char *filename, zend_compile_position position);
+#elif PHP_VERSION_ID >= 80000
+static zend_op_array * (*_zend_compile_string) (zend_string *source_string, const char *filename);
+#else
 static zend_op_array * (*_zend_compile_string) (zval *source_string, char *filename TSRMLS_DC);
+#endif
+
+/* Pointer to the original error callback */
+#if PHP_VERSION_ID >= 80100
+static void (*_zend_error_cb) (int type, zend_string *error_filename, const uint32_t error_lineno, zend_string *message);
+#elif PHP_VERSION_ID >= 80000
+static void (*_zend_error_cb) (int type, const char *error_filename, const uint32_t error_lineno, zend_string *message);
+#else
+static void (*_zend_error_cb) (int type, const char *error_filename, const uint32_t error_lineno, const char *format, va_list args);
+#endif
+
+/* XHProfSpan, a code region for the lifetime of the object */
+static zend_class_entry *hp_span_ce;
+
+/* Pointer to the original cycle collector, a function pointer since 7.3 */
+#if PHP_VERSION_ID >= 70300
+static int (*_gc_collect_cycles) (void);
+#endif
+
+/* Counters table shared by all the processes, NULL unless xhprof.counters
+ * is on; and the size of its mapping */
+static hp_counters_t *hp_counters;
+static size_t         hp_counters_size;
+
+/* op_array.reserved[] slot for hp_func_info_t, -1 if none was available */
+static int hp_resource_handle = -1;
+
+#if PHP_VERSION_ID < 80000
+/* zend_get_resource_handle() wants a zend_extension before PHP 8; it only
+ * uses it to record the handle. */
+static zend_extension hp_resource_owner = { "md_xhprof" };
+#endif
+
+/* Profiler state put aside while profiling fictitious calls, see
+ * hp_scratch_enter() */
+typedef struct hp_scratch_t {
+  zval          stats_count;
+  zend_long     stats_bytes;
+  hp_entry_t   *entries;
+  uint64        call_count;
+} hp_scratch_t;
+
+#if PHP_VERSION_ID >= 80100
+/* Saved state of a fiber that is not currently running. */
+typedef struct hp_fiber_t {
+  hp_entry_t  *entries;            /* top of the fiber's profile stack        */
+  uint64       switched_out_tsc;   /* TSC when the fiber was switched out     */
+  int          suspended;          /* 1 if suspended, 0 if it is waiting on a
+                                    * fiber it started or resumed itself     */
+} hp_fiber_t;
+#endif
 
 /* Bloom filter for function names to be ignored */
 #define INDEX_2_BYTE(index)  (index >> 3)
@@ -171,23 +138,58 @@ static zend_op_array * (*_zend_compile_string) (zval *source_string, char *filen
  */
 static void hp_register_constants(INIT_FUNC_ARGS);
 
+static void hp_install_hooks(int builtins);
+static void hp_remove_hooks();
 static void hp_begin(long level, long xhprof_flags TSRMLS_DC);
 static void hp_stop(TSRMLS_D);
 static void hp_end(TSRMLS_D);
 
+#if PHP_VERSION_ID >= 80100
+static void hp_fiber_switch_cb(zend_fiber_context *from, zend_fiber_context *to);
+#endif
+static void hp_fiber_stacks_close(TSRMLS_D);
+static void hp_end_frame(hp_entry_t **entries, hp_entry_t *frame,
+                         uint64 seq TSRMLS_DC);
+static int  hp_exception_pending(TSRMLS_D);
+
+static inline uint64 hp_call_overhead_tsc(TSRMLS_D);
+static void hp_scratch_enter(hp_scratch_t *saved TSRMLS_DC);
+static void hp_scratch_leave(hp_scratch_t *saved TSRMLS_DC);
+static void hp_scratch_calls(int calls TSRMLS_DC);
+static void hp_calibrate_overhead(TSRMLS_D);
+static void hp_add_overhead_entry(TSRMLS_D);
+static void hp_add_folded_entries(TSRMLS_D);
+static void hp_sampled_edges_finish(TSRMLS_D);
+static void hp_sampled_edges_destroy(TSRMLS_D);
+static void hp_sampled_edges_reset(TSRMLS_D);
+static void hp_flush_schedule(TSRMLS_D);
+static int  hp_flush(TSRMLS_D);
+static void hp_collector_send(TSRMLS_D);
+static int  hp_keep_profile(TSRMLS_D);
+static uint64 hp_counters_now_ns();
+
 static void clear_frequencies();
 
-static void hp_free_the_free_list();
+static void hp_free_the_free_list(hp_entry_t *p);
 static hp_entry_t *hp_fast_alloc_hprof_entry();
 static void hp_fast_free_hprof_entry(hp_entry_t *p);
 static void get_all_cpu_frequencies();
 
 static void hp_get_ignored_functions_from_arg(zval *args);
+static void hp_get_allowed_functions_from_arg(zval *args);
+static void hp_get_call_sample_rate_from_arg(zval *args);
+static void hp_get_span_functions_from_arg(zval *args);
+static int  hp_allowed_entry(const char *name);
+static hp_func_info_t *hp_get_func_info(zend_function *func TSRMLS_DC);
+static hp_func_info_t *hp_get_func_info_ex(zend_function *func,
+                                           zend_op_array *ops TSRMLS_DC);
+static void hp_func_cache_destroy(TSRMLS_D);
 static void hp_ignored_functions_filter_clear();
 static void hp_ignored_functions_filter_init();
 
 static inline zval  *hp_zval_at_key(char  *key, zval  *values);
 static inline char **hp_strings_in_zval(zval  *values);
+int save_cpu_affinity(cpu_set_t * prev_mask);
 int restore_cpu_affinity(cpu_set_t * prev_mask);
 int bind_to_cpu(uint32 cpu_id);
 
@@ -224,6 +226,30 @@ static void hp_register_constants(INIT_FUNC_ARGS) {
   REGISTER_LONG_CONSTANT("XHPROF_FLAGS_MEMORY",
                          XHPROF_FLAGS_MEMORY,
                          CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_FLAGS_OVERHEAD",
+                         XHPROF_FLAGS_OVERHEAD,
+                         CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_FLAGS_COMPENSATE",
+                         XHPROF_FLAGS_COMPENSATE,
+                         CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_FLAGS_ADAPTIVE",
+                         XHPROF_FLAGS_ADAPTIVE,
+                         CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_FLAGS_IOWAIT",
+                         XHPROF_FLAGS_IOWAIT,
+                         CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_SUMMARY",
+                         XHPROF_SUMMARY,
+                         CONST_CS | CONST_PERSISTENT);
+
+  REGISTER_LONG_CONSTANT("XHPROF_SUMMARY_ONLY",
+                         XHPROF_SUMMARY_ONLY,
+                         CONST_CS | CONST_PERSISTENT);
 }
 
 /**
@@ -233,27 +259,185 @@ static void hp_register_constants(INIT_FUNC_ARGS) {
  */
 static void hp_get_ignored_functions_from_arg(zval *args) {
 
-  if (hp_globals.ignored_function_names) {
-    hp_array_del(hp_globals.ignored_function_names);
+  if (XHPROF_G(ignored_function_names)) {
+    hp_array_del(XHPROF_G(ignored_function_names));
+  }
+  if (XHPROF_G(ignored_function_lens)) {
+    efree(XHPROF_G(ignored_function_lens));
+    XHPROF_G(ignored_function_lens) = NULL;
   }
 
   if (args != NULL) {
     zval  *zresult = NULL;
 
     zresult = hp_zval_at_key("ignored_functions", args);
-    hp_globals.ignored_function_names = hp_strings_in_zval(zresult);
+    XHPROF_G(ignored_function_names) = hp_strings_in_zval(zresult);
+  } else {
+    XHPROF_G(ignored_function_names) = NULL;
+  }
+
+  /* Their lengths, compared before the names themselves */
+  if (XHPROF_G(ignored_function_names)) {
+    int i, count = 0;
+
+    while (XHPROF_G(ignored_function_names)[count]) {
+      count++;
+    }
+    XHPROF_G(ignored_function_lens) = safe_emalloc(count + 1, sizeof(size_t), 0);
+    for (i = 0; i < count; i++) {
+      XHPROF_G(ignored_function_lens)[i] =
+        strlen(XHPROF_G(ignored_function_names)[i]);
+    }
+  }
+}
+
+/**
+ * Parse the "profile_only" list from the zval argument. Each entry is one
+ * of:
+ *   - a namespace, ending with a backslash: "App\\Billing\\"
+ *   - a pattern with "*" wildcards:          "App\\*Repository::find*"
+ *   - a function or method name:            "strlen", "Foo::bar"
+ *   - a class name, matching all its methods: "Foo"
+ * Matching is case insensitive, like PHP's own names.
+ */
+static void hp_get_allowed_functions_from_arg(zval *args) {
+
+  if (XHPROF_G(allowed_function_names)) {
+    hp_array_del(XHPROF_G(allowed_function_names));
+  }
+
+  if (args != NULL) {
+    XHPROF_G(allowed_function_names) =
+      hp_strings_in_zval(hp_zval_at_key("profile_only", args));
   } else {
-    hp_globals.ignored_function_names = NULL;
+    XHPROF_G(allowed_function_names) = NULL;
+  }
+}
+
+/**
+ * Parse the "sample_calls" rate from the zval argument: time only one in
+ * that many calls of each caller==>callee edge.
+ */
+static void hp_get_call_sample_rate_from_arg(zval *args) {
+  zval *rate = args ? hp_zval_at_key("sample_calls", args) : NULL;
+
+  XHPROF_G(call_sample_rate) = 0;
+  if (rate) {
+    zend_long n = zval_get_long(rate);
+
+    if (n > 1 && n <= UINT32_MAX) {
+      XHPROF_G(call_sample_rate) = (uint32)n;
+    }
+  }
+}
+
+/* Functions the "spans" option stands for when it is just true */
+static const char *hp_default_span_functions[] = {
+  "PDO::query", "PDO::exec", "PDOStatement::execute",
+  "mysqli_query", "mysqli::query", "mysqli_real_query", "mysqli::real_query",
+  "pg_query", "pg_query_params", "curl_exec", "file_get_contents", "Redis::",
+  NULL
+};
+
+/**
+ * Parse the "spans" option from the zval argument: true for the functions
+ * of hp_default_span_functions, or a list of function names. A name ending
+ * with "::" stands for all the methods of the class.
+ */
+static void hp_get_span_functions_from_arg(zval *args) {
+  zval *spans = args ? hp_zval_at_key("spans", args) : NULL;
+
+  if (XHPROF_G(span_function_names)) {
+    hp_array_del(XHPROF_G(span_function_names));
+    XHPROF_G(span_function_names) = NULL;
+  }
+
+  if (spans && Z_TYPE_P(spans) == IS_TRUE) {
+    size_t count = sizeof(hp_default_span_functions) / sizeof(char *);
+    size_t i;
+
+    XHPROF_G(span_function_names) = emalloc(count * sizeof(char *));
+    for (i = 0; i + 1 < count; i++) {
+      XHPROF_G(span_function_names)[i] =
+        estrdup(hp_default_span_functions[i]);
+    }
+    XHPROF_G(span_function_names)[i] = NULL;
+  } else if (spans) {
+    XHPROF_G(span_function_names) = hp_strings_in_zval(spans);
   }
 }
 
+/**
+ * Case insensitive match of name against a pattern where "*" matches any
+ * run of characters.
+ */
+static int hp_pattern_match(const char *pattern, const char *name) {
+  const char *star = NULL;
+  const char *retry = NULL;
+
+  while (*name) {
+    if (*pattern == '*') {
+      star  = ++pattern;
+      retry = name;
+    } else if (tolower((unsigned char)*pattern)
+               == tolower((unsigned char)*name)) {
+      pattern++;
+      name++;
+    } else if (star) {
+      pattern = star;
+      name    = ++retry;
+    } else {
+      return 0;
+    }
+  }
+
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == 0;
+}
+
+/**
+ * Check if name is selected by the "profile_only" list. Everything is
+ * allowed when there is no such list.
+ */
+static int hp_allowed_entry(const char *name) {
+  int i;
+
+  if (XHPROF_G(allowed_function_names) == NULL) {
+    return 1;
+  }
+
+  for (i = 0; XHPROF_G(allowed_function_names)[i] != NULL; i++) {
+    const char *pattern = XHPROF_G(allowed_function_names)[i];
+    size_t      len     = strlen(pattern);
+
+    if (strchr(pattern, '*')) {
+      if (hp_pattern_match(pattern, name)) {
+        return 1;
+      }
+    } else if (len && pattern[len - 1] == '\\') {
+      /* namespace prefix */
+      if (!strncasecmp(name, pattern, len)) {
+        return 1;
+      }
+    } else if (!strncasecmp(name, pattern, len)
+               && (name[len] == 0 || !strncmp(name + len, "::", 2))) {
+      /* exact name, or a method of the class */
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 /**
  * Clear filter for functions which may be ignored during profiling.
  *
  * @author mpal
  */
 static void hp_ignored_functions_filter_clear() {
-  memset(hp_globals.ignored_function_filter, 0,
+  memset(XHPROF_G(ignored_function_filter), 0,
          XHPROF_IGNORED_FUNCTION_FILTER_SIZE);
 }
 
@@ -263,13 +447,13 @@ static void hp_ignored_functions_filter_clear() {
  * @author mpal
  */
 static void hp_ignored_functions_filter_init() {
-  if (hp_globals.ignored_function_names != NULL) {
+  if (XHPROF_G(ignored_function_names) != NULL) {
     int i = 0;
-    for(; hp_globals.ignored_function_names[i] != NULL; i++) {
-      char *str  = hp_globals.ignored_function_names[i];
-      uint8 hash = hp_inline_hash(str);
+    for(; XHPROF_G(ignored_function_names)[i] != NULL; i++) {
+      char *str  = XHPROF_G(ignored_function_names)[i];
+      uint8 hash = hp_inline_hash_len(str, XHPROF_G(ignored_function_lens)[i]);
       int   idx  = INDEX_2_BYTE(hash);
-      hp_globals.ignored_function_filter[idx] |= INDEX_2_BIT(hash);
+      XHPROF_G(ignored_function_filter)[idx] |= INDEX_2_BIT(hash);
     }
   }
 }
@@ -281,7 +465,7 @@ static void hp_ignored_functions_filter_init() {
  */
 int hp_ignored_functions_filter_collision(uint8 hash) {
   uint8 mask = INDEX_2_BIT(hash);
-  return hp_globals.ignored_function_filter[INDEX_2_BYTE(hash)] & mask;
+  return XHPROF_G(ignored_function_filter)[INDEX_2_BYTE(hash)] & mask;
 }
 
 /**
@@ -291,32 +475,60 @@ int hp_ignored_functions_filter_collision(uint8 hash) {
  */
 void hp_init_profiler_state(int level TSRMLS_DC) {
   /* Setup globals */
-  if (!hp_globals.ever_enabled) {
-    hp_globals.ever_enabled  = 1;
-    hp_globals.entries = NULL;
+  if (!XHPROF_G(ever_enabled)) {
+    XHPROF_G(ever_enabled)  = 1;
+    XHPROF_G(entries) = NULL;
   }
-  hp_globals.profiler_level  = (int) level;
+  XHPROF_G(profiler_level)  = (int) level;
 
-  /* Init stats_count */
-  array_init(&hp_globals.stats_count);
+  /* Init stats_count, counters mode adds to the shared table instead */
+  if (level == XHPROF_MODE_COUNTERS) {
+    ZVAL_NULL(&XHPROF_G(stats_count));
+  } else {
+    array_init(&XHPROF_G(stats_count));
+  }
+  XHPROF_G(stats_bytes)   = 0;
+  XHPROF_G(io_wait_us)    = 0;
+  XHPROF_G(max_edges)     = INI_INT("xhprof.max_edges");
+  XHPROF_G(max_key_bytes) = INI_INT("xhprof.max_key_bytes");
+  XHPROF_G(max_samples)   = INI_INT("xhprof.max_samples");
+
+  /* Spans of the previous run are kept until now, see xhprof_spans() */
+  zval_ptr_dtor(&XHPROF_G(spans));
+  ZVAL_UNDEF(&XHPROF_G(spans));
+  XHPROF_G(span_count) = 0;
+  if (XHPROF_G(span_function_names)) {
+    array_init(&XHPROF_G(spans));
+  }
   
   
-  /* NOTE(cjiang): some fields such as cpu_frequencies take relatively longer
-   * to initialize, (5 milisecond per logical cpu right now), therefore we
-   * calculate them lazily. */
-  if (hp_globals.cpu_frequencies == NULL) {
-    get_all_cpu_frequencies();
-    restore_cpu_affinity(&hp_globals.prev_mask);
-  }
+  /* Counters mode runs on every request, it reads the monotonic clock
+   * rather than the TSC so it needn't pin the thread to a cpu. */
+  if (level != XHPROF_MODE_COUNTERS) {
+    /* Remember this thread's affinity so hp_stop() can restore it. */
+    save_cpu_affinity(&XHPROF_G(prev_mask));
+
+    /* NOTE(cjiang): some fields such as cpu_frequencies take relatively
+     * longer to initialize, (5 milisecond per logical cpu right now),
+     * therefore we calculate them lazily. */
+    if (XHPROF_G(cpu_frequencies) == NULL) {
+      get_all_cpu_frequencies();
+      restore_cpu_affinity(&XHPROF_G(prev_mask));
+    }
 
-  /* bind to a random cpu so that we can use rdtsc instruction. */
-  bind_to_cpu((int) (rand() % hp_globals.cpu_num));
+    /* bind to a random cpu so that we can use rdtsc instruction. */
+    bind_to_cpu((int) (rand() % XHPROF_G(cpu_num)));
+  }
 
   /* Call current mode's init cb */
-  hp_globals.mode_cb.init_cb(TSRMLS_C);
+  XHPROF_G(mode_cb).init_cb(TSRMLS_C);
 
   /* Set up filter of functions which may be ignored during profiling */
+  hp_ignored_functions_filter_clear();
   hp_ignored_functions_filter_init();
+
+  /* The ignore/allow lists may have changed, redo cached decisions */
+  XHPROF_G(filter_gen)++;
 }
 
 /**
@@ -326,20 +538,36 @@ void hp_init_profiler_state(int level TSRMLS_DC) {
  */
 void hp_clean_profiler_state(TSRMLS_D) {
   /* Call current mode's exit cb */
-  hp_globals.mode_cb.exit_cb(TSRMLS_C);
+  XHPROF_G(mode_cb).exit_cb(TSRMLS_C);
 
-  if (hp_globals.enabled){
-    zval_dtor(&hp_globals.stats_count);
+  if (XHPROF_G(enabled)){
+    zval_dtor(&XHPROF_G(stats_count));
   }
   
   /* Clear globals */
-  hp_globals.entries = NULL;
-  hp_globals.profiler_level = 1;
-  hp_globals.ever_enabled = 0;
+  XHPROF_G(entries) = NULL;
+  XHPROF_G(profiler_level) = 1;
+  XHPROF_G(ever_enabled) = 0;
+  XHPROF_G(request_sampled) = 0;
 
   /* Delete the array storing ignored function names */
-  hp_array_del(hp_globals.ignored_function_names);
-  hp_globals.ignored_function_names = NULL;
+  hp_array_del(XHPROF_G(ignored_function_names));
+  XHPROF_G(ignored_function_names) = NULL;
+  if (XHPROF_G(ignored_function_lens)) {
+    efree(XHPROF_G(ignored_function_lens));
+    XHPROF_G(ignored_function_lens) = NULL;
+  }
+
+  hp_array_del(XHPROF_G(allowed_function_names));
+  XHPROF_G(allowed_function_names) = NULL;
+
+  hp_array_del(XHPROF_G(span_function_names));
+  XHPROF_G(span_function_names) = NULL;
+  zval_ptr_dtor(&XHPROF_G(spans));
+  ZVAL_UNDEF(&XHPROF_G(spans));
+
+  /* Cached per-function data only lives for the request */
+  hp_func_cache_destroy(TSRMLS_C);
 }
 
 /*
@@ -353,20 +581,43 @@ void hp_clean_profiler_state(TSRMLS_D) {
 #define BEGIN_PROFILING(entries, symbol, profile_curr)                  \
   do {                                                                  \
     /* Use a hash code to filter most of the string comparisons. */     \
-    uint8 hash_code  = hp_inline_hash(symbol);                          \
-    profile_curr = !hp_ignore_entry(hash_code, symbol);                 \
+    size_t symbol_len = strlen(symbol);                                 \
+    uint8 hash_code  = hp_inline_hash_len(symbol, symbol_len);          \
+    profile_curr = !hp_ignore_entry(hash_code, symbol, symbol_len);     \
+    if (profile_curr) {                                                 \
+      HP_PUSH_ENTRY(entries, symbol, hash_code, 0, 0);                  \
+    }                                                                   \
+  } while (0)
+
+/*
+ * Same as BEGIN_PROFILING, for a function whose name, hash code and
+ * profiling decision are cached in an hp_func_info_t.
+ */
+#define BEGIN_PROFILING_CACHED(entries, info, profile_curr)             \
+  do {                                                                  \
+    profile_curr = (info)->profile;                                     \
     if (profile_curr) {                                                 \
+      HP_PUSH_ENTRY(entries, (info)->name, (info)->hash_code,           \
+                    (info)->symbol_id, (info)->blocking);               \
+    }                                                                   \
+  } while (0)
+
+#define HP_PUSH_ENTRY(entries, symbol, hash, id, is_blocking)           \
+  do {                                                                  \
       hp_entry_t *cur_entry = hp_fast_alloc_hprof_entry();              \
-      (cur_entry)->hash_code = hash_code;                               \
-      (cur_entry)->name_hprof = symbol;                                 \
+      (cur_entry)->hash_code = (hash);                                  \
+      (cur_entry)->symbol_id = (id);                                    \
+      (cur_entry)->blocking  = (is_blocking);                           \
+      (cur_entry)->resume    = 0;                                       \
+      (cur_entry)->name_hprof = (symbol);                               \
       (cur_entry)->prev_hprof = (*(entries));                           \
+      (cur_entry)->calls_start = ++XHPROF_G(call_count);                \
       /* Call the universal callback */                                 \
       hp_mode_common_beginfn((entries), (cur_entry) TSRMLS_CC);         \
       /* Call the mode's beginfn callback */                            \
-      hp_globals.mode_cb.begin_fn_cb((entries), (cur_entry) TSRMLS_CC); \
+      XHPROF_G(mode_cb).begin_fn_cb((entries), (cur_entry) TSRMLS_CC); \
       /* Update entries linked list */                                  \
       (*(entries)) = (cur_entry);                                       \
-    }                                                                   \
   } while (0)
 
 
@@ -387,7 +638,7 @@ void hp_clean_profiler_state(TSRMLS_D) {
       /* NOTE(cjiang): we want to call this 'end_fn_cb' before */       \
       /* 'hp_mode_common_endfn' to avoid including the time in */       \
       /* 'hp_mode_common_endfn' in the profiling results.      */       \
-      hp_globals.mode_cb.end_fn_cb((entries) TSRMLS_CC);                \
+      XHPROF_G(mode_cb).end_fn_cb((entries) TSRMLS_CC);                \
       cur_entry = (*(entries));                                         \
       /* Call the universal callback */                                 \
       hp_mode_common_endfn((entries), (cur_entry) TSRMLS_CC);           \
@@ -397,6 +648,45 @@ void hp_clean_profiler_state(TSRMLS_D) {
     }                                                                   \
   } while (0)
 
+/*
+ * Remember the frame a proxy pushed, for END_PROFILING_FRAME. seq tells it
+ * from a later frame reusing the same hp_entry_t.
+ */
+#define HP_FRAME_SAVE(frame, seq)                                       \
+  do {                                                                  \
+    (frame) = XHPROF_G(entries);                                        \
+    (seq)   = XHPROF_G(call_count);                                     \
+  } while (0)
+
+/*
+ * END_PROFILING for the frame saved with HP_FRAME_SAVE. When it isn't the
+ * top of the stack any more, a bailout skipped the ends of the frames
+ * above it, or closed it already: see hp_end_frame().
+ */
+#define END_PROFILING_FRAME(entries, frame, seq, profile_curr)          \
+  do {                                                                  \
+    if (profile_curr) {                                                 \
+      if (EXPECTED(*(entries) == (frame)                                \
+                   && (frame)->calls_start == (seq))) {                 \
+        END_PROFILING(entries, profile_curr);                           \
+      } else {                                                          \
+        hp_end_frame(entries, frame, seq TSRMLS_CC);                    \
+      }                                                                 \
+    }                                                                   \
+  } while (0)
+
+
+/*
+ * Whether zend_execute_ex() runs a generator again rather than calling it:
+ * the first call runs on the VM stack, resumes run the generator's copy of
+ * the frame.
+ */
+#ifdef ZEND_CALL_GENERATOR
+# define HP_GENERATOR_RESUMED(execute_data)                             \
+  (ZEND_CALL_INFO(execute_data) & ZEND_CALL_GENERATOR)
+#else
+# define HP_GENERATOR_RESUMED(execute_data) 0
+#endif
 
 /**
  * Returns formatted function name
@@ -444,13 +734,14 @@ size_t hp_get_entry_name(hp_entry_t  *entry,
  *
  * @author mpal
  */
-int  hp_ignore_entry_work(uint8 hash_code, char *curr_func) {
+int  hp_ignore_entry_work(uint8 hash_code, char *curr_func, size_t len) {
   int ignore = 0;
   if (hp_ignored_functions_filter_collision(hash_code)) {
     int i = 0;
-    for (; hp_globals.ignored_function_names[i] != NULL; i++) {
-      char *name = hp_globals.ignored_function_names[i];
-      if ( !strcmp(curr_func, name)) {
+    for (; XHPROF_G(ignored_function_names)[i] != NULL; i++) {
+      char *name = XHPROF_G(ignored_function_names)[i];
+      if (XHPROF_G(ignored_function_lens)[i] == len
+          && !memcmp(curr_func, name, len)) {
         ignore++;
         break;
       }
@@ -460,10 +751,11 @@ int  hp_ignore_entry_work(uint8 hash_code, char *curr_func) {
   return ignore;
 }
 
-static inline int  hp_ignore_entry(uint8 hash_code, char *curr_func) {
+static inline int  hp_ignore_entry(uint8 hash_code, char *curr_func,
+                                   size_t len) {
   /* First check if ignoring functions is enabled */
-  return hp_globals.ignored_function_names != NULL &&
-         hp_ignore_entry_work(hash_code, curr_func);
+  return XHPROF_G(ignored_function_names) != NULL &&
+         hp_ignore_entry_work(hash_code, curr_func, len);
 }
 
 /**
@@ -525,9 +817,49 @@ size_t hp_get_function_stack(hp_entry_t *entry,
 }
 
 
+/**
+ * Get the name of a class as reported in function names. Anonymous classes
+ * are named "class@anonymous/dir/file.php:12" (or "Parent@anonymous/..."),
+ * without the NUL byte and per-process suffix of their generated name.
+ *
+ * @param  buf  room for the name of an anonymous class
+ * @return the name
+ */
+static const char *hp_get_class_name(zend_class_entry *ce, char *buf,
+                                     size_t size) {
+  if (ce->type == ZEND_USER_CLASS && (ce->ce_flags & ZEND_ACC_ANON_CLASS)) {
+    snprintf(buf, size, "%s/%s:%u", ZSTR_VAL(ce->name),
+             hp_get_base_filename(ZSTR_VAL(ce->info.user.filename)),
+             ce->info.user.line_start);
+    return buf;
+  }
+  return ZSTR_VAL(ce->name);
+}
+
+/**
+ * Where eval()'d code comes from: its file name is
+ * "/dir/file.php(12) : eval()'d code", which becomes "dir/file.php(12)".
+ *
+ * @param  filename  file name of the eval()'d op_array
+ * @param  buf       where to write the site
+ * @param  size      size of buf
+ */
+static void hp_get_eval_site(const char *filename, char *buf, size_t size) {
+  const char *base = hp_get_base_filename(filename);
+  const char *end  = strstr(base, " : ");
+  size_t      len  = end ? (size_t)(end - base) : strlen(base);
+
+  if (len >= size) {
+    len = size - 1;
+  }
+  memcpy(buf, base, len);
+  buf[len] = 0;
+}
+
 /**
  * Get the name of the current function. The name is qualified with
  * the class name if the function is in a class.
+ * Closures and anonymous classes are named after where they are declared.
  *
  * @author kannan, hzhao
  */
@@ -558,21 +890,38 @@ static char *hp_get_function_name(zend_op_array *ops TSRMLS_DC) {
        * of the object.
        */
      
+      char  cls_buf[SCRATCH_BUF_LEN];
+      char  func_buf[SCRATCH_BUF_LEN];
+      const char *cls_name  = NULL;
+      const char *func_name = ZSTR_VAL(func);
+
       if (curr_func->common.scope) {
         cls = curr_func->common.scope->name;
+        cls_name = hp_get_class_name(curr_func->common.scope, cls_buf,
+                                     sizeof(cls_buf));
+      }
+
+      /* all closures are "{closure}" before PHP 8.4, tell them apart by
+       * where they are declared. Closures made from a function or method
+       * (Closure::fromCallable(), foo(...)) keep its name. */
+      if (curr_func->type == ZEND_USER_FUNCTION
+          && (curr_func->common.fn_flags & ZEND_ACC_CLOSURE)
+          && !strncmp(func_name, "{closure", sizeof("{closure") - 1)) {
+        snprintf(func_buf, sizeof(func_buf), "{closure:%s:%u}",
+                 hp_get_base_filename(ZSTR_VAL(curr_func->op_array.filename)),
+                 curr_func->op_array.line_start);
+        func_name = func_buf;
       }
 
       if ( cls ) {
 
-        len = ZSTR_LEN(cls) + ZSTR_LEN(func)+3;
+        len = strlen(cls_name) + strlen(func_name) + 3;
         ret = (char*)emalloc(len);
-        snprintf(ret, len, "%s::%s", ZSTR_VAL(cls), ZSTR_VAL(func));
+        snprintf(ret, len, "%s::%s", cls_name, func_name);
 
       } else {
 
-        len = ZSTR_LEN(func)+1;
-        ret = (char*)emalloc(len);
-        snprintf(ret, len, "%s", ZSTR_VAL(func));
+        ret = estrdup(func_name);
       }
 
     } else {
@@ -588,12 +937,15 @@ static char *hp_get_function_name(zend_op_array *ops TSRMLS_DC) {
       if (data->prev_execute_data) {
         curr_op = data->prev_execute_data->opline->extended_value;
       } else {
-        curr_op = data->opline->extended_value;
+        /* the main script, when profiling started before it (see
+         * xhprof.sample_requests): name it like a required file */
+        curr_op = ZEND_REQUIRE;
       }
 
       switch (curr_op) {
         case ZEND_EVAL:
           _func = "eval";
+          add_filename = 1;
           break;
         case ZEND_INCLUDE:
           _func = "include";
@@ -620,7 +972,15 @@ static char *hp_get_function_name(zend_op_array *ops TSRMLS_DC) {
        * name to make the reports more useful. So rather than just "include"
        * you'll see something like "run_init::foo.php" in your reports.
        */
-      if (add_filename){
+      if (curr_op == ZEND_EVAL) {
+        char site[SCRATCH_BUF_LEN];
+
+        hp_get_eval_site(ZSTR_VAL(curr_func->op_array.filename), site,
+                         sizeof(site));
+        len = strlen("eval") + strlen(site) + 3;
+        ret = (char *)emalloc(len);
+        snprintf(ret, len, "eval::%s", site);
+      } else if (add_filename){
         const char *filename;
         int   len;
         filename = hp_get_base_filename((curr_func->op_array).filename->val);
@@ -635,103 +995,485 @@ static char *hp_get_function_name(zend_op_array *ops TSRMLS_DC) {
   return ret;
 }
 
+/* Builtins that may wait for I/O, timed on and off the CPU with
+ * XHPROF_FLAGS_IOWAIT: names starting with one of the prefixes, and exact
+ * names. */
+static const char *hp_blocking_prefixes[] = {
+  "stream_", "socket_", "curl_multi_", "mysqli", "PDO", "pg_", "oci_",
+  "sqlsrv_", "Redis::", "Memcached::", "SoapClient::",
+  NULL
+};
+
+static const char *hp_blocking_names[] = {
+  "fopen", "fread", "fwrite", "fgets", "fgetc", "fgetcsv", "fputs",
+  "fputcsv", "fflush", "fpassthru", "flock", "fsockopen", "pfsockopen",
+  "file", "file_get_contents", "file_put_contents", "readfile", "copy",
+  "curl_exec", "gethostbyname", "dns_get_record", "mail", "sleep", "usleep",
+  "time_nanosleep", "exec", "system", "passthru", "shell_exec",
+  "proc_close", "pclose", NULL
+};
+
 /**
- * Free any items in the free list.
+ * Whether a builtin may block on I/O, so that its time off the CPU is
+ * worth measuring. Decided once per function, see hp_get_func_info_ex().
  */
-static void hp_free_the_free_list() {
-  hp_entry_t *p = hp_globals.entry_free_list;
-  hp_entry_t *cur = NULL;
+static int hp_blocking_function(const char *name) {
+  const char **p;
 
-  while (p) {
-    cur = p;
-    p = p->prev_hprof;
-    free(cur);
+  for (p = hp_blocking_prefixes; *p; p++) {
+    if (!strncmp(name, *p, strlen(*p))) {
+      return 1;
+    }
+  }
+  for (p = hp_blocking_names; *p; p++) {
+    if (!strcmp(name, *p)) {
+      return 1;
+    }
   }
+  return 0;
 }
 
 /**
- * Fast allocate a hp_entry_t structure. Picks one from the
- * free list if available, else does an actual allocate.
- *
- * Doesn't bother initializing allocated memory.
+ * Whether a builtin is one of the "spans" functions, and where the
+ * fingerprint of its calls comes from. Decided again for every
+ * xhprof_enable(), see hp_get_func_info_ex().
  *
- * @author kannan
+ * @return an XHPROF_SPAN_* kind
  */
-static hp_entry_t *hp_fast_alloc_hprof_entry() {
-  hp_entry_t *p;
+static uint8 hp_span_kind(const char *name TSRMLS_DC) {
+  char **p;
 
-  p = hp_globals.entry_free_list;
+  for (p = XHPROF_G(span_function_names); p && *p; p++) {
+    size_t len = strlen(*p);
 
-  if (p) {
-    hp_globals.entry_free_list = p->prev_hprof;
-    return p;
-  } else {
-    return (hp_entry_t *)malloc(sizeof(hp_entry_t));
+    if (len > 2 && !strcmp(*p + len - 2, "::")
+        ? !strncasecmp(name, *p, len)
+        : !strcasecmp(name, *p)) {
+      break;
+    }
+  }
+  if (!p || !*p) {
+    return XHPROF_SPAN_NONE;
+  }
+
+  if (!strcasecmp(name, "PDOStatement::execute")) {
+    return XHPROF_SPAN_STMT;
+  }
+  if (!strcasecmp(name, "curl_exec")) {
+    return XHPROF_SPAN_CURL;
   }
+  if (!strcasecmp(name, "file_get_contents") || !strcasecmp(name, "fopen")) {
+    return XHPROF_SPAN_URL;
+  }
+  if (!strncasecmp(name, "PDO", 3) || !strncasecmp(name, "mysqli", 6)
+      || !strncasecmp(name, "pg_", 3) || !strncasecmp(name, "sqlsrv_", 7)
+      || !strncasecmp(name, "oci_", 4)) {
+    return XHPROF_SPAN_SQL;
+  }
+  return XHPROF_SPAN_KEY;
 }
 
 /**
- * Fast free a hp_entry_t structure. Simply returns back
- * the hp_entry_t to a free list and doesn't actually
- * perform the free.
- *
- * @author kannan
+ * CPU time of the calling thread in nanoseconds. Only read around blocking
+ * builtins: it's a system call on some kernels.
  */
-static void hp_fast_free_hprof_entry(hp_entry_t *p) {
+static uint64 hp_thread_cpu_ns() {
+  struct timespec ts;
 
-  /* we use/overload the prev_hprof field in the structure to link entries in
-   * the free list. */
-  p->prev_hprof = hp_globals.entry_free_list;
-  hp_globals.entry_free_list = p;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /**
- * Increment the count of the given stat with the given count
- * If the stat was not set before, inits the stat to the given count
- *
- * @param  zval *counts   Zend hash table pointer
- * @param  char *name     Name of the stat
- * @param  long  count    Value of the stat to incr by
- * @return void
- * @author kannan
+ * Add the time a blocking builtin that just returned spent off the CPU,
+ * its wall time less its thread CPU time, to XHPROF_G(io_wait_us).
  */
-void hp_inc_count(zval *counts, char *name, long count TSRMLS_DC) {
+static void hp_account_io_wait(hp_entry_t *top TSRMLS_DC) {
+  double cpu_freq = XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)];
+  uint64 wall_us  = get_us_from_tsc(cycle_timer() - top->tsc_start, cpu_freq);
+  uint64 cpu_us   = (hp_thread_cpu_ns() - top->cpu_start_ns) / 1000;
 
-  HashTable *ht;
-  zval *data;
+  if (top->cpu_start_ns && wall_us > cpu_us) {
+    XHPROF_G(io_wait_us) += wall_us - cpu_us;
+  }
+}
 
-  if (!counts) return;
+/**
+ * ***************************
+ * PER-FUNCTION CACHE
+ * ***************************
+ */
 
-  ht = Z_ARRVAL_P(counts); 
-  if(zend_hash_str_exists(ht, name, strlen(name))){
-    data = zend_hash_str_find(ht, name, strlen(name));
-    add_assoc_long(counts, name, Z_LVAL_P(data) + count);
-  } else {
-    add_assoc_long(counts, name, count);
+static void hp_func_info_dtor(zval *zv) {
+  hp_func_info_t *info = Z_PTR_P(zv);
+
+  /* Don't leave a dangling pointer in the op_array */
+  if (info->slot) {
+    *info->slot = NULL;
+  }
+  if (info->name) {
+    efree(info->name);
   }
+  efree(info);
 }
 
 /**
- * Looksup the hash table for the given symbol
- * Initializes a new array() if symbol is not present
- *
- * @author kannan, veeve
+ * Free the per-function cache at the end of the request, resetting the
+ * op_array slots that point into it.
  */
-zval * hp_hash_lookup(char *symbol  TSRMLS_DC) {
-  zval *p = (zval*)0;
-  
-  /* Lookup our hash table */
-  HashTable *ht = Z_ARRVAL_P(&hp_globals.stats_count);
-  if(zend_hash_str_exists(ht, symbol, strlen(symbol))){
-      return zend_hash_str_find(ht, symbol, strlen(symbol));
-  } else {
-    zval tmp;
-    array_init(&tmp);
-    if (add_assoc_zval(&hp_globals.stats_count, symbol, &tmp) == SUCCESS){
-      p = zend_hash_str_find(ht, symbol, strlen(symbol));
+static void hp_func_cache_destroy(TSRMLS_D) {
+  if (XHPROF_G(func_cache)) {
+    zend_hash_destroy(XHPROF_G(func_cache));
+    FREE_HASHTABLE(XHPROF_G(func_cache));
+    XHPROF_G(func_cache) = NULL;
+  }
+  if (XHPROF_G(markers)) {
+    zend_hash_destroy(XHPROF_G(markers));
+    FREE_HASHTABLE(XHPROF_G(markers));
+    XHPROF_G(markers) = NULL;
+  }
+  if (XHPROF_G(symbols)) {
+    zend_hash_destroy(XHPROF_G(symbols));
+    FREE_HASHTABLE(XHPROF_G(symbols));
+    XHPROF_G(symbols) = NULL;
+  }
+  if (XHPROF_G(counter_slots)) {
+    efree(XHPROF_G(counter_slots));
+    XHPROF_G(counter_slots)      = NULL;
+    XHPROF_G(counter_slots_size) = 0;
+  }
+}
+
+/**
+ * Get the id of a function name, allocating the next one for a new name.
+ * Ids are only unique within a request; functions sharing a name (such as
+ * all the closures of a class) share the id.
+ */
+static uint32 hp_symbol_id(const char *name, size_t len TSRMLS_DC) {
+  zval   *id;
+  zval    next;
+
+  if (!XHPROF_G(symbols)) {
+    ALLOC_HASHTABLE(XHPROF_G(symbols));
+    zend_hash_init(XHPROF_G(symbols), 64, NULL, NULL, 0);
+  } else if ((id = zend_hash_str_find(XHPROF_G(symbols), name, len))) {
+    return (uint32)Z_LVAL_P(id);
+  }
+
+  ZVAL_LONG(&next, zend_hash_num_elements(XHPROF_G(symbols)) + 1);
+  zend_hash_str_add_new(XHPROF_G(symbols), name, len, &next);
+  return (uint32)Z_LVAL(next);
+}
+
+/**
+ * Find the cached hp_func_info_t of a function, creating it on its first
+ * call. Returns NULL for functions whose identity isn't stable enough to
+ * cache: trampolines (__call and friends) and internal closures.
+ *
+ * User functions keep the pointer in their op_array's reserved slot, so
+ * later calls cost a single load. Closures share one entry per declaration,
+ * keyed by their opcodes, because each closure object carries its own copy
+ * of the op_array. Internal functions and immutable (opcache) op_arrays
+ * are shared with other threads or processes and must not be written to,
+ * they go through the side table.
+ */
+static hp_func_info_t *hp_get_func_info(zend_function *func TSRMLS_DC) {
+  hp_func_info_t *info;
+  void          **slot = NULL;
+  zend_ulong      key;
+
+  if (func->common.fn_flags & ZEND_ACC_CALL_VIA_TRAMPOLINE) {
+    return NULL;
+  }
+
+  if (func->type == ZEND_USER_FUNCTION) {
+    if (func->common.fn_flags & ZEND_ACC_CLOSURE) {
+      key = (zend_ulong)(zend_uintptr_t)func->op_array.opcodes;
+#ifdef ZEND_ACC_IMMUTABLE
+    } else if (func->common.fn_flags & ZEND_ACC_IMMUTABLE) {
+      key = (zend_ulong)(zend_uintptr_t)func;
+#endif
+    } else if (hp_resource_handle >= 0) {
+      slot = &func->op_array.reserved[hp_resource_handle];
+      if (*slot) {
+        return (hp_func_info_t *)*slot;
+      }
+      key = (zend_ulong)(zend_uintptr_t)func;
+    } else {
+      key = (zend_ulong)(zend_uintptr_t)func;
+    }
+  } else if (func->common.fn_flags & ZEND_ACC_CLOSURE) {
+    return NULL;
+  } else {
+    key = (zend_ulong)(zend_uintptr_t)func;
+  }
+
+  if (!XHPROF_G(func_cache)) {
+    ALLOC_HASHTABLE(XHPROF_G(func_cache));
+    zend_hash_init(XHPROF_G(func_cache), 64, NULL, hp_func_info_dtor, 0);
+  } else if ((info = zend_hash_index_find_ptr(XHPROF_G(func_cache), key))) {
+    /* a closure rebound to another class has a different name */
+    return info->scope == (void *)func->common.scope ? info : NULL;
+  }
+
+  info = ecalloc(1, sizeof(hp_func_info_t));
+  info->scope = (void *)func->common.scope;
+  zend_hash_index_add_ptr(XHPROF_G(func_cache), key, info);
+  if (slot) {
+    info->slot = slot;
+    *slot = info;
+  }
+  return info;
+}
+
+/**
+ * Whether a function is a method of Generator, through which a consumer
+ * resumes a generator. They aren't profiled, so that the generator's time
+ * is attributed to the consumer.
+ */
+static int hp_generator_method(zend_function *func) {
+  return func->type == ZEND_INTERNAL_FUNCTION
+         && func->common.scope == zend_ce_generator;
+}
+
+/**
+ * Whether a function opens or closes code regions. They aren't profiled
+ * themselves: the region's frame has to be right above the caller's.
+ */
+static int hp_marker_function(zend_function *func) {
+  void (*handler)(INTERNAL_FUNCTION_PARAMETERS);
+
+  if (func->type != ZEND_INTERNAL_FUNCTION) {
+    return 0;
+  }
+  handler = func->internal_function.handler;
+  return handler == ZEND_FN(xhprof_span_begin)
+         || handler == ZEND_FN(xhprof_span_end)
+         || handler == ZEND_MN(XHProfSpan___construct)
+         || handler == ZEND_MN(XHProfSpan___destruct);
+}
+
+/**
+ * Get the cached hp_func_info_t of the function being called, ready for
+ * BEGIN_PROFILING_CACHED(). Its name, hash code and symbol id are computed
+ * on the first call only; whether to profile it is decided again when the
+ * ignore/allow lists change.
+ *
+ * @param  func  the function being called
+ * @param  ops   its op_array, as passed to hp_get_function_name()
+ * @return the info, or NULL if the function can't be cached
+ */
+static hp_func_info_t *hp_get_func_info_ex(zend_function *func,
+                                           zend_op_array *ops TSRMLS_DC) {
+  hp_func_info_t *info = hp_get_func_info(func TSRMLS_CC);
+
+  if (info && UNEXPECTED(info->filter_gen != XHPROF_G(filter_gen))) {
+    if (!info->name) {
+      info->name = hp_get_function_name(ops TSRMLS_CC);
+      if (!info->name) {
+        return NULL;
+      }
+      info->name_len  = strlen(info->name);
+      info->hash_code = hp_inline_hash_len(info->name, info->name_len);
+      info->symbol_id = hp_symbol_id(info->name, info->name_len TSRMLS_CC);
+      info->blocking  = func->type == ZEND_INTERNAL_FUNCTION
+                        && hp_blocking_function(info->name);
     }
+    info->filter_gen = XHPROF_G(filter_gen);
+    info->profile    = !hp_ignore_entry(info->hash_code, info->name,
+                                        info->name_len)
+                       && hp_allowed_entry(info->name)
+                       && !hp_marker_function(func)
+                       && !hp_generator_method(func);
+    info->span       = func->type == ZEND_INTERNAL_FUNCTION
+                       ? hp_span_kind(info->name TSRMLS_CC)
+                       : XHPROF_SPAN_NONE;
+
+    /* The flags may have changed too, start timing again */
+    info->folded       = 0;
+    info->timed_calls  = 0;
+    info->timed_tsc    = 0;
+    info->folded_calls = 0;
+  }
+  return info;
+}
+
+/**
+ * Find the cached hp_func_info_t of a code region, creating it on its
+ * first use. Regions are profiled like functions named after them.
+ */
+static hp_func_info_t *hp_get_marker_info(zend_string *name TSRMLS_DC) {
+  hp_func_info_t *info;
+
+  if (!XHPROF_G(markers)) {
+    ALLOC_HASHTABLE(XHPROF_G(markers));
+    zend_hash_init(XHPROF_G(markers), 8, NULL, hp_func_info_dtor, 0);
+    info = NULL;
+  } else {
+    info = zend_hash_find_ptr(XHPROF_G(markers), name);
+  }
+
+  if (!info) {
+    info = ecalloc(1, sizeof(hp_func_info_t));
+    info->name       = estrndup(ZSTR_VAL(name), ZSTR_LEN(name));
+    info->name_len   = ZSTR_LEN(name);
+    info->hash_code  = hp_inline_hash_len(info->name, info->name_len);
+    info->symbol_id  = hp_symbol_id(info->name, info->name_len TSRMLS_CC);
+    info->filter_gen = XHPROF_G(filter_gen) - 1;
+    zend_hash_add_ptr(XHPROF_G(markers), name, info);
+  }
+
+  if (UNEXPECTED(info->filter_gen != XHPROF_G(filter_gen))) {
+    info->filter_gen = XHPROF_G(filter_gen);
+    info->profile    = !hp_ignore_entry(info->hash_code, info->name,
+                                        info->name_len)
+                       && hp_allowed_entry(info->name);
+  }
+  return info;
+}
+
+/**
+ * Account one timed call of a builtin for XHPROF_FLAGS_ADAPTIVE. At the end
+ * of each window the builtin is folded into its callers if it took less on
+ * average than profiling it costs, or than xhprof.adaptive_threshold_us.
+ *
+ * @param  info  the builtin's cached info
+ * @param  tsc   TSC ticks spent in the builtin itself
+ */
+static void hp_adaptive_account(hp_func_info_t *info, uint64 tsc TSRMLS_DC) {
+  uint64 limit;
+
+  info->timed_tsc += tsc;
+  if (++info->timed_calls < XHPROF_ADAPTIVE_WINDOW) {
+    return;
+  }
+
+  limit = XHPROF_G(adaptive_tsc) ? XHPROF_G(adaptive_tsc)
+                                 : hp_call_overhead_tsc(TSRMLS_C);
+  info->folded = info->timed_tsc < XHPROF_ADAPTIVE_WINDOW * limit;
+  info->timed_calls = 0;
+  info->timed_tsc   = 0;
+}
+
+/**
+ * Free any items in the free list starting at p.
+ */
+static void hp_free_the_free_list(hp_entry_t *p) {
+  hp_entry_t *cur = NULL;
+
+  while (p) {
+    cur = p;
+    p = p->prev_hprof;
+    free(cur);
+  }
+}
+
+/**
+ * Fast allocate a hp_entry_t structure. Picks one from the
+ * free list if available, else does an actual allocate.
+ *
+ * Doesn't bother initializing allocated memory.
+ *
+ * @author kannan
+ */
+static hp_entry_t *hp_fast_alloc_hprof_entry() {
+  hp_entry_t *p;
+
+  p = XHPROF_G(entry_free_list);
+
+  if (p) {
+    XHPROF_G(entry_free_list) = p->prev_hprof;
     return p;
+  } else {
+    return (hp_entry_t *)malloc(sizeof(hp_entry_t));
+  }
+}
+
+/**
+ * Fast free a hp_entry_t structure. Simply returns back
+ * the hp_entry_t to a free list and doesn't actually
+ * perform the free.
+ *
+ * @author kannan
+ */
+static void hp_fast_free_hprof_entry(hp_entry_t *p) {
+
+  /* we use/overload the prev_hprof field in the structure to link entries in
+   * the free list. */
+  p->prev_hprof = XHPROF_G(entry_free_list);
+  XHPROF_G(entry_free_list) = p;
+}
+
+/**
+ * Increment the count of the given stat with the given count
+ * If the stat was not set before, inits the stat to the given count
+ *
+ * @param  zval *counts   Zend hash table pointer
+ * @param  char *name     Name of the stat
+ * @param  long  count    Value of the stat to incr by
+ * @return void
+ * @author kannan
+ */
+void hp_inc_count(zval *counts, char *name, long count TSRMLS_DC) {
+
+  HashTable *ht;
+  zval *data;
+
+  if (!counts) return;
+
+  ht = Z_ARRVAL_P(counts); 
+  if(zend_hash_str_exists(ht, name, strlen(name))){
+    data = zend_hash_str_find(ht, name, strlen(name));
+    add_assoc_long(counts, name, Z_LVAL_P(data) + count);
+  } else {
+    add_assoc_long(counts, name, count);
+  }
+}
+
+/**
+ * Whether stats_count is at one of its caps, and can't take a new key of
+ * the given length.
+ */
+static int hp_stats_full(size_t len, zend_long max_entries TSRMLS_DC) {
+  return (max_entries > 0
+          && zend_hash_num_elements(Z_ARRVAL(XHPROF_G(stats_count)))
+             >= (uint32_t)max_entries)
+      || (XHPROF_G(max_key_bytes) > 0
+          && XHPROF_G(stats_bytes) + (zend_long)len > XHPROF_G(max_key_bytes));
+}
+
+/**
+ * Looksup the hash table for the given symbol
+ * Initializes a new array() if symbol is not present
+ *
+ * Once the profile is at xhprof.max_edges or xhprof.max_key_bytes, new
+ * symbols get the OTHER_SYMBOL entry instead, so its ct counts the calls
+ * that were folded. The root and pseudo entries like OVERHEAD_SYMBOL are
+ * few and always get their own.
+ *
+ * @author kannan, veeve
+ */
+zval * hp_hash_lookup(char *symbol  TSRMLS_DC) {
+  zval   *p;
+  size_t  len = strlen(symbol);
+
+  /* Lookup our hash table */
+  HashTable *ht = Z_ARRVAL_P(&XHPROF_G(stats_count));
+  if ((p = zend_hash_str_find(ht, symbol, len)) == NULL) {
+    zval tmp;
+
+    if (symbol[0] != '(' && strcmp(symbol, ROOT_SYMBOL)
+        && hp_stats_full(len, XHPROF_G(max_edges) TSRMLS_CC)) {
+      return hp_hash_lookup(OTHER_SYMBOL TSRMLS_CC);
+    }
+
+    array_init(&tmp);
+    p = zend_hash_str_update(ht, symbol, len, &tmp);
+    XHPROF_G(stats_bytes) += len;
   }
+  return p;
 }
 
 /**
@@ -743,14 +1485,15 @@ zval * hp_hash_lookup(char *symbol  TSRMLS_DC) {
  * @author veeve
  */
 void hp_sample_stack(hp_entry_t  **entries  TSRMLS_DC) {
-  char key[SCRATCH_BUF_LEN];
-  char symbol[SCRATCH_BUF_LEN * 1000];
+  char   key[SCRATCH_BUF_LEN];
+  char   symbol[SCRATCH_BUF_LEN * 1000];
+  size_t len;
 
   /* Build key */
   snprintf(key, sizeof(key),
            "%d.%06d",
-           hp_globals.last_sample_time.tv_sec,
-           hp_globals.last_sample_time.tv_usec);
+           XHPROF_G(last_sample_time).tv_sec,
+           XHPROF_G(last_sample_time).tv_usec);
 
   /* Init stats in the global stats_count hashtable */
   hp_get_function_stack(*entries,
@@ -758,9 +1501,21 @@ void hp_sample_stack(hp_entry_t  **entries  TSRMLS_DC) {
                         symbol,
                         sizeof(symbol));
 
-  add_assoc_string(&hp_globals.stats_count,
+  /* Past xhprof.max_samples or xhprof.max_key_bytes, only count them */
+  len = strlen(key) + strlen(symbol);
+  if (hp_stats_full(len, XHPROF_G(max_samples) TSRMLS_CC)) {
+    zval *dropped = zend_hash_str_find(Z_ARRVAL(XHPROF_G(stats_count)),
+                                       OTHER_SYMBOL, strlen(OTHER_SYMBOL));
+
+    add_assoc_long(&XHPROF_G(stats_count), OTHER_SYMBOL,
+                   (dropped ? zval_get_long(dropped) : 0) + 1);
+    return;
+  }
+
+  add_assoc_string(&XHPROF_G(stats_count),
                    key,
                    symbol);
+  XHPROF_G(stats_bytes) += len;
   return;
 }
 
@@ -782,14 +1537,14 @@ void hp_sample_check(hp_entry_t **entries  TSRMLS_DC) {
 
   /* See if its time to sample.  While loop is to handle a single function
    * taking a long time and passing several sampling intervals. */
-  while ((cycle_timer() - hp_globals.last_sample_tsc)
-         > hp_globals.sampling_interval_tsc) {
+  while ((cycle_timer() - XHPROF_G(last_sample_tsc))
+         > XHPROF_G(sampling_interval_tsc)) {
 
     /* bump last_sample_tsc */
-    hp_globals.last_sample_tsc += hp_globals.sampling_interval_tsc;
+    XHPROF_G(last_sample_tsc) += XHPROF_G(sampling_interval_tsc);
 
     /* bump last_sample_time - HAS TO BE UPDATED BEFORE calling hp_sample_stack */
-    incr_us_interval(&hp_globals.last_sample_time, XHPROF_SAMPLING_INTERVAL);
+    incr_us_interval(&XHPROF_G(last_sample_time), XHPROF_SAMPLING_INTERVAL);
 
     /* sample the stack */
     hp_sample_stack(entries  TSRMLS_CC);
@@ -822,7 +1577,7 @@ int bind_to_cpu(uint32 cpu_id) {
   }
 
   /* record the cpu_id the process is bound to. */
-  hp_globals.cur_cpu_id = cpu_id;
+  XHPROF_G(cur_cpu_id) = cpu_id;
 
   return 0;
 }
@@ -837,13 +1592,13 @@ static void get_all_cpu_frequencies() {
   int id;
   double frequency;
 
-  hp_globals.cpu_frequencies = malloc(sizeof(double) * hp_globals.cpu_num);
-  if (hp_globals.cpu_frequencies == NULL) {
+  XHPROF_G(cpu_frequencies) = malloc(sizeof(double) * XHPROF_G(cpu_num));
+  if (XHPROF_G(cpu_frequencies) == NULL) {
     return;
   }
 
   /* Iterate over all cpus found on the machine. */
-  for (id = 0; id < hp_globals.cpu_num; ++id) {
+  for (id = 0; id < XHPROF_G(cpu_num); ++id) {
     /* Only get the previous cpu affinity mask for the first call. */
     if (bind_to_cpu(id)) {
       clear_frequencies();
@@ -859,8 +1614,27 @@ static void get_all_cpu_frequencies() {
       clear_frequencies();
       return;
     }
-    hp_globals.cpu_frequencies[id] = frequency;
+    XHPROF_G(cpu_frequencies)[id] = frequency;
+  }
+}
+
+/**
+ * Save the current thread's cpu affinity mask. It returns 0 on success and -1
+ * on failure.
+ *
+ * @param cpu_set_t * prev_mask, where to store the current mask.
+ * @return int, 0 on success, and -1 on failure.
+ */
+int save_cpu_affinity(cpu_set_t * prev_mask) {
+#ifndef __APPLE__
+  if (GET_AFFINITY(0, sizeof(cpu_set_t), prev_mask) < 0) {
+    perror("getaffinity");
+    return -1;
   }
+#else
+  CPU_ZERO(prev_mask);
+#endif
+  return 0;
 }
 
 /**
@@ -880,7 +1654,7 @@ int restore_cpu_affinity(cpu_set_t * prev_mask) {
   }
 
   /* default value ofor cur_cpu_id is 0. */
-  hp_globals.cur_cpu_id = 0;
+  XHPROF_G(cur_cpu_id) = 0;
   return 0;
 }
 
@@ -891,12 +1665,12 @@ int restore_cpu_affinity(cpu_set_t * prev_mask) {
  */
 static void clear_frequencies() {
 
-  if (hp_globals.cpu_frequencies) {
-    free(hp_globals.cpu_frequencies);
-    hp_globals.cpu_frequencies = NULL;
+  if (XHPROF_G(cpu_frequencies)) {
+    free(XHPROF_G(cpu_frequencies));
+    XHPROF_G(cpu_frequencies) = NULL;
   }
 
-  restore_cpu_affinity(&hp_globals.prev_mask);
+  restore_cpu_affinity(&XHPROF_G(prev_mask));
 }
 
 
@@ -940,20 +1714,27 @@ void hp_mode_common_beginfn(hp_entry_t **entries,
   /* This symbol's recursive level */
   int    recurse_level = 0;
 
-  if (hp_globals.func_hash_counters[current->hash_code] > 0) {
+  if (XHPROF_G(func_hash_counters)[current->hash_code] > 0) {
     /* Find this symbols recurse level */
     for(p = (*entries); p; p = p->prev_hprof) {
-      if (!strcmp(current->name_hprof, p->name_hprof)) {
+      /* Symbol ids are unique per name, compare names when one is unknown */
+      if (current->symbol_id && p->symbol_id
+          ? current->symbol_id == p->symbol_id
+          : p->hash_code == current->hash_code
+            && !strcmp(current->name_hprof, p->name_hprof)) {
         recurse_level = (p->rlvl_hprof) + 1;
         break;
       }
     }
   }
-  hp_globals.func_hash_counters[current->hash_code]++;
+  XHPROF_G(func_hash_counters)[current->hash_code]++;
 
   /* Init current function's recurse level */
   current->rlvl_hprof = recurse_level;
 
+  /* Nothing suspended yet */
+  current->suspended_tsc = 0;
+
 }
 
 /**
@@ -965,7 +1746,7 @@ void hp_mode_common_beginfn(hp_entry_t **entries,
  * @author kannan, veeve
  */
 void hp_mode_common_endfn(hp_entry_t **entries, hp_entry_t *current TSRMLS_DC) {
-  hp_globals.func_hash_counters[current->hash_code]--;
+  XHPROF_G(func_hash_counters)[current->hash_code]--;
 }
 
 
@@ -984,31 +1765,212 @@ void hp_mode_sampled_init_cb(TSRMLS_D) {
   struct timeval  now;
   uint64 truncated_us;
   uint64 truncated_tsc;
-  double cpu_freq = hp_globals.cpu_frequencies[hp_globals.cur_cpu_id];
+  double cpu_freq = XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)];
 
   /* Init the last_sample in tsc */
-  hp_globals.last_sample_tsc = cycle_timer();
+  XHPROF_G(last_sample_tsc) = cycle_timer();
 
   /* Find the microseconds that need to be truncated */
-  gettimeofday(&hp_globals.last_sample_time, 0);
-  now = hp_globals.last_sample_time;
-  hp_trunc_time(&hp_globals.last_sample_time, XHPROF_SAMPLING_INTERVAL);
+  gettimeofday(&XHPROF_G(last_sample_time), 0);
+  now = XHPROF_G(last_sample_time);
+  hp_trunc_time(&XHPROF_G(last_sample_time), XHPROF_SAMPLING_INTERVAL);
 
   /* Subtract truncated time from last_sample_tsc */
-  truncated_us  = get_us_interval(&hp_globals.last_sample_time, &now);
+  truncated_us  = get_us_interval(&XHPROF_G(last_sample_time), &now);
   truncated_tsc = get_tsc_from_us(truncated_us, cpu_freq);
-  if (hp_globals.last_sample_tsc > truncated_tsc) {
+  if (XHPROF_G(last_sample_tsc) > truncated_tsc) {
     /* just to be safe while subtracting unsigned ints */
-    hp_globals.last_sample_tsc -= truncated_tsc;
+    XHPROF_G(last_sample_tsc) -= truncated_tsc;
   }
 
   /* Convert sampling interval to ticks */
-  hp_globals.sampling_interval_tsc =
+  XHPROF_G(sampling_interval_tsc) =
     get_tsc_from_us(XHPROF_SAMPLING_INTERVAL, cpu_freq);
 
 }
 
 
+/**
+ * ****************************
+ * XHPROF CALL SAMPLING
+ * ****************************
+ */
+
+static void hp_edge_dtor(zval *zv) {
+  hp_edge_t *edge = Z_PTR_P(zv);
+
+  if (edge->symbol) {
+    efree(edge->symbol);
+  }
+  efree(edge);
+}
+
+/**
+ * Find the edge from current's caller to current, creating it on its first
+ * call. Returns NULL if either end has no symbol id or the ids and
+ * recursion levels don't fit in the key; such calls are always timed.
+ */
+static hp_edge_t *hp_sampled_edge(hp_entry_t *current TSRMLS_DC) {
+  hp_entry_t *parent = current->prev_hprof;
+  hp_edge_t  *edge;
+  zend_ulong  key;
+
+  if (sizeof(zend_ulong) < 8
+      || !parent || !parent->symbol_id || !current->symbol_id
+      || parent->symbol_id  >> XHPROF_EDGE_ID_BITS
+      || current->symbol_id >> XHPROF_EDGE_ID_BITS
+      || parent->rlvl_hprof  >> XHPROF_EDGE_RLVL_BITS
+      || current->rlvl_hprof >> XHPROF_EDGE_RLVL_BITS) {
+    return NULL;
+  }
+
+  key = (((((zend_ulong)parent->symbol_id << XHPROF_EDGE_RLVL_BITS)
+           | parent->rlvl_hprof) << XHPROF_EDGE_ID_BITS
+          | current->symbol_id) << XHPROF_EDGE_RLVL_BITS)
+        | current->rlvl_hprof;
+
+  if (!XHPROF_G(sampled_edges)) {
+    ALLOC_HASHTABLE(XHPROF_G(sampled_edges));
+    zend_hash_init(XHPROF_G(sampled_edges), 64, NULL, hp_edge_dtor, 0);
+  } else if ((edge = zend_hash_index_find_ptr(XHPROF_G(sampled_edges),
+                                              key))) {
+    return edge;
+  }
+
+  edge = ecalloc(1, sizeof(hp_edge_t));
+  edge->countdown = 1;
+  zend_hash_index_add_ptr(XHPROF_G(sampled_edges), key, edge);
+  return edge;
+}
+
+/**
+ * Decide if current is one of the calls to time, counting it on its edge.
+ *
+ * @return 1 if the call is to be timed
+ */
+static inline int hp_sample_call(hp_entry_t *current TSRMLS_DC) {
+  hp_edge_t *edge = hp_sampled_edge(current TSRMLS_CC);
+
+  current->edge    = edge;
+  current->untimed = 0;
+  if (!edge) {
+    return 1;
+  }
+
+  edge->ct++;
+  if (--edge->countdown) {
+    current->untimed = 1;
+    return 0;
+  }
+  edge->countdown = XHPROF_G(call_sample_rate);
+  return 1;
+}
+
+/**
+ * Record the wall time of a timed call of a sampled edge.
+ */
+static void hp_sampled_edge_timed(hp_edge_t *edge, char *symbol,
+                                  double wt) {
+  if (!edge->symbol) {
+    edge->symbol = estrdup(symbol);
+  }
+  edge->timed++;
+  edge->wt_sum += wt;
+  edge->wt_sq  += wt * wt;
+}
+
+static void hp_scale_count(zval *counts, char *name, double scale) {
+  zval *data = zend_hash_str_find(Z_ARRVAL_P(counts), name, strlen(name));
+
+  if (data) {
+    add_assoc_long(counts, name, (long)floor(Z_LVAL_P(data) * scale + 0.5));
+  }
+}
+
+/**
+ * Turn the timed calls of each sampled edge into estimates for all its
+ * calls: ct becomes the exact call count and the other metrics are scaled
+ * by ct/sct, where sct is the number of timed calls. wt_se is the standard
+ * error of the wt estimate, in microseconds.
+ */
+static void hp_sampled_edges_finish(TSRMLS_D) {
+  hp_edge_t *edge;
+  zval      *counts;
+
+  if (!XHPROF_G(sampled_edges)) {
+    return;
+  }
+
+  ZEND_HASH_FOREACH_PTR(XHPROF_G(sampled_edges), edge) {
+    double n, scale, mean, var, se;
+
+    /* Nothing to scale, and never fewer calls than timed ones: see
+     * hp_sampled_edges_reset() */
+    if (!edge->symbol || edge->timed >= edge->ct
+        || !(counts = zend_hash_str_find(Z_ARRVAL(XHPROF_G(stats_count)),
+                                         edge->symbol,
+                                         strlen(edge->symbol)))) {
+      continue;
+    }
+
+    n     = (double)edge->timed;
+    scale = (double)edge->ct / n;
+    hp_scale_count(counts, "wt", scale);
+    hp_scale_count(counts, "swt", scale);
+    hp_scale_count(counts, "ex", scale);
+    hp_scale_count(counts, "exwt", scale);
+    hp_scale_count(counts, "cpu", scale);
+    hp_scale_count(counts, "io", scale);
+    hp_scale_count(counts, "mu", scale);
+    hp_scale_count(counts, "pmu", scale);
+
+    /* Sampling without replacement from the edge's ct calls */
+    mean = edge->wt_sum / n;
+    var  = n > 1 ? (edge->wt_sq - n * mean * mean) / (n - 1) : 0;
+    se   = edge->ct * sqrt((var > 0 ? var : 0) / n * (1 - n / edge->ct));
+
+    add_assoc_long(counts, "ct", (long)edge->ct);
+    add_assoc_long(counts, "sct", (long)edge->timed);
+    add_assoc_long(counts, "wt_se", (long)floor(se + 0.5));
+  } ZEND_HASH_FOREACH_END();
+}
+
+/**
+ * Start counting the sampled edges from zero, keeping their place in the
+ * 1 in N cycle. A timed call still running counted its call already but
+ * adds its time after the reset, so it is counted again in the new window.
+ */
+static void hp_sampled_edges_reset(TSRMLS_D) {
+  hp_edge_t  *edge;
+  hp_entry_t *p;
+
+  if (!XHPROF_G(sampled_edges)) {
+    return;
+  }
+
+  ZEND_HASH_FOREACH_PTR(XHPROF_G(sampled_edges), edge) {
+    edge->ct     = 0;
+    edge->timed  = 0;
+    edge->wt_sum = 0;
+    edge->wt_sq  = 0;
+  } ZEND_HASH_FOREACH_END();
+
+  for (p = XHPROF_G(entries); p; p = p->prev_hprof) {
+    if (p->edge && !p->untimed) {
+      p->edge->ct++;
+    }
+  }
+}
+
+static void hp_sampled_edges_destroy(TSRMLS_D) {
+  if (XHPROF_G(sampled_edges)) {
+    zend_hash_destroy(XHPROF_G(sampled_edges));
+    FREE_HASHTABLE(XHPROF_G(sampled_edges));
+    XHPROF_G(sampled_edges) = NULL;
+  }
+}
+
+
 /**
  * ************************************
  * XHPROF BEGIN FUNCTION CALLBACKS
@@ -1022,16 +1984,34 @@ void hp_mode_sampled_init_cb(TSRMLS_D) {
  */
 void hp_mode_hier_beginfn_cb(hp_entry_t **entries,
                              hp_entry_t  *current  TSRMLS_DC) {
+  /* Only count the calls that call sampling doesn't time */
+  if (XHPROF_G(call_sample_rate) > 1) {
+    if (!hp_sample_call(current TSRMLS_CC)) {
+      return;
+    }
+  } else {
+    current->edge    = NULL;
+    current->untimed = 0;
+  }
+
   /* Get start tsc counter */
   current->tsc_start = cycle_timer();
 
   /* Get CPU usage */
-  if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_CPU) {
     getrusage(RUSAGE_SELF, &(current->ru_start_hprof));
   }
 
+  /* Off-CPU time: what callees spend waiting, and this call if it may */
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_IOWAIT) {
+    current->io_start = XHPROF_G(io_wait_us);
+    if (current->blocking) {
+      current->cpu_start_ns = hp_thread_cpu_ns();
+    }
+  }
+
   /* Get memory usage */
-  if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_MEMORY) {
     current->mu_start_hprof  = zend_memory_usage(0 TSRMLS_CC);
     current->pmu_start_hprof = zend_memory_peak_usage(0 TSRMLS_CC);
   }
@@ -1064,23 +2044,211 @@ void hp_mode_sampled_beginfn_cb(hp_entry_t **entries,
 zval * hp_mode_shared_endfn_cb(hp_entry_t *top, char *symbol  TSRMLS_DC) {
   zval    *counts;
   uint64   tsc_end;
+  uint64   tsc_wt;
 
   /* Get end tsc counter */
   tsc_end = cycle_timer();
+  tsc_wt  = tsc_end - top->tsc_start;
+
+  /* Take out the profiler's own cost for every call made below this one */
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_COMPENSATE) {
+    uint64 tsc_overhead = (XHPROF_G(call_count) - top->calls_start)
+                          * hp_call_overhead_tsc(TSRMLS_C);
+    tsc_wt = tsc_wt > tsc_overhead ? tsc_wt - tsc_overhead : 0;
+  }
+
+  /* Let the proxy flush once the call is over, see hp_flush_schedule() */
+  if (XHPROF_G(flush_deadline_tsc) && tsc_end >= XHPROF_G(flush_deadline_tsc)) {
+    XHPROF_G(flush_due) = 1;
+  }
 
   /* Get the stat array */
   if (!(counts = hp_hash_lookup(symbol TSRMLS_CC))) {
     return (zval *) 0;
   }
 
-  /* Bump stats in the counts hashtable */
-  hp_inc_count(counts, "ct", 1  TSRMLS_CC);
+  /* Calls that ended by throwing, or letting through, an exception, or
+   * cut short by a fatal error, and how long they ran until then */
+  if (UNEXPECTED(XHPROF_G(unwinding) || hp_exception_pending(TSRMLS_C))) {
+    hp_inc_count(counts, "ex", 1  TSRMLS_CC);
+    hp_inc_count(counts, "exwt", get_us_from_tsc(tsc_wt,
+          XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]) TSRMLS_CC);
+  }
 
-  hp_inc_count(counts, "wt", get_us_from_tsc(tsc_end - top->tsc_start,
-        hp_globals.cpu_frequencies[hp_globals.cur_cpu_id]) TSRMLS_CC);
+  /* Bump stats in the counts hashtable. Resuming a generator (until its
+   * next yield) isn't a call, it is counted in "rs". */
+  if (UNEXPECTED(top->resume)) {
+    hp_inc_count(counts, "ct", 0  TSRMLS_CC);
+    hp_inc_count(counts, "rs", 1  TSRMLS_CC);
+  } else {
+    hp_inc_count(counts, "ct", 1  TSRMLS_CC);
+  }
 
-  return counts;
-}
+  hp_inc_count(counts, "wt", get_us_from_tsc(tsc_wt,
+        XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]) TSRMLS_CC);
+
+  if (top->edge) {
+    hp_sampled_edge_timed(top->edge, symbol, get_us_from_tsc(tsc_wt,
+          XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]));
+  }
+
+  /* Time the frame's fiber spent suspended, already excluded from wt */
+  if (top->suspended_tsc) {
+    hp_inc_count(counts, "swt", get_us_from_tsc(top->suspended_tsc,
+          XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]) TSRMLS_CC);
+  }
+
+  return counts;
+}
+
+/**
+ * ******************************
+ * XHPROF OVERHEAD MEASUREMENT
+ * ******************************
+ */
+
+/**
+ * The calibrated per-call overhead for the current flags.
+ */
+static inline uint64 hp_call_overhead_tsc(TSRMLS_D) {
+  return XHPROF_G(call_overhead_tsc)[(XHPROF_G(xhprof_flags) >> 1) & 3];
+}
+
+/**
+ * Switch to a scratch stats table and profile stack, so that fictitious calls
+ * can be profiled without showing up in the profile. The real state is
+ * saved in *saved and put back by hp_scratch_leave().
+ */
+static void hp_scratch_enter(hp_scratch_t *saved TSRMLS_DC) {
+  int hp_profile_flag = 1;
+
+  saved->stats_count = XHPROF_G(stats_count);
+  saved->entries     = XHPROF_G(entries);
+  saved->call_count  = XHPROF_G(call_count);
+  saved->stats_bytes = XHPROF_G(stats_bytes);
+  array_init(&XHPROF_G(stats_count));
+  XHPROF_G(entries) = NULL;
+
+  BEGIN_PROFILING(&XHPROF_G(entries), ROOT_SYMBOL, hp_profile_flag);
+}
+
+static void hp_scratch_leave(hp_scratch_t *saved TSRMLS_DC) {
+  int hp_profile_flag = 1;
+
+  while (XHPROF_G(entries)) {
+    END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+  }
+
+  zval_dtor(&XHPROF_G(stats_count));
+  XHPROF_G(stats_count) = saved->stats_count;
+  XHPROF_G(entries)     = saved->entries;
+  XHPROF_G(call_count)  = saved->call_count;
+  XHPROF_G(stats_bytes) = saved->stats_bytes;
+}
+
+/**
+ * Profile the given number of fictitious calls the way hp_execute_ex()
+ * does for a function whose hp_func_info_t is cached.
+ * Must be called between hp_scratch_enter() and hp_scratch_leave().
+ */
+static void hp_scratch_calls(int calls TSRMLS_DC) {
+  hp_func_info_t  info;
+  hp_func_info_t *cached = &info;
+  int             i;
+
+  memset(&info, 0, sizeof(info));
+  info.name      = XHPROF_CALIBRATION_SYMBOL;
+  info.hash_code = hp_inline_hash(info.name);
+  info.profile   = 1;
+
+  for (i = 0; i < calls; i++) {
+    int hp_profile_flag = 1;
+
+    BEGIN_PROFILING_CACHED(&XHPROF_G(entries), cached, hp_profile_flag);
+    END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+  }
+}
+
+/**
+ * Measure what the profiler costs per intercepted call with the current mode
+ * and flags. The result only depends on the flags, so it is measured once
+ * per thread for each CPU/MEMORY combination.
+ */
+static void hp_calibrate_overhead(TSRMLS_D) {
+  uint64       *slot = &XHPROF_G(call_overhead_tsc)[(XHPROF_G(xhprof_flags) >> 1) & 3];
+  hp_scratch_t  saved;
+  uint64        best = 0;
+  uint64        start, elapsed;
+  int           batch;
+
+  if (*slot) {
+    return;
+  }
+
+  hp_scratch_enter(&saved TSRMLS_CC);
+  for (batch = 0; batch < XHPROF_CALIBRATION_BATCHES; batch++) {
+    start = cycle_timer();
+    hp_scratch_calls(XHPROF_CALIBRATION_CALLS TSRMLS_CC);
+    elapsed = cycle_timer() - start;
+    if (!best || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  hp_scratch_leave(&saved TSRMLS_CC);
+
+  *slot = best / XHPROF_CALIBRATION_CALLS;
+  if (!*slot) {
+    *slot = 1;
+  }
+}
+
+/**
+ * Add the OVERHEAD_SYMBOL pseudo entry to the profile: the number of
+ * intercepted calls since xhprof_enable() or the last flush (ct), the
+ * estimated profiler overhead of those (wt) and the calibrated cost of one
+ * call (cal_ns).
+ */
+static void hp_add_overhead_entry(TSRMLS_D) {
+  zval   *counts;
+  uint64  per_call = hp_call_overhead_tsc(TSRMLS_C);
+  double  cpu_freq = XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)];
+  uint64  calls    = XHPROF_G(call_count) - XHPROF_G(flush_call_count);
+
+  if (!(counts = hp_hash_lookup(OVERHEAD_SYMBOL TSRMLS_CC))) {
+    return;
+  }
+
+  hp_inc_count(counts, "ct", calls TSRMLS_CC);
+  hp_inc_count(counts, "wt",
+               get_us_from_tsc(calls * per_call, cpu_freq) TSRMLS_CC);
+  hp_inc_count(counts, "cal_ns",
+               get_us_from_tsc(per_call * 1000, cpu_freq) TSRMLS_CC);
+}
+
+/**
+ * Report the calls of builtins folded by XHPROF_FLAGS_ADAPTIVE as
+ * "(folded)==>name" entries. They only have a call count; their time is
+ * part of their callers' exclusive time.
+ */
+static void hp_add_folded_entries(TSRMLS_D) {
+  hp_func_info_t *info;
+  zval           *counts;
+  char            symbol[SCRATCH_BUF_LEN];
+
+  if (!XHPROF_G(func_cache)) {
+    return;
+  }
+
+  ZEND_HASH_FOREACH_PTR(XHPROF_G(func_cache), info) {
+    if (info->folded_calls) {
+      snprintf(symbol, sizeof(symbol), "%s==>%s", FOLDED_SYMBOL, info->name);
+      if ((counts = hp_hash_lookup(symbol TSRMLS_CC))) {
+        hp_inc_count(counts, "ct", info->folded_calls TSRMLS_CC);
+      }
+      info->folded_calls = 0;
+    }
+  } ZEND_HASH_FOREACH_END();
+}
 
 /**
  * XHPROF_MODE_HIERARCHICAL's end function callback
@@ -1099,13 +2267,18 @@ void hp_mode_hier_endfn_cb(hp_entry_t **entries  TSRMLS_DC) {
   long int         pmu_end;
   
 
+  /* Counted on its edge already, see hp_sample_call() */
+  if (top->untimed) {
+    return;
+  }
+
   /* Get the stat array */
   hp_get_function_stack(top, 2, symbol, sizeof(symbol));
   if (!(counts = hp_mode_shared_endfn_cb(top,  symbol  TSRMLS_CC))) {
     return;
   }
 
-  if (hp_globals.xhprof_flags & XHPROF_FLAGS_CPU) {
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_CPU) {
     /* Get CPU usage */
     getrusage(RUSAGE_SELF, &ru_end);
 
@@ -1117,7 +2290,15 @@ void hp_mode_hier_endfn_cb(hp_entry_t **entries  TSRMLS_DC) {
               TSRMLS_CC);
   }
 
-  if (hp_globals.xhprof_flags & XHPROF_FLAGS_MEMORY) {
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_IOWAIT) {
+    if (top->blocking) {
+      hp_account_io_wait(top TSRMLS_CC);
+    }
+    hp_inc_count(counts, "io", XHPROF_G(io_wait_us) - top->io_start
+                 TSRMLS_CC);
+  }
+
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_MEMORY) {
     /* Get Memory usage */
     mu_end  = zend_memory_usage(0 TSRMLS_CC);
     pmu_end = zend_memory_peak_usage(0 TSRMLS_CC);
@@ -1154,21 +2335,55 @@ void hp_mode_sampled_endfn_cb(hp_entry_t **entries  TSRMLS_DC) {
  */
 ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
 
-  zend_op_array *ops  = &execute_data->func->op_array;
-  char          *func = NULL;
+  zend_op_array  *ops  = &execute_data->func->op_array;
+  char           *func = NULL;
+  hp_func_info_t *info = NULL;
+  hp_entry_t     *frame;
+  uint64          seq;
   int hp_profile_flag = 1;
 
+  if (!XHPROF_G(enabled)) {
+    _zend_execute_ex(execute_data TSRMLS_CC);
+    return;
+  }
+
+  /* Functions with a cached name and decision skip the work below */
+  if (ops->function_name) {
+    info = hp_get_func_info_ex(execute_data->func, ops TSRMLS_CC);
+  }
+  if (info) {
+    BEGIN_PROFILING_CACHED(&XHPROF_G(entries), info, hp_profile_flag);
+    HP_FRAME_SAVE(frame, seq);
+    if (UNEXPECTED(ops->fn_flags & ZEND_ACC_GENERATOR) && hp_profile_flag
+        && HP_GENERATOR_RESUMED(execute_data)) {
+      XHPROF_G(entries)->resume = 1;
+    }
+    _zend_execute_ex(execute_data TSRMLS_CC);
+    END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+    if (UNEXPECTED(XHPROF_G(flush_due)) && XHPROF_G(enabled)) {
+      hp_flush(TSRMLS_C);
+    }
+    return;
+  }
+
   func = hp_get_function_name(ops TSRMLS_CC);
   if (!func) {
     _zend_execute_ex(execute_data TSRMLS_CC);
     return;
   }
 
-  BEGIN_PROFILING(&hp_globals.entries, func, hp_profile_flag);
-  _zend_execute_ex(execute_data TSRMLS_CC);
+  if (!hp_allowed_entry(func)) {
+    efree(func);
+    _zend_execute_ex(execute_data TSRMLS_CC);
+    return;
+  }
 
-  if (hp_globals.entries) {
-    END_PROFILING(&hp_globals.entries, hp_profile_flag);
+  BEGIN_PROFILING(&XHPROF_G(entries), func, hp_profile_flag);
+  HP_FRAME_SAVE(frame, seq);
+  _zend_execute_ex(execute_data TSRMLS_CC);
+  END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+  if (UNEXPECTED(XHPROF_G(flush_due)) && XHPROF_G(enabled)) {
+    hp_flush(TSRMLS_C);
   }
 
   efree(func);
@@ -1177,6 +2392,257 @@ ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
 #undef EX
 #define EX(element) ((execute_data)->element)
 
+/* Chain to the execute_internal hook we replaced, if any */
+#define HP_CALL_EXECUTE_INTERNAL(execute_data, return_value)            \
+  do {                                                                  \
+    if (_zend_execute_internal) {                                       \
+      _zend_execute_internal((execute_data), (return_value) TSRMLS_CC); \
+    } else {                                                            \
+      execute_internal((execute_data), (return_value) TSRMLS_CC);       \
+    }                                                                   \
+  } while (0)
+
+/**
+ * ************
+ * CODE REGIONS
+ * ************
+ */
+
+/**
+ * Open a code region: push a frame named after it, as if the current
+ * function had called a function of that name.
+ *
+ * @return SUCCESS if the region is profiled
+ */
+static int hp_marker_begin(zend_string *name TSRMLS_DC) {
+  hp_func_info_t *info;
+  int             hp_profile_flag = 1;
+
+  if (!XHPROF_G(enabled) || !XHPROF_G(entries)) {
+    return FAILURE;
+  }
+
+  info = hp_get_marker_info(name TSRMLS_CC);
+  BEGIN_PROFILING_CACHED(&XHPROF_G(entries), info, hp_profile_flag);
+  return hp_profile_flag ? SUCCESS : FAILURE;
+}
+
+/**
+ * The cached info of a code region's frame, or NULL if p isn't one.
+ */
+static hp_func_info_t *hp_marker_frame(hp_entry_t *p TSRMLS_DC) {
+  hp_func_info_t *info;
+
+  if (!XHPROF_G(markers)) {
+    return NULL;
+  }
+
+  /* The name of a region's frame is the one of its cached info */
+  info = zend_hash_str_find_ptr(XHPROF_G(markers), p->name_hprof,
+                                strlen(p->name_hprof));
+  return info && info->name == p->name_hprof ? info : NULL;
+}
+
+/**
+ * Close the innermost code region, if it is the top frame.
+ *
+ * @param  name  only close the region of that name, or NULL for any
+ * @return SUCCESS if a region was closed
+ */
+static int hp_marker_end(zend_string *name TSRMLS_DC) {
+  hp_entry_t     *top = XHPROF_G(entries);
+  hp_func_info_t *info;
+  int             hp_profile_flag = 1;
+
+  if (!XHPROF_G(enabled) || !top) {
+    return FAILURE;
+  }
+
+  info = hp_marker_frame(top TSRMLS_CC);
+  if (!info || (name && strcmp(ZSTR_VAL(name), info->name))) {
+    return FAILURE;
+  }
+
+  END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+  return SUCCESS;
+}
+
+/**
+ * *****
+ * SPANS
+ * *****
+ */
+
+/**
+ * The first string argument of a call, or NULL.
+ */
+static zend_string *hp_span_string_arg(zend_execute_data *execute_data) {
+  uint32_t i;
+
+  for (i = 0; i < ZEND_CALL_NUM_ARGS(execute_data); i++) {
+    zval *arg = ZEND_CALL_ARG(execute_data, i + 1);
+
+    ZVAL_DEREF(arg);
+    if (Z_TYPE_P(arg) == IS_STRING) {
+      return Z_STR_P(arg);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The URL a curl handle fetched last, from curl_getinfo(). It runs with
+ * the profiler off, so it doesn't show up in the profile.
+ *
+ * @return SUCCESS, with the URL in url to be destroyed
+ */
+static int hp_span_curl_url(zend_execute_data *execute_data, zval *url
+                            TSRMLS_DC) {
+  zval  func, args[2];
+  zval *opt;
+  int   enabled = XHPROF_G(enabled);
+  int   ret;
+
+  if (ZEND_CALL_NUM_ARGS(execute_data) < 1
+      || !(opt = zend_get_constant_str("CURLINFO_EFFECTIVE_URL",
+                                       sizeof("CURLINFO_EFFECTIVE_URL") - 1))) {
+    return FAILURE;
+  }
+
+  ZVAL_STRING(&func, "curl_getinfo");
+  ZVAL_COPY_VALUE(&args[0], ZEND_CALL_ARG(execute_data, 1));
+  ZVAL_COPY_VALUE(&args[1], opt);
+
+  XHPROF_G(enabled) = 0;
+  ret = call_user_function(EG(function_table), NULL, &func, url, 2, args);
+  XHPROF_G(enabled) = enabled;
+  zval_ptr_dtor(&func);
+
+  if (ret != SUCCESS || Z_TYPE_P(url) != IS_STRING) {
+    zval_ptr_dtor(url);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+/**
+ * Compute the fingerprint of a call of a "spans" function, after the call
+ * (its arguments are still there).
+ *
+ * @return SUCCESS, or FAILURE when the call has nothing to fingerprint
+ */
+static int hp_span_fingerprint(uint8 kind, zend_execute_data *execute_data,
+                               char *fp, size_t size TSRMLS_DC) {
+  zend_string *str = NULL;
+  zval         tmp;
+
+  ZVAL_UNDEF(&tmp);
+
+  switch (kind) {
+    case XHPROF_SPAN_STMT:
+      if (Z_TYPE(execute_data->This) == IS_OBJECT) {
+        zval *query;
+
+#if PHP_VERSION_ID >= 80000
+        query = zend_read_property(Z_OBJCE(execute_data->This),
+                                   Z_OBJ(execute_data->This), "queryString",
+                                   sizeof("queryString") - 1, 1, &tmp);
+#else
+        query = zend_read_property(Z_OBJCE(execute_data->This),
+                                   &execute_data->This, "queryString",
+                                   sizeof("queryString") - 1, 1, &tmp);
+#endif
+        if (query && Z_TYPE_P(query) == IS_STRING) {
+          str = Z_STR_P(query);
+        }
+      }
+      break;
+
+    case XHPROF_SPAN_CURL:
+      if (hp_span_curl_url(execute_data, &tmp TSRMLS_CC) == SUCCESS) {
+        str = Z_STR(tmp);
+      }
+      break;
+
+    default:
+      str = hp_span_string_arg(execute_data);
+      break;
+  }
+
+  if (!str || (kind == XHPROF_SPAN_URL && !strstr(ZSTR_VAL(str), "://"))) {
+    zval_ptr_dtor(&tmp);
+    return FAILURE;
+  }
+
+  if (kind == XHPROF_SPAN_SQL || kind == XHPROF_SPAN_STMT) {
+    hp_sql_fingerprint(ZSTR_VAL(str), ZSTR_LEN(str), fp, size);
+  } else {
+    hp_key_fingerprint(ZSTR_VAL(str), ZSTR_LEN(str), fp, size);
+  }
+  zval_ptr_dtor(&tmp);
+  return SUCCESS;
+}
+
+/**
+ * Add a call to the spans table. Past xhprof.max_spans fingerprints, new
+ * ones are counted under OTHER_SYMBOL.
+ */
+static void hp_span_record(const char *name, const char *fp, uint64 us
+                           TSRMLS_DC) {
+  zval      *fps, *counts;
+  zval       tmp;
+  zend_long  max = INI_INT("xhprof.max_spans");
+
+  if (Z_TYPE(XHPROF_G(spans)) != IS_ARRAY) {
+    return;
+  }
+
+  if (!(fps = zend_hash_str_find(Z_ARRVAL(XHPROF_G(spans)), name,
+                                 strlen(name)))) {
+    array_init(&tmp);
+    fps = zend_hash_str_update(Z_ARRVAL(XHPROF_G(spans)), name, strlen(name),
+                               &tmp);
+  }
+
+  if (!(counts = zend_hash_str_find(Z_ARRVAL_P(fps), fp, strlen(fp)))) {
+    if (max > 0 && XHPROF_G(span_count) >= max) {
+      fp = OTHER_SYMBOL;
+      counts = zend_hash_str_find(Z_ARRVAL_P(fps), fp, strlen(fp));
+    }
+    if (!counts) {
+      array_init(&tmp);
+      counts = zend_hash_str_update(Z_ARRVAL_P(fps), fp, strlen(fp), &tmp);
+      XHPROF_G(span_count)++;
+    }
+  }
+
+  hp_inc_count(counts, "ct", 1 TSRMLS_CC);
+  hp_inc_count(counts, "wt", us TSRMLS_CC);
+}
+
+/**
+ * Call a "spans" builtin, timing it and recording it under the
+ * fingerprint of its arguments. It is profiled as usual by the caller.
+ */
+static void hp_span_execute(hp_func_info_t *info,
+                            zend_execute_data *execute_data,
+                            zval *return_value TSRMLS_DC) {
+  char   fp[XHPROF_SPAN_FINGERPRINT_LEN];
+  uint64 start = cycle_timer();
+  uint64 end;
+
+  HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+  end = cycle_timer();
+
+  if (hp_span_fingerprint(info->span, execute_data, fp, sizeof(fp)
+                          TSRMLS_CC) == SUCCESS) {
+    hp_span_record(info->name, fp,
+                   get_us_from_tsc(end - start,
+                     XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)])
+                   TSRMLS_CC);
+  }
+}
+
 /**
  * Very similar to hp_execute. Proxy for zend_execute_internal().
  * Applies to zend builtin functions.
@@ -1186,22 +2652,84 @@ ZEND_DLEXPORT void hp_execute_ex (zend_execute_data *execute_data TSRMLS_DC) {
 ZEND_DLEXPORT void hp_execute_internal(zend_execute_data *execute_data, zval *return_value TSRMLS_DC ) {
   zend_execute_data *current_data;
   char             *func = NULL;
+  hp_func_info_t   *info;
+  hp_entry_t       *frame;
+  uint64            seq;
   int    hp_profile_flag = 1;
 
+  if (!XHPROF_G(enabled)) {
+    HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+    return;
+  }
+
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_NO_BUILTINS) {
+    /* if NO_BUILTINS is set, builtins run without being profiled, but
+     * still make spans */
+    if (XHPROF_G(span_function_names)
+        && (info = hp_get_func_info_ex(EG(current_execute_data)->func,
+                         &EG(current_execute_data)->func->op_array TSRMLS_CC))
+        && info->span) {
+      hp_span_execute(info, execute_data, return_value TSRMLS_CC);
+    } else {
+      HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+    }
+    return;
+  }
+
+  /* Builtins with a cached name and decision skip the work below */
   current_data = EG(current_execute_data);
-  func = hp_get_function_name(&current_data->func->op_array TSRMLS_CC);
-  if (func) {
+  info = hp_get_func_info_ex(current_data->func,
+                             &current_data->func->op_array TSRMLS_CC);
+  if (info) {
+    if (UNEXPECTED(info->span)) {
+      BEGIN_PROFILING_CACHED(&XHPROF_G(entries), info, hp_profile_flag);
+      HP_FRAME_SAVE(frame, seq);
+      hp_span_execute(info, execute_data, return_value TSRMLS_CC);
+      END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+      return;
+    }
 
-    BEGIN_PROFILING(&hp_globals.entries, func, hp_profile_flag);
+    if (info->folded) {
+      /* Too short to be worth timing, only count it */
+      info->folded_calls++;
+      HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+      return;
+    }
 
-    execute_internal(execute_data, return_value);
+    BEGIN_PROFILING_CACHED(&XHPROF_G(entries), info, hp_profile_flag);
+    HP_FRAME_SAVE(frame, seq);
+    if (hp_profile_flag
+        && (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_ADAPTIVE)) {
+      uint64 start = cycle_timer();
 
-    if (hp_globals.entries) {
-      END_PROFILING(&hp_globals.entries, hp_profile_flag);
+      HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+      hp_adaptive_account(info, cycle_timer() - start TSRMLS_CC);
+    } else {
+      HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
     }
+    END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+    return;
+  }
+
+  func = hp_get_function_name(&current_data->func->op_array TSRMLS_CC);
+  if (!func) {
+    HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+    return;
+  }
+
+  if (!hp_allowed_entry(func)) {
     efree(func);
+    HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+    return;
   }
 
+  BEGIN_PROFILING(&XHPROF_G(entries), func, hp_profile_flag);
+  HP_FRAME_SAVE(frame, seq);
+
+  HP_CALL_EXECUTE_INTERNAL(execute_data, return_value);
+
+  END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+  efree(func);
 }
 
 /**
@@ -1215,21 +2743,34 @@ ZEND_DLEXPORT zend_op_array* hp_compile_file(zend_file_handle *file_handle, int
   char           *func;
   int             len;
   zend_op_array  *ret;
+  hp_entry_t     *frame;
+  uint64          seq;
   int             hp_profile_flag = 1;
 
+  if (!XHPROF_G(enabled)) {
+    return _zend_compile_file(file_handle, type TSRMLS_CC);
+  }
 
+#if PHP_VERSION_ID >= 80100
+  filename = hp_get_base_filename(ZSTR_VAL(file_handle->filename));
+#else
   filename = hp_get_base_filename(file_handle->filename);
+#endif
   len      = strlen("load") + strlen(filename) + 3;
   func      = (char *)emalloc(len);
   snprintf(func, len, "load::%s", filename);
 
-  BEGIN_PROFILING(&hp_globals.entries, func, hp_profile_flag);
+  if (!hp_allowed_entry(func)) {
+    efree(func);
+    return _zend_compile_file(file_handle, type TSRMLS_CC);
+  }
+
+  BEGIN_PROFILING(&XHPROF_G(entries), func, hp_profile_flag);
+  HP_FRAME_SAVE(frame, seq);
 
   ret = _zend_compile_file(file_handle, type TSRMLS_CC);
 
-  if (hp_globals.entries) {
-    END_PROFILING(&hp_globals.entries, hp_profile_flag);
-  }
+  END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
 
   efree(func);
   return ret;
@@ -1238,97 +2779,1257 @@ ZEND_DLEXPORT zend_op_array* hp_compile_file(zend_file_handle *file_handle, int
 /**
  * Proxy for zend_compile_string(). Used to profile PHP eval compilation time.
  */
+#if PHP_VERSION_ID >= 80200
+# define HP_COMPILE_STRING_ARGS   source_string, filename, position
+ZEND_DLEXPORT zend_op_array* hp_compile_string(zend_string *source_string, const char *filename, zend_compile_position position) {
+#elif PHP_VERSION_ID >= 80000
+# define HP_COMPILE_STRING_ARGS   source_string, filename
+ZEND_DLEXPORT zend_op_array* hp_compile_string(zend_string *source_string, const char *filename) {
+#else
+# define HP_COMPILE_STRING_ARGS   source_string, filename TSRMLS_CC
 ZEND_DLEXPORT zend_op_array* hp_compile_string(zval *source_string, char *filename TSRMLS_DC) {
+#endif
     char          *func;
+    char           site[SCRATCH_BUF_LEN];
     int            len;
     zend_op_array *ret;
+    hp_entry_t    *frame;
+    uint64         seq;
     int            hp_profile_flag = 1;
 
-    len  = strlen("eval") + strlen(filename) + 3;
+    if (!XHPROF_G(enabled)) {
+        return _zend_compile_string(HP_COMPILE_STRING_ARGS);
+    }
+
+    /* Compiling and running the code are two nodes, "eval_compile::" and
+     * "eval::" of the same site */
+    hp_get_eval_site(filename, site, sizeof(site));
+    len  = strlen("eval_compile") + strlen(site) + 3;
     func = (char *)emalloc(len);
-    snprintf(func, len, "eval::%s", filename);
+    snprintf(func, len, "eval_compile::%s", site);
 
-    BEGIN_PROFILING(&hp_globals.entries, func, hp_profile_flag);
-    ret = _zend_compile_string(source_string, filename TSRMLS_CC);
-    if (hp_globals.entries) {
-        END_PROFILING(&hp_globals.entries, hp_profile_flag);
+    if (!hp_allowed_entry(func)) {
+        efree(func);
+        return _zend_compile_string(HP_COMPILE_STRING_ARGS);
     }
 
+    BEGIN_PROFILING(&XHPROF_G(entries), func, hp_profile_flag);
+    HP_FRAME_SAVE(frame, seq);
+    ret = _zend_compile_string(HP_COMPILE_STRING_ARGS);
+    END_PROFILING_FRAME(&XHPROF_G(entries), frame, seq, hp_profile_flag);
+
     efree(func);
     return ret;
 }
 
+#if PHP_VERSION_ID >= 70300
 /**
- * **************************
- * MAIN XHPROF CALLBACKS
- * **************************
- */
-
-/**
- * This function gets called once when xhprof gets enabled.
- * It replaces all the functions like zend_execute, zend_execute_internal,
- * etc that needs to be instrumented with their corresponding proxies.
+ * Proxy for gc_collect_cycles(), which the engine calls when its buffer of
+ * possible cycles fills up. Each run is profiled as a "(gc)" call of the
+ * function that triggered it, with the number of freed cycles in "gc".
  */
-static void hp_begin(long level, long xhprof_flags TSRMLS_DC) {
-  if (!hp_globals.enabled) {
-    int hp_profile_flag = 1;
+static int hp_gc_collect_cycles(void) {
+  char  symbol[SCRATCH_BUF_LEN];
+  int   collected;
+  int   hp_profile_flag = 1;
+  int   counted;
+  zval *counts;
 
-    hp_globals.enabled      = 1;
-    hp_globals.xhprof_flags = (uint32)xhprof_flags;
-    
-    /* Replace zend_compile with our proxy */
-    _zend_compile_file = zend_compile_file;
-    zend_compile_file  = hp_compile_file;
-    
-    /* Replace zend_compile_string with our proxy */
-    _zend_compile_string = zend_compile_string;
-    zend_compile_string = hp_compile_string;
-  
-    /* Replace zend_execute with our proxy */
-    _zend_execute_ex = zend_execute_ex;
-    zend_execute_ex  = hp_execute_ex;
-    
-    /* Replace zend_execute_internal with our proxy */
-    _zend_execute_internal = zend_execute_internal;
-    if (!(hp_globals.xhprof_flags & XHPROF_FLAGS_NO_BUILTINS)) {
-      /* if NO_BUILTINS is not set (i.e. user wants to profile builtins),
-       * then we intercept internal (builtin) function calls.
-       */
-      zend_execute_internal = hp_execute_internal;
-    }
-    
+  if (!XHPROF_G(enabled) || !XHPROF_G(entries)) {
+    return _gc_collect_cycles();
+  }
 
-    /* Initialize with the dummy mode first Having these dummy callbacks saves
-     * us from checking if any of the callbacks are NULL everywhere. */
-    hp_globals.mode_cb.init_cb     = hp_mode_dummy_init_cb;
-    hp_globals.mode_cb.exit_cb     = hp_mode_dummy_exit_cb;
-    hp_globals.mode_cb.begin_fn_cb = hp_mode_dummy_beginfn_cb;
-    hp_globals.mode_cb.end_fn_cb   = hp_mode_dummy_endfn_cb;
+  BEGIN_PROFILING(&XHPROF_G(entries), GC_SYMBOL, hp_profile_flag);
 
+  collected = _gc_collect_cycles();
 
-    /* Register the appropriate callback functions Override just a subset of
-     * all the callbacks is OK. */
-    switch(level) {
-      case XHPROF_MODE_HIERARCHICAL:
-        hp_globals.mode_cb.begin_fn_cb = hp_mode_hier_beginfn_cb;
-        hp_globals.mode_cb.end_fn_cb   = hp_mode_hier_endfn_cb;
-        break;
-      case XHPROF_MODE_SAMPLED:
-        hp_globals.mode_cb.init_cb     = hp_mode_sampled_init_cb;
-        hp_globals.mode_cb.begin_fn_cb = hp_mode_sampled_beginfn_cb;
-        hp_globals.mode_cb.end_fn_cb   = hp_mode_sampled_endfn_cb;
-        break;
-    }
+  if (!XHPROF_G(entries)) {
+    return collected;
+  }
 
+  counted = hp_profile_flag && !XHPROF_G(entries)->untimed
+            && XHPROF_G(profiler_level) == XHPROF_MODE_HIERARCHICAL;
+  if (counted) {
+    hp_get_function_stack(XHPROF_G(entries), 2, symbol, sizeof(symbol));
+  }
 
-    /* one time initializations */
-    hp_init_profiler_state(level TSRMLS_CC);
+  END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
 
-    /* start profiling from fictitious main() */
-    BEGIN_PROFILING(&hp_globals.entries, ROOT_SYMBOL, hp_profile_flag);
+  if (counted && Z_TYPE(XHPROF_G(stats_count)) == IS_ARRAY
+      && (counts = hp_hash_lookup(symbol TSRMLS_CC))) {
+    hp_inc_count(counts, "gc", collected TSRMLS_CC);
   }
+  return collected;
 }
-
+#endif
+
+/**
+ * ***********************
+ * EXCEPTIONS AND BAILOUTS
+ * ***********************
+ */
+
+/**
+ * Whether an exception is on its way up, not counting the ones exit()
+ * and the destruction of fibers use to unwind the stack.
+ */
+static int hp_exception_pending(TSRMLS_D) {
+  if (EXPECTED(!EG(exception))) {
+    return 0;
+  }
+#if PHP_VERSION_ID >= 80100
+  return !zend_is_unwind_exit(EG(exception))
+         && !zend_is_graceful_exit(EG(exception));
+#elif PHP_VERSION_ID >= 80000
+  return !zend_is_unwind_exit(EG(exception));
+#else
+  return 1;
+#endif
+}
+
+/**
+ * Close the frames above the root now, for an error that ends the request
+ * with a longjmp (zend_bailout()) past the proxies that would close them.
+ * Shutdown functions and destructors that run next are profiled under
+ * the root, rather than under the frames that failed.
+ */
+static void hp_unwind(TSRMLS_D) {
+  int hp_profile_flag = 1;
+
+  XHPROF_G(unwinding) = 1;
+  while (XHPROF_G(entries) && XHPROF_G(entries)->prev_hprof) {
+    END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+  }
+  XHPROF_G(unwinding) = 0;
+}
+
+/**
+ * End a proxy's frame that isn't the top of the stack. Either a bailout
+ * caught below the frames above it skipped their ends, and they are
+ * closed first, or hp_unwind() (or hp_stop()) closed the frame already.
+ * Code regions the function left open are closed with it, and don't count
+ * as failed unless an exception is on its way.
+ */
+static void hp_end_frame(hp_entry_t **entries, hp_entry_t *frame,
+                         uint64 seq TSRMLS_DC) {
+  hp_entry_t *p;
+  int         hp_profile_flag = 1;
+
+  for (p = *entries; p; p = p->prev_hprof) {
+    if (p == frame && p->calls_start == seq) {
+      break;
+    }
+  }
+  if (!p) {
+    return;
+  }
+
+  while (*entries != frame) {
+    XHPROF_G(unwinding) = !hp_marker_frame(*entries TSRMLS_CC);
+    END_PROFILING(entries, hp_profile_flag);
+  }
+  XHPROF_G(unwinding) = 0;
+  END_PROFILING(entries, hp_profile_flag);
+}
+
+/**
+ * Proxy for zend_error_cb(). Fatal errors bail out right after it.
+ */
+#if PHP_VERSION_ID >= 80100
+# define HP_ERROR_CB_ARGS   type, error_filename, error_lineno, message
+static void hp_error_cb(int type, zend_string *error_filename, const uint32_t error_lineno, zend_string *message) {
+#elif PHP_VERSION_ID >= 80000
+# define HP_ERROR_CB_ARGS   type, error_filename, error_lineno, message
+static void hp_error_cb(int type, const char *error_filename, const uint32_t error_lineno, zend_string *message) {
+#else
+# define HP_ERROR_CB_ARGS   type, error_filename, error_lineno, format, args
+static void hp_error_cb(int type, const char *error_filename, const uint32_t error_lineno, const char *format, va_list args) {
+#endif
+  if (XHPROF_G(enabled) && !(type & E_DONT_BAIL)
+      && (type & (E_ERROR | E_CORE_ERROR | E_COMPILE_ERROR | E_USER_ERROR
+                  | E_RECOVERABLE_ERROR | E_PARSE))) {
+    hp_unwind(TSRMLS_C);
+  }
+  _zend_error_cb(HP_ERROR_CB_ARGS);
+}
+
+/**
+ * *************
+ * FIBER SUPPORT
+ * *************
+ */
+
+#if PHP_VERSION_ID >= 80100
+/**
+ * Shift the start of every frame on a fiber's stack by the time the fiber
+ * spent suspended, so wt only counts the time the fiber was running. The
+ * shifted amount is kept in suspended_tsc and reported separately as swt.
+ */
+static void hp_fiber_shift_stack(hp_entry_t *entries, uint64 delta) {
+  hp_entry_t *p;
+
+  for (p = entries; p; p = p->prev_hprof) {
+    p->tsc_start     += delta;
+    p->suspended_tsc += delta;
+  }
+}
+
+/**
+ * Fiber switch observer. Every fiber gets its own profile stack, so that
+ * frames of a suspended fiber are neither the parent of, nor closed by,
+ * the code that runs while it is switched out.
+ *
+ * A fiber starts with a fictitious FIBER_SYMBOL frame at the bottom of its
+ * stack, which is closed when the fiber finishes.
+ */
+static void hp_fiber_switch_cb(zend_fiber_context *from, zend_fiber_context *to) {
+  hp_fiber_t *state;
+  uint64      now;
+  int         hp_profile_flag = 1;
+
+  if (!XHPROF_G(enabled)) {
+    return;
+  }
+
+  /* Counters mode times calls with the monotonic clock, not the TSC */
+  now = XHPROF_G(profiler_level) == XHPROF_MODE_COUNTERS
+        ? hp_counters_now_ns() : cycle_timer();
+
+  if (!XHPROF_G(fiber_stacks)) {
+    ALLOC_HASHTABLE(XHPROF_G(fiber_stacks));
+    zend_hash_init(XHPROF_G(fiber_stacks), 8, NULL, NULL, 0);
+  }
+
+  if (from->status == ZEND_FIBER_STATUS_DEAD) {
+    /* The fiber returned, close whatever is left on its stack */
+    while (XHPROF_G(entries)) {
+      END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+    }
+  } else {
+    state = emalloc(sizeof(hp_fiber_t));
+    state->entries          = XHPROF_G(entries);
+    state->switched_out_tsc = now;
+    /* When "from" starts or resumes "to" it is still running, just further
+     * down in "to"; that time belongs to its frames. */
+    state->suspended = !(to->kind == zend_ce_fiber
+                         && zend_fiber_from_context(to)->caller == from);
+    zend_hash_index_update_ptr(XHPROF_G(fiber_stacks),
+                               (zend_ulong)(zend_uintptr_t)from, state);
+  }
+
+  state = zend_hash_index_find_ptr(XHPROF_G(fiber_stacks),
+                                   (zend_ulong)(zend_uintptr_t)to);
+  if (state) {
+    XHPROF_G(entries) = state->entries;
+    if (state->suspended) {
+      hp_fiber_shift_stack(state->entries, now - state->switched_out_tsc);
+    }
+    efree(state);
+    zend_hash_index_del(XHPROF_G(fiber_stacks),
+                        (zend_ulong)(zend_uintptr_t)to);
+  } else {
+    XHPROF_G(entries) = NULL;
+    if (to->status == ZEND_FIBER_STATUS_INIT) {
+      BEGIN_PROFILING(&XHPROF_G(entries), FIBER_SYMBOL, hp_profile_flag);
+    }
+  }
+}
+#endif
+
+/**
+ * Close the profile stacks of fibers that are still switched out when
+ * profiling stops. Their frames are ended as of now.
+ */
+static void hp_fiber_stacks_close(TSRMLS_D) {
+#if PHP_VERSION_ID >= 80100
+  hp_entry_t *current = XHPROF_G(entries);
+  hp_fiber_t *state;
+  int         hp_profile_flag = 1;
+
+  if (!XHPROF_G(fiber_stacks)) {
+    return;
+  }
+
+  ZEND_HASH_FOREACH_PTR(XHPROF_G(fiber_stacks), state) {
+    XHPROF_G(entries) = state->entries;
+    while (XHPROF_G(entries)) {
+      END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
+    }
+    efree(state);
+  } ZEND_HASH_FOREACH_END();
+
+  XHPROF_G(entries) = current;
+
+  zend_hash_destroy(XHPROF_G(fiber_stacks));
+  FREE_HASHTABLE(XHPROF_G(fiber_stacks));
+  XHPROF_G(fiber_stacks) = NULL;
+#endif
+}
+
+/**
+ * ********
+ * COUNTERS
+ * ********
+ */
+
+/**
+ * Map the counters table. Called at MINIT, before the server forks its
+ * workers, so that they all share it. Anonymous shared memory is zeroed:
+ * every slot is free.
+ */
+static void hp_counters_init() {
+  uint32  nslots = 64;
+  uint32  nshards;
+  long    ncpu;
+  size_t  head;
+  char   *mem;
+
+  if (!INI_BOOL("xhprof.counters")) {
+    return;
+  }
+
+  while (nslots < INI_INT("xhprof.max_counters") && nslots < (1u << 20)) {
+    nslots <<= 1;
+  }
+  ncpu    = sysconf(_SC_NPROCESSORS_CONF);
+  nshards = ncpu < 1 ? 1 : ncpu > 256 ? 256 : (uint32)ncpu;
+
+  head = (sizeof(hp_counters_t) + 63) & ~(size_t)63;
+  hp_counters_size = head + (size_t)nslots * sizeof(hp_counter_name_t)
+                     + (size_t)nshards * nslots * sizeof(hp_counter_t);
+  mem = mmap(NULL, hp_counters_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return;
+  }
+
+  hp_counters          = (hp_counters_t *)mem;
+  hp_counters->nslots  = nslots;
+  hp_counters->nshards = nshards;
+  hp_counters->names   = (hp_counter_name_t *)(mem + head);
+  hp_counters->counts  = (hp_counter_t *)(hp_counters->names + nslots);
+}
+
+static void hp_counters_shutdown() {
+  if (hp_counters) {
+    munmap(hp_counters, hp_counters_size);
+    hp_counters = NULL;
+  }
+}
+
+/**
+ * Find the slot of a function name in the counters table, taking a free
+ * one for a new name. Processes race for free slots with a compare and
+ * swap of the hash; there are no locks.
+ *
+ * @return the slot, -1 when the table is full
+ */
+static int hp_counter_slot(const char *name, size_t len) {
+  uint64  h    = zend_inline_hash_func(name, len);
+  uint32  mask = hp_counters->nslots - 1;
+  size_t  keep = len < HP_COUNTER_NAME_LEN ? len : HP_COUNTER_NAME_LEN;
+  uint32  i, n;
+
+  for (i = h & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+    hp_counter_name_t *slot = &hp_counters->names[i];
+    uint64             cur  = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+    if (!cur) {
+      if (__atomic_compare_exchange_n(&slot->hash, &cur, h, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        memcpy(slot->name, name, keep);
+        slot->len = (uint32)len;
+        __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+        return (int)i;
+      }
+      /* Another process took it, for the name whose hash is now in cur */
+    }
+
+    /* A name still being written is this one: the hashes are 64 bits */
+    if (cur == h
+        && (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)
+            || (slot->len == len && !memcmp(slot->name, name, keep)))) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * hp_counter_slot() of the function of an entry, remembered by symbol ID
+ * for the rest of the request.
+ */
+static int hp_counters_entry_slot(hp_entry_t *top TSRMLS_DC) {
+  uint32 id = top->symbol_id;
+  int    slot;
+
+  if (id && id < XHPROF_G(counter_slots_size) && XHPROF_G(counter_slots)[id]) {
+    return (int)XHPROF_G(counter_slots)[id] - 1;
+  }
+
+  slot = hp_counter_slot(top->name_hprof, strlen(top->name_hprof));
+  if (id && slot >= 0) {
+    if (id >= XHPROF_G(counter_slots_size)) {
+      uint32 size = XHPROF_G(counter_slots_size) ? XHPROF_G(counter_slots_size)
+                                                 : 64;
+
+      while (size <= id) {
+        size <<= 1;
+      }
+      XHPROF_G(counter_slots) = safe_erealloc(XHPROF_G(counter_slots), size,
+                                              sizeof(uint32), 0);
+      memset(XHPROF_G(counter_slots) + XHPROF_G(counter_slots_size), 0,
+             (size - XHPROF_G(counter_slots_size)) * sizeof(uint32));
+      XHPROF_G(counter_slots_size) = size;
+    }
+    XHPROF_G(counter_slots)[id] = (uint32)slot + 1;
+  }
+  return slot;
+}
+
+/**
+ * Monotonic wall clock in nanoseconds, for counters mode which doesn't
+ * bind the thread to a cpu and so can't use the TSC.
+ */
+static uint64 hp_counters_now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * XHPROF_MODE_COUNTERS's init callback. The request adds to the shard of
+ * the cpu it starts on; it may move later, shards only spread contention.
+ */
+void hp_mode_counters_init_cb(TSRMLS_D) {
+  int cpu = 0;
+
+#ifdef __linux__
+  if ((cpu = sched_getcpu()) < 0) {
+    cpu = 0;
+  }
+#endif
+  XHPROF_G(counter_shard) = (uint32)cpu % hp_counters->nshards;
+}
+
+/**
+ * XHPROF_MODE_COUNTERS's begin function callback. tsc_start holds the
+ * monotonic clock in nanoseconds in this mode.
+ */
+void hp_mode_counters_beginfn_cb(hp_entry_t **entries,
+                                 hp_entry_t  *current  TSRMLS_DC) {
+  current->tsc_start = hp_counters_now_ns();
+}
+
+/**
+ * XHPROF_MODE_COUNTERS's end function callback. Adds the call to the
+ * shared table rather than to stats_count.
+ */
+void hp_mode_counters_endfn_cb(hp_entry_t **entries  TSRMLS_DC) {
+  hp_entry_t   *top    = (*entries);
+  uint64        wt_ns  = hp_counters_now_ns() - top->tsc_start;
+  hp_counter_t *counter;
+  int           slot;
+
+  if ((slot = hp_counters_entry_slot(top TSRMLS_CC)) < 0) {
+    __atomic_fetch_add(&hp_counters->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  counter = &hp_counters->counts[(size_t)XHPROF_G(counter_shard)
+                                 * hp_counters->nslots + slot];
+  __atomic_fetch_add(&counter->ct, 1, __ATOMIC_RELAXED);
+
+  /* wt is inclusive, only the outermost call of a recursion adds to it */
+  if (top->rlvl_hprof == 0) {
+    __atomic_fetch_add(&counter->wt, wt_ns / 1000, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Stop counting calls for the rest of the request, for xhprof_enable() or
+ * xhprof_sample_enable() to take over.
+ */
+static void hp_counters_stop(TSRMLS_D) {
+  if (XHPROF_G(enabled) && XHPROF_G(profiler_level) == XHPROF_MODE_COUNTERS) {
+    hp_stop(TSRMLS_C);
+  }
+}
+
+/* The totals of a function over all the shards */
+typedef struct hp_counter_row_t {
+  uint32  slot;
+  uint64  ct;
+  uint64  wt;
+} hp_counter_row_t;
+
+static int hp_counter_row_cmp(const void *a, const void *b) {
+  const hp_counter_row_t *x = a;
+  const hp_counter_row_t *y = b;
+
+  if (x->wt != y->wt) {
+    return x->wt < y->wt ? 1 : -1;
+  }
+  if (x->ct != y->ct) {
+    return x->ct < y->ct ? 1 : -1;
+  }
+  return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+/**
+ * Sum the shards of every function in the counters table, the most
+ * expensive (by wt) first.
+ *
+ * @param  top    keep this many functions, all of them if <= 0
+ * @param  count  set to the number of rows
+ * @return emalloc'ed rows
+ */
+static hp_counter_row_t *hp_counters_collect(zend_long top, uint32 *count) {
+  hp_counter_row_t *rows;
+  uint32            i, j, n = 0;
+
+  rows = safe_emalloc(hp_counters->nslots, sizeof(hp_counter_row_t), 0);
+  for (i = 0; i < hp_counters->nslots; i++) {
+    if (!__atomic_load_n(&hp_counters->names[i].ready, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    rows[n].slot = i;
+    rows[n].ct   = 0;
+    rows[n].wt   = 0;
+    for (j = 0; j < hp_counters->nshards; j++) {
+      hp_counter_t *c = &hp_counters->counts[(size_t)j * hp_counters->nslots
+                                             + i];
+
+      rows[n].ct += __atomic_load_n(&c->ct, __ATOMIC_RELAXED);
+      rows[n].wt += __atomic_load_n(&c->wt, __ATOMIC_RELAXED);
+    }
+    if (rows[n].ct) {
+      n++;
+    }
+  }
+
+  qsort(rows, n, sizeof(hp_counter_row_t), hp_counter_row_cmp);
+  if (top > 0 && (zend_long)n > top) {
+    n = (uint32)top;
+  }
+  *count = n;
+  return rows;
+}
+
+/* The name kept for a slot, and its length */
+static zend_always_inline const char *hp_counter_name(uint32 slot,
+                                                      size_t *len) {
+  hp_counter_name_t *name = &hp_counters->names[slot];
+
+  *len = name->len < HP_COUNTER_NAME_LEN ? name->len : HP_COUNTER_NAME_LEN;
+  return name->name;
+}
+
+/**
+ * Append an OpenMetrics sample for a function: name{function="..."} value.
+ * The label value escapes backslashes (namespaces), quotes and newlines.
+ */
+static int hp_counters_sample(hp_prof_buf_t *buf, const char *metric,
+                              const char *name, size_t len,
+                              const char *value) {
+  size_t i, start = 0;
+
+  if (hp_prof_buf_append(buf, metric, strlen(metric)) < 0
+      || hp_prof_buf_append(buf, "{function=\"", 11) < 0) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    const char *esc = name[i] == '\\' ? "\\\\"
+                      : name[i] == '"' ? "\\\""
+                      : name[i] == '\n' ? "\\n" : NULL;
+
+    if (esc) {
+      if (hp_prof_buf_append(buf, name + start, i - start) < 0
+          || hp_prof_buf_append(buf, esc, 2) < 0) {
+        return -1;
+      }
+      start = i + 1;
+    }
+  }
+  if (hp_prof_buf_append(buf, name + start, len - start) < 0
+      || hp_prof_buf_append(buf, "\"} ", 3) < 0
+      || hp_prof_buf_append(buf, value, strlen(value)) < 0
+      || hp_prof_buf_append(buf, "\n", 1) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * The counters table as OpenMetrics (and Prometheus) text.
+ */
+static int hp_counters_export(zend_long top, hp_prof_buf_t *buf) {
+  hp_counter_row_t *rows;
+  uint32            count, i;
+  char              value[64];
+  const char       *name;
+  size_t            len;
+  int               ret = -1;
+
+  rows = hp_counters_collect(top, &count);
+
+#define HP_COUNTERS_TEXT(text)                                          \
+  if (hp_prof_buf_append(buf, text, sizeof(text) - 1) < 0) goto out
+
+  HP_COUNTERS_TEXT(
+    "# TYPE xhprof_function_calls counter\n"
+    "# HELP xhprof_function_calls Calls of the function in all workers.\n");
+  for (i = 0; i < count; i++) {
+    name = hp_counter_name(rows[i].slot, &len);
+    snprintf(value, sizeof(value), "%llu", rows[i].ct);
+    if (hp_counters_sample(buf, "xhprof_function_calls_total", name, len,
+                           value) < 0) {
+      goto out;
+    }
+  }
+
+  HP_COUNTERS_TEXT(
+    "# TYPE xhprof_function_wall_seconds counter\n"
+    "# UNIT xhprof_function_wall_seconds seconds\n"
+    "# HELP xhprof_function_wall_seconds Wall time of the function, "
+    "including its callees.\n");
+  for (i = 0; i < count; i++) {
+    name = hp_counter_name(rows[i].slot, &len);
+    snprintf(value, sizeof(value), "%llu.%06llu", rows[i].wt / 1000000,
+             rows[i].wt % 1000000);
+    if (hp_counters_sample(buf, "xhprof_function_wall_seconds_total", name,
+                           len, value) < 0) {
+      goto out;
+    }
+  }
+
+  HP_COUNTERS_TEXT(
+    "# TYPE xhprof_dropped_calls counter\n"
+    "# HELP xhprof_dropped_calls Calls of functions the table had no room "
+    "for.\n");
+  snprintf(value, sizeof(value), "xhprof_dropped_calls_total %llu\n",
+           (uint64)__atomic_load_n(&hp_counters->dropped, __ATOMIC_RELAXED));
+  if (hp_prof_buf_append(buf, value, strlen(value)) < 0) {
+    goto out;
+  }
+  HP_COUNTERS_TEXT("# EOF\n");
+  ret = 0;
+
+#undef HP_COUNTERS_TEXT
+out:
+  efree(rows);
+  return ret;
+}
+
+/**
+ * *********
+ * STREAMING
+ * *********
+ */
+
+/**
+ * The metadata of the request: what it was, with "request.*" keys, and the
+ * tags set with xhprof_tag(), which win over these.
+ *
+ * @param  meta  array to fill, initialized here
+ */
+static void hp_request_meta(zval *meta TSRMLS_DC) {
+  struct timeval now;
+  double         started = sapi_get_request_time(TSRMLS_C);
+  char           buf[32];
+
+  array_init(meta);
+
+  if (SG(request_info).request_method) {
+    add_assoc_string(meta, "request.method",
+                     (char *)SG(request_info).request_method);
+  }
+  if (SG(request_info).request_uri) {
+    add_assoc_string(meta, "request.uri", SG(request_info).request_uri);
+  }
+  add_assoc_string(meta, "request.sapi", (char *)sapi_module.name);
+
+  snprintf(buf, sizeof(buf), "%zu", zend_memory_peak_usage(0 TSRMLS_CC));
+  add_assoc_string(meta, "request.pmu", buf);
+
+  /* Microseconds since the request started */
+  gettimeofday(&now, NULL);
+  if (started > 0) {
+    snprintf(buf, sizeof(buf), "%.0f",
+             (now.tv_sec + now.tv_usec / 1000000.0 - started) * 1000000);
+    add_assoc_string(meta, "request.wt", buf);
+  }
+
+  if (Z_TYPE(XHPROF_G(tags)) == IS_ARRAY) {
+    zend_hash_merge(Z_ARRVAL_P(meta), Z_ARRVAL(XHPROF_G(tags)), zval_add_ref,
+                    1);
+  }
+}
+
+/**
+ * Add the metadata of the request to a profile as tags.
+ *
+ * @return SUCCESS, or FAILURE when out of memory
+ */
+static int hp_meta_to_prof(hp_prof_t *prof TSRMLS_DC) {
+  zend_string *key;
+  zval        *value;
+  zval         meta;
+  int          ret = SUCCESS;
+
+  hp_request_meta(&meta TSRMLS_CC);
+  ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL(meta), key, value) {
+    if (key && Z_TYPE_P(value) == IS_STRING
+        && hp_prof_tag(prof, ZSTR_VAL(key), Z_STRVAL_P(value)) < 0) {
+      ret = FAILURE;
+      break;
+    }
+  } ZEND_HASH_FOREACH_END();
+  zval_ptr_dtor(&meta);
+
+  return ret;
+}
+
+/**
+ * Add the metrics of an xhprof_disable() style array to a profile.
+ *
+ * @return SUCCESS, or FAILURE when out of memory
+ */
+static int hp_stats_to_prof(zval *stats, hp_prof_t *prof) {
+  zend_string *key;
+  zend_string *name;
+  zval        *counts;
+  zval        *value;
+
+  ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(stats), key, counts) {
+    hp_prof_edge_t *edge;
+
+    if (!key || Z_TYPE_P(counts) != IS_ARRAY) {
+      continue;
+    }
+    if (!(edge = hp_prof_edge_by_key(prof, ZSTR_VAL(key), ZSTR_LEN(key)))) {
+      return FAILURE;
+    }
+
+    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(counts), name, value) {
+      int m;
+
+      if (name && (m = hp_prof_metric(prof, ZSTR_VAL(name))) >= 0) {
+        edge->v[m] += zval_get_long(value);
+        edge->mask |= 1u << m;
+      }
+    } ZEND_HASH_FOREACH_END();
+  } ZEND_HASH_FOREACH_END();
+
+  return SUCCESS;
+}
+
+/**
+ * Write serialized profiles to xhprof.stream: "unix:/path" for a Unix
+ * socket, anything else is a file to append to. A "%p" in the path is
+ * replaced by the process id, so that workers can each have their file.
+ *
+ * @return SUCCESS if all of data was written
+ */
+static int hp_stream_write(const unsigned char *data, size_t len TSRMLS_DC) {
+  const char *target = INI_STR("xhprof.stream");
+  const char *pct;
+  char        path[MAXPATHLEN];
+  size_t      done = 0;
+  int         fd;
+
+  if (!target || !*target) {
+    return FAILURE;
+  }
+
+  if ((pct = strstr(target, "%p"))) {
+    snprintf(path, sizeof(path), "%.*s%ld%s", (int)(pct - target), target,
+             (long)getpid(), pct + 2);
+  } else {
+    snprintf(path, sizeof(path), "%s", target);
+  }
+
+  if (!strncmp(path, "unix:", 5)) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path + 5);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      return FAILURE;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      return FAILURE;
+    }
+  } else if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+    return FAILURE;
+  }
+
+  while (done < len) {
+    ssize_t n = write(fd, data + done, len - done);
+
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+
+  close(fd);
+  return done == len ? SUCCESS : FAILURE;
+}
+
+/**
+ * Arm the timed flush: xhprof.flush_interval seconds from now, if set and
+ * there is somewhere to stream to. The end of profiled calls compares the
+ * deadline with the TSC value they read anyway.
+ */
+static void hp_flush_schedule(TSRMLS_D) {
+  zend_long   interval = INI_INT("xhprof.flush_interval");
+  const char *target   = INI_STR("xhprof.stream");
+
+  XHPROF_G(flush_due)          = 0;
+  XHPROF_G(flush_deadline_tsc) = 0;
+
+  if (interval > 0 && target && *target
+      && XHPROF_G(profiler_level) == XHPROF_MODE_HIERARCHICAL) {
+    XHPROF_G(flush_deadline_tsc) = cycle_timer()
+      + get_tsc_from_us((uint64)interval * 1000000,
+                        XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]);
+  }
+}
+
+/**
+ * Stream what was profiled since the last flush to xhprof.stream, and start
+ * over with empty counters. Profiling goes on: the hooks stay in place and
+ * calls still in progress are reported by the flush after they return.
+ *
+ * @return SUCCESS if the profile was written
+ */
+static int hp_flush(TSRMLS_D) {
+  hp_prof_t      prof;
+  hp_prof_buf_t  buf;
+  struct timeval now;
+  int            ret = FAILURE;
+
+  /* Only hierarchical profiles have edges to stream */
+  if (XHPROF_G(profiler_level) != XHPROF_MODE_HIERARCHICAL) {
+    return FAILURE;
+  }
+
+  hp_flush_schedule(TSRMLS_C);
+  XHPROF_G(flush_jobs) = 0;
+
+  /* Complete the counters the way hp_stop() does. The calls of the
+   * "(xhprof)" entry are the ones since the last flush; call_count itself
+   * keeps going, frames still running compensate with their calls_start */
+  if (XHPROF_G(xhprof_flags)
+      & (XHPROF_FLAGS_OVERHEAD | XHPROF_FLAGS_COMPENSATE)) {
+    hp_add_overhead_entry(TSRMLS_C);
+  }
+  XHPROF_G(flush_call_count) = XHPROF_G(call_count);
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_ADAPTIVE) {
+    hp_add_folded_entries(TSRMLS_C);
+  }
+  hp_sampled_edges_finish(TSRMLS_C);
+  hp_sampled_edges_reset(TSRMLS_C);
+
+  hp_prof_init(&prof);
+  memset(&buf, 0, sizeof(buf));
+  gettimeofday(&now, NULL);
+  prof.time_us = (uint64)now.tv_sec * 1000000 + now.tv_usec;
+  prof.pid     = (uint32_t)getpid();
+  prof.seq     = ++XHPROF_G(flush_seq);
+
+  if (hp_stats_to_prof(&XHPROF_G(stats_count), &prof) == SUCCESS
+      && hp_meta_to_prof(&prof TSRMLS_CC) == SUCCESS
+      && hp_prof_write(&prof, &buf) == 0) {
+    ret = hp_stream_write(buf.data, buf.len TSRMLS_CC);
+  }
+
+  hp_prof_buf_free(&buf);
+  hp_prof_free(&prof);
+
+  /* The next flush only has what happens from now on */
+  zval_dtor(&XHPROF_G(stats_count));
+  array_init(&XHPROF_G(stats_count));
+  XHPROF_G(stats_bytes) = 0;
+
+  return ret;
+}
+
+
+/**
+ * Send the profile of the request to the local collector at
+ * xhprof.collector, as one datagram on a Unix socket. The send never
+ * blocks: when the collector is behind and its queue is full, it isn't
+ * running or the profile doesn't fit in a datagram, the profile is dropped
+ * and counted (see phpinfo()).
+ */
+static void hp_collector_send(TSRMLS_D) {
+  const char        *target = INI_STR("xhprof.collector");
+  struct sockaddr_un addr;
+  hp_prof_t          prof;
+  hp_prof_buf_t      buf;
+  struct timeval     now;
+  ssize_t            sent = -1;
+  int                sndbuf = XHPROF_COLLECTOR_MAX_DATAGRAM;
+
+  if (!target || !*target
+      || XHPROF_G(profiler_level) != XHPROF_MODE_HIERARCHICAL) {
+    return;
+  }
+  if (!strncmp(target, "unix:", 5)) {
+    target += 5;
+  }
+
+  if (XHPROF_G(collector_fd) < 0) {
+    XHPROF_G(collector_fd) = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (XHPROF_G(collector_fd) < 0) {
+      XHPROF_G(collector_failed)++;
+      return;
+    }
+    fcntl(XHPROF_G(collector_fd), F_SETFL,
+          fcntl(XHPROF_G(collector_fd), F_GETFL) | O_NONBLOCK);
+    /* The default send buffer (net.core.wmem_default) is smaller than
+     * many profiles; the kernel caps this at net.core.wmem_max */
+    setsockopt(XHPROF_G(collector_fd), SOL_SOCKET, SO_SNDBUF,
+               &sndbuf, sizeof(sndbuf));
+  }
+
+  hp_prof_init(&prof);
+  memset(&buf, 0, sizeof(buf));
+  gettimeofday(&now, NULL);
+  prof.time_us = (uint64)now.tv_sec * 1000000 + now.tv_usec;
+  prof.pid     = (uint32_t)getpid();
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", target);
+
+  if (hp_stats_to_prof(&XHPROF_G(stats_count), &prof) != SUCCESS
+      || hp_meta_to_prof(&prof TSRMLS_CC) != SUCCESS
+      || hp_prof_write(&prof, &buf) != 0) {
+    XHPROF_G(collector_failed)++;
+  } else if (buf.len > XHPROF_COLLECTOR_MAX_DATAGRAM) {
+    XHPROF_G(collector_too_large)++;
+  } else if ((sent = sendto(XHPROF_G(collector_fd), buf.data, buf.len,
+                            MSG_DONTWAIT, (struct sockaddr *)&addr,
+                            sizeof(addr))) >= 0) {
+    XHPROF_G(collector_sent)++;
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+    XHPROF_G(collector_busy)++;
+  } else if (errno == EMSGSIZE) {
+    /* larger than the send buffer the kernel let us have */
+    XHPROF_G(collector_too_large)++;
+  } else {
+    /* not running */
+    XHPROF_G(collector_failed)++;
+  }
+
+  hp_prof_buf_free(&buf);
+  hp_prof_free(&prof);
+}
+
+
+/**
+ * Whether the profile of the request is worth keeping: forced with
+ * xhprof_keep(), or else it took at least one of xhprof.keep_wt or
+ * xhprof.keep_cpu (ms) or xhprof.keep_pmu (bytes) so far. Without
+ * thresholds every profile is kept.
+ */
+static int hp_keep_profile(TSRMLS_D) {
+  zend_long      keep_wt  = INI_INT("xhprof.keep_wt");
+  zend_long      keep_cpu = INI_INT("xhprof.keep_cpu");
+  zend_long      keep_pmu = INI_INT("xhprof.keep_pmu");
+  struct timeval now;
+  struct rusage  ru;
+
+  if (XHPROF_G(keep)) {
+    return XHPROF_G(keep) > 0;
+  }
+  if (keep_wt <= 0 && keep_cpu <= 0 && keep_pmu <= 0) {
+    return 1;
+  }
+
+  if (keep_wt > 0) {
+    gettimeofday(&now, NULL);
+    if (get_us_interval(&XHPROF_G(begin_time), &now) >= keep_wt * 1000) {
+      return 1;
+    }
+  }
+  if (keep_cpu > 0) {
+    getrusage(RUSAGE_SELF, &ru);
+    if (get_us_interval(&XHPROF_G(begin_ru).ru_utime, &ru.ru_utime)
+        + get_us_interval(&XHPROF_G(begin_ru).ru_stime, &ru.ru_stime)
+        >= keep_cpu * 1000) {
+      return 1;
+    }
+  }
+  return keep_pmu > 0
+         && zend_memory_peak_usage(0 TSRMLS_CC) >= (size_t)keep_pmu;
+}
+
+
+/**
+ * *******
+ * SUMMARY
+ * *******
+ */
+
+/**
+ * Summarize an xhprof_disable() style array per function, the way
+ * consumers otherwise do in PHP from the "parent==>child" keys:
+ *
+ *   "functions" => name => ["ct" => .., "wt" => .., "excl_wt" => .., ...]
+ *   "top"       => "excl_wt" => [name => value, ...], "wt" => [...], ...
+ *
+ * Exclusive metrics are the inclusive ones less those of the callees. Only
+ * the metrics that were profiled are there.
+ *
+ * @param  top  functions in each "top" list
+ * @return SUCCESS, or FAILURE when out of memory
+ */
+static int hp_summary(zval *stats, zend_long top, zval *out) {
+  hp_prof_t       prof;
+  hp_report_fn_t *fns = NULL;
+  uint32_t       *best = NULL;
+  int             present[HP_REPORT_METRICS];
+  zval            functions, lists;
+  uint32_t        f;
+  int             m, excl;
+  int             ret = FAILURE;
+
+  hp_prof_init(&prof);
+  if (hp_stats_to_prof(stats, &prof) != SUCCESS
+      || !(fns = hp_report_functions(&prof))) {
+    goto out;
+  }
+
+  /* No list is longer than the number of functions */
+  if (top > (zend_long)prof.strings.count) {
+    top = prof.strings.count;
+  }
+  if (top > 0) {
+    best = safe_emalloc(top, sizeof(uint32_t), 0);
+  }
+
+  for (m = 0; m < HP_REPORT_METRICS; m++) {
+    present[m] = hp_prof_metric_find(&prof, hp_report_metric_names[m]) >= 0;
+  }
+
+  array_init(&functions);
+  for (f = 0; f < prof.strings.count; f++) {
+    zval fn;
+
+    if (!fns[f].incl[HP_REPORT_CT]) {
+      continue;
+    }
+
+    array_init(&fn);
+    for (m = 0; m < HP_REPORT_METRICS; m++) {
+      char name[16];
+
+      if (!present[m]) {
+        continue;
+      }
+      add_assoc_long(&fn, hp_report_metric_names[m], fns[f].incl[m]);
+      if (m != HP_REPORT_CT) {
+        snprintf(name, sizeof(name), "excl_%s", hp_report_metric_names[m]);
+        add_assoc_long(&fn, name, fns[f].excl[m]);
+      }
+    }
+    add_assoc_zval_ex(&functions, prof.strings.strs[f], prof.strings.lens[f],
+                      &fn);
+  }
+
+  array_init(&lists);
+  for (m = 0; m < HP_REPORT_METRICS && top > 0; m++) {
+    for (excl = 1; excl >= 0 && present[m]; excl--) {
+      char   name[16];
+      zval   list;
+      size_t n, i;
+
+      if (excl && m == HP_REPORT_CT) {
+        continue;
+      }
+
+      n = hp_report_top(fns, prof.strings.count, m, excl, best, top);
+      array_init_size(&list, n);
+      for (i = 0; i < n; i++) {
+        const hp_report_fn_t *fn = &fns[best[i]];
+
+        add_assoc_long_ex(&list, prof.strings.strs[best[i]],
+                          prof.strings.lens[best[i]],
+                          excl ? fn->excl[m] : fn->incl[m]);
+      }
+      snprintf(name, sizeof(name), "%s%s", excl ? "excl_" : "",
+               hp_report_metric_names[m]);
+      add_assoc_zval(&lists, name, &list);
+    }
+  }
+
+  array_init(out);
+  add_assoc_zval(out, "functions", &functions);
+  add_assoc_zval(out, "top", &lists);
+  ret = SUCCESS;
+
+out:
+  if (best) {
+    efree(best);
+  }
+  free(fns);
+  hp_prof_free(&prof);
+  return ret;
+}
+
+
+/**
+ * **************************
+ * MAIN XHPROF CALLBACKS
+ * **************************
+ */
+
+/**
+ * Replaces all the functions like zend_execute, zend_execute_internal,
+ * etc that needs to be instrumented with their corresponding proxies.
+ *
+ * Without ZTS, hp_begin() installs them and hp_stop() removes them, so that
+ * requests that aren't profiled run at full speed (and with the opcache
+ * JIT, which stays off while zend_execute_ex is replaced).
+ *
+ * With ZTS the hooks are process wide and can't be swapped without racing
+ * other threads, so they are installed once from MINIT and the proxies
+ * fall through to the originals while XHPROF_G(enabled) is off. That costs
+ * every request the slower call path, profiled or not.
+ *
+ * @param builtins  proxy zend_execute_internal() too
+ */
+static void hp_install_hooks(int builtins) {
+  /* Replace zend_compile with our proxy */
+  _zend_compile_file = zend_compile_file;
+  zend_compile_file  = hp_compile_file;
+
+  /* Replace zend_compile_string with our proxy */
+  _zend_compile_string = zend_compile_string;
+  zend_compile_string = hp_compile_string;
+
+  /* Replace the error callback with our proxy */
+  _zend_error_cb = zend_error_cb;
+  zend_error_cb  = hp_error_cb;
+
+#if PHP_VERSION_ID >= 70300
+  /* Replace the cycle collector with our proxy */
+  _gc_collect_cycles = gc_collect_cycles;
+  gc_collect_cycles  = hp_gc_collect_cycles;
+#endif
+
+  /* Replace zend_execute with our proxy */
+  _zend_execute_ex = zend_execute_ex;
+  zend_execute_ex  = hp_execute_ex;
+
+  /* Replace zend_execute_internal with our proxy, unless builtins are
+   * neither profiled nor spans. The proxy checks XHPROF_FLAGS_NO_BUILTINS
+   * too, for ZTS. */
+  _zend_execute_internal = zend_execute_internal;
+  if (builtins) {
+    zend_execute_internal = hp_execute_internal;
+  }
+}
+
+/**
+ * Restores the original values replaced by hp_install_hooks(). Called from
+ * hp_stop(), or from MSHUTDOWN with ZTS.
+ */
+static void hp_remove_hooks() {
+  zend_execute_ex       = _zend_execute_ex;
+  zend_execute_internal = _zend_execute_internal;
+  zend_compile_file     = _zend_compile_file;
+  zend_compile_string   = _zend_compile_string;
+  zend_error_cb         = _zend_error_cb;
+#if PHP_VERSION_ID >= 70300
+  gc_collect_cycles     = _gc_collect_cycles;
+#endif
+}
+
+/**
+ * This function gets called once when xhprof gets enabled.
+ * It sets up the current thread's profiler state; the proxies installed by
+ * hp_install_hooks() start profiling as soon as XHPROF_G(enabled) is set.
+ */
+static void hp_begin(long level, long xhprof_flags TSRMLS_DC) {
+  if (!XHPROF_G(enabled)) {
+    int hp_profile_flag = 1;
+
+    XHPROF_G(xhprof_flags) = (uint32)xhprof_flags;
+
+    /* Initialize with the dummy mode first Having these dummy callbacks saves
+     * us from checking if any of the callbacks are NULL everywhere. */
+    XHPROF_G(mode_cb).init_cb     = hp_mode_dummy_init_cb;
+    XHPROF_G(mode_cb).exit_cb     = hp_mode_dummy_exit_cb;
+    XHPROF_G(mode_cb).begin_fn_cb = hp_mode_dummy_beginfn_cb;
+    XHPROF_G(mode_cb).end_fn_cb   = hp_mode_dummy_endfn_cb;
+
+
+    /* Register the appropriate callback functions Override just a subset of
+     * all the callbacks is OK. */
+    switch(level) {
+      case XHPROF_MODE_HIERARCHICAL:
+        XHPROF_G(mode_cb).begin_fn_cb = hp_mode_hier_beginfn_cb;
+        XHPROF_G(mode_cb).end_fn_cb   = hp_mode_hier_endfn_cb;
+        break;
+      case XHPROF_MODE_SAMPLED:
+        XHPROF_G(mode_cb).init_cb     = hp_mode_sampled_init_cb;
+        XHPROF_G(mode_cb).begin_fn_cb = hp_mode_sampled_beginfn_cb;
+        XHPROF_G(mode_cb).end_fn_cb   = hp_mode_sampled_endfn_cb;
+        break;
+      case XHPROF_MODE_COUNTERS:
+        XHPROF_G(mode_cb).init_cb     = hp_mode_counters_init_cb;
+        XHPROF_G(mode_cb).begin_fn_cb = hp_mode_counters_beginfn_cb;
+        XHPROF_G(mode_cb).end_fn_cb   = hp_mode_counters_endfn_cb;
+        break;
+    }
+
+
+    /* one time initializations */
+    hp_init_profiler_state(level TSRMLS_CC);
+
+    if (level == XHPROF_MODE_HIERARCHICAL
+        && (XHPROF_G(xhprof_flags)
+            & (XHPROF_FLAGS_OVERHEAD | XHPROF_FLAGS_COMPENSATE
+               | XHPROF_FLAGS_ADAPTIVE))) {
+      hp_calibrate_overhead(TSRMLS_C);
+    }
+    XHPROF_G(adaptive_tsc) = 0;
+    if ((XHPROF_G(xhprof_flags) & XHPROF_FLAGS_ADAPTIVE)
+        && INI_INT("xhprof.adaptive_threshold_us") > 0) {
+      XHPROF_G(adaptive_tsc) = get_tsc_from_us(
+        (uint64)INI_INT("xhprof.adaptive_threshold_us"),
+        XHPROF_G(cpu_frequencies)[XHPROF_G(cur_cpu_id)]);
+    }
+    XHPROF_G(call_count) = 0;
+    XHPROF_G(flush_call_count) = 0;
+    gettimeofday(&XHPROF_G(begin_time), NULL);
+    getrusage(RUSAGE_SELF, &XHPROF_G(begin_ru));
+    XHPROF_G(flush_seq)  = 0;
+    XHPROF_G(flush_jobs) = 0;
+    hp_flush_schedule(TSRMLS_C);
+
+#ifndef ZTS
+    hp_install_hooks(!(XHPROF_G(xhprof_flags) & XHPROF_FLAGS_NO_BUILTINS)
+                     || XHPROF_G(span_function_names));
+#endif
+
+    /* From here on the proxies profile this thread */
+    XHPROF_G(enabled) = 1;
+
+    /* start profiling from fictitious main() */
+    BEGIN_PROFILING(&XHPROF_G(entries), ROOT_SYMBOL, hp_profile_flag);
+  }
+}
+
 
 /**
  * Called at request shutdown time. Cleans the profiler's global state.
@@ -1336,13 +4037,21 @@ static void hp_begin(long level, long xhprof_flags TSRMLS_DC) {
 static void hp_end(TSRMLS_D) {
 
   /* Bail if not ever enabled */
-  if (!hp_globals.ever_enabled) {
+  if (!XHPROF_G(ever_enabled)) {
     return;
   }
 
-  /* Stop profiler if enabled */
-  if (hp_globals.enabled) {
+  /* Stop profiler if enabled, the profile goes to the collector if any
+   * and if it is worth keeping */
+  if (XHPROF_G(enabled)) {
     hp_stop(TSRMLS_C);
+    if (XHPROF_G(profiler_level) == XHPROF_MODE_COUNTERS) {
+      /* The calls are in the counters table already */
+    } else if (hp_keep_profile(TSRMLS_C)) {
+      hp_collector_send(TSRMLS_C);
+    } else {
+      XHPROF_G(profiles_discarded)++;
+    }
   }
 
   /* Clean up state */
@@ -1350,28 +4059,66 @@ static void hp_end(TSRMLS_D) {
 }
 
 /**
- * Called from xhprof_disable(). Removes all the proxies setup by
- * hp_begin() and restores the original values.
+ * Whether to profile this request, one in every n on average, for
+ * xhprof.sample_requests.
+ */
+static int hp_sample_request(zend_long n) {
+#if PHP_VERSION_ID >= 70100
+  return php_mt_rand_range(0, (uint32_t)(n - 1)) == 0;
+#else
+  return rand() % n == 0;
+#endif
+}
+
+/**
+ * Drop the profile xhprof.sample_requests started in RINIT, for
+ * xhprof_enable() or xhprof_sample_enable() to start over with their own
+ * flags and options.
+ */
+static void hp_sample_request_stop(TSRMLS_D) {
+  if (XHPROF_G(enabled) && XHPROF_G(request_sampled)) {
+    hp_stop(TSRMLS_C);
+    zval_dtor(&XHPROF_G(stats_count));
+  }
+  XHPROF_G(request_sampled) = 0;
+}
+
+/**
+ * Called from xhprof_disable(). Closes the open frames and removes the
+ * proxies setup by hp_install_hooks(), or with ZTS turns them back into
+ * pass-throughs.
  */
 static void hp_stop(TSRMLS_D) {
   int   hp_profile_flag = 1;
 
-  /* End any unfinished calls */
-  while (hp_globals.entries) {
-    END_PROFILING(&hp_globals.entries, hp_profile_flag);
+  /* End any unfinished calls, including those of suspended fibers */
+  hp_fiber_stacks_close(TSRMLS_C);
+  while (XHPROF_G(entries)) {
+    END_PROFILING(&XHPROF_G(entries), hp_profile_flag);
   }
 
- 
-  zend_execute_ex       = _zend_execute_ex;
-  zend_execute_internal = _zend_execute_internal;
-  zend_compile_file     = _zend_compile_file;
-  zend_compile_string   = _zend_compile_string;
+  if (XHPROF_G(profiler_level) == XHPROF_MODE_HIERARCHICAL
+      && (XHPROF_G(xhprof_flags)
+          & (XHPROF_FLAGS_OVERHEAD | XHPROF_FLAGS_COMPENSATE))) {
+    hp_add_overhead_entry(TSRMLS_C);
+  }
+  if (XHPROF_G(xhprof_flags) & XHPROF_FLAGS_ADAPTIVE) {
+    hp_add_folded_entries(TSRMLS_C);
+  }
+  hp_sampled_edges_finish(TSRMLS_C);
+  hp_sampled_edges_destroy(TSRMLS_C);
 
-  /* Resore cpu affinity. */
-  restore_cpu_affinity(&hp_globals.prev_mask);
+  /* Resore cpu affinity, counters mode never changed it. */
+  if (XHPROF_G(profiler_level) != XHPROF_MODE_COUNTERS) {
+    restore_cpu_affinity(&XHPROF_G(prev_mask));
+  }
 
   /* Stop profiling */
-  hp_globals.enabled = 0;
+  XHPROF_G(enabled) = 0;
+
+#ifndef ZTS
+  hp_remove_hooks();
+#endif
 
 }
 
@@ -1428,27 +4175,21 @@ static char **hp_strings_in_zval(zval  *values) {
       return result;
     }
 
-    for (zend_hash_internal_pointer_reset(ht);
-         zend_hash_has_more_elements(ht) == SUCCESS;
-         zend_hash_move_forward(ht)) {
-      
+    {
       zend_string *str;
-      zend_ulong  len;
-      HashPosition idx;
+      zend_ulong   num;
+      zval        *data;
 
-      int    type;
-      zval *data;
-
-      type = zend_hash_get_current_key_ex(ht, &str, &len, &idx);
-      /* Get the names stored in a standard array */
-      if(type == HASH_KEY_IS_LONG) {
-        data = zend_hash_get_current_data_ex(ht, &idx);
-        if (Z_TYPE_P(data) == IS_STRING &&
+      ZEND_HASH_FOREACH_KEY_VAL(ht, num, str, data) {
+        /* Get the names stored in a standard array */
+        if (str == NULL &&
+            Z_TYPE_P(data) == IS_STRING &&
             strcmp(Z_STRVAL_P(data), ROOT_SYMBOL)) { /* do not ignore "main" */
           result[ix] = estrdup(Z_STRVAL_P(data));
           ix++;
         }
-      }
+        (void)num;
+      } ZEND_HASH_FOREACH_END();
     }
 
   } else if(Z_TYPE_P(values) == IS_STRING) {
@@ -1475,10 +4216,6 @@ static char **hp_strings_in_zval(zval  *values) {
 //////////////////////////
 //////////////////////////
 
-/* If you declare any globals in php_md_xhprof.h uncomment this:
-ZEND_DECLARE_MODULE_GLOBALS(md_xhprof)
-*/
-
 /* True global resources - no need for thread safety here */
 static int le_md_xhprof;
 
@@ -1488,6 +4225,22 @@ static int le_md_xhprof;
 PHP_INI_BEGIN()
 
 PHP_INI_ENTRY("xhprof.output_dir", "", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.stream", "", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.flush_interval", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.flush_jobs", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.collector", "", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.max_edges", "100000", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.max_key_bytes", "8388608", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.max_samples", "100000", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.max_spans", "1000", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.adaptive_threshold_us", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.sample_requests", "0", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY("xhprof.sample_flags", "0", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY("xhprof.keep_wt", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.keep_cpu", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.keep_pmu", "0", PHP_INI_ALL, NULL)
+PHP_INI_ENTRY("xhprof.counters", "0", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY("xhprof.max_counters", "4096", PHP_INI_SYSTEM, NULL)
 
 PHP_INI_END()
 
@@ -1499,7 +4252,9 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_enable, 0, 0, 0)
   ZEND_ARG_INFO(0, options)
 ZEND_END_ARG_INFO()
 
-ZEND_BEGIN_ARG_INFO(arginfo_xhprof_disable, 0)
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_disable, 0, 0, 0)
+  ZEND_ARG_INFO(0, summary)
+  ZEND_ARG_INFO(0, top)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO(arginfo_xhprof_sample_enable, 0)
@@ -1508,6 +4263,57 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO(arginfo_xhprof_sample_disable, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_flush, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_job_end, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_spans, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_tag, 0)
+  ZEND_ARG_INFO(0, key)
+  ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_tags, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_keep, 0, 0, 0)
+  ZEND_ARG_INFO(0, keep)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_span_begin, 0, 0, 1)
+  ZEND_ARG_INFO(0, name)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_xhprof_span_end, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_diff, 0, 0, 2)
+  ZEND_ARG_INFO(0, before)
+  ZEND_ARG_INFO(0, after)
+  ZEND_ARG_INFO(0, metric)
+  ZEND_ARG_INFO(0, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_merge, 0, 0, 2)
+  ZEND_ARG_INFO(0, profiles)
+  ZEND_ARG_INFO(0, output)
+  ZEND_ARG_INFO(0, per_run)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_counters, 0, 0, 0)
+  ZEND_ARG_INFO(0, top)
+ZEND_END_ARG_INFO()
+
+#ifdef XHPROF_BENCH
+ZEND_BEGIN_ARG_INFO_EX(arginfo_xhprof_microbench, 0, 0, 0)
+  ZEND_ARG_INFO(0, iterations)
+ZEND_END_ARG_INFO()
+#endif
+
 
 /**
  * Start XHProf profiling in hierarchical mode.
@@ -1525,7 +4331,12 @@ PHP_FUNCTION(xhprof_enable) {
     return;
   }
 
+  hp_counters_stop(TSRMLS_C);
+  hp_sample_request_stop(TSRMLS_C);
   hp_get_ignored_functions_from_arg(optional_array);
+  hp_get_allowed_functions_from_arg(optional_array);
+  hp_get_call_sample_rate_from_arg(optional_array);
+  hp_get_span_functions_from_arg(optional_array);
 
   hp_begin(XHPROF_MODE_HIERARCHICAL, xhprof_flags TSRMLS_CC);
 }
@@ -1534,18 +4345,567 @@ PHP_FUNCTION(xhprof_enable) {
  * Stops XHProf from profiling in hierarchical mode anymore and returns the
  * profile info.
  *
- * @param  void
+ * @param  long $summary  XHPROF_SUMMARY to get ["edges" => profile info,
+ *                        "summary" => per function summary], or
+ *                        XHPROF_SUMMARY_ONLY for just the summary
+ * @param  long $top      functions in the top lists of the summary, which
+ *                        can't be negative
  * @return array  hash-array of XHProf's profile info
  * @author kannan, hzhao
  */
 PHP_FUNCTION(xhprof_disable) {
-	if (hp_globals.enabled) {
+  zend_long summary = 0;
+  zend_long top     = XHPROF_SUMMARY_TOP;
+  zval      functions;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                            "|ll", &summary, &top) == FAILURE) {
+    return;
+  }
+  if (top < 0) {
+    php_error_docref(NULL, E_WARNING, "top must not be negative");
+    RETURN_FALSE;
+  }
+
+	if (XHPROF_G(enabled)
+	    && XHPROF_G(profiler_level) != XHPROF_MODE_COUNTERS) {
     hp_stop(TSRMLS_C);
-		RETURN_ZVAL(&hp_globals.stats_count, 1, 1);
+    if (!(summary & (XHPROF_SUMMARY | XHPROF_SUMMARY_ONLY))) {
+		  RETURN_ZVAL(&XHPROF_G(stats_count), 1, 1);
+    }
+
+    /* The profile info is handed over to the caller, or freed */
+    if (hp_summary(&XHPROF_G(stats_count), top, &functions) != SUCCESS) {
+      zval_ptr_dtor(&XHPROF_G(stats_count));
+      RETURN_FALSE;
+    }
+    if (summary & XHPROF_SUMMARY_ONLY) {
+      zval_ptr_dtor(&XHPROF_G(stats_count));
+      RETURN_ZVAL(&functions, 0, 0);
+    }
+    array_init(return_value);
+    add_assoc_zval(return_value, "edges", &XHPROF_G(stats_count));
+    add_assoc_zval(return_value, "summary", &functions);
+    return;
 	}
   /* else null is returned */
 }
 
+/**
+ * Stream what was profiled since xhprof_enable() or the last flush to
+ * xhprof.stream, then go on profiling from empty counters.
+ *
+ * @return bool  true if the profile was written
+ */
+PHP_FUNCTION(xhprof_flush) {
+  if (!XHPROF_G(enabled)) {
+    RETURN_FALSE;
+  }
+  RETURN_BOOL(hp_flush(TSRMLS_C) == SUCCESS);
+}
+
+/**
+ * Mark the end of a job in a long running worker. Flushes once every
+ * xhprof.flush_jobs jobs, or when xhprof.flush_interval has passed.
+ *
+ * @return bool  true if this call flushed
+ */
+PHP_FUNCTION(xhprof_job_end) {
+  zend_long jobs = INI_INT("xhprof.flush_jobs");
+
+  if (!XHPROF_G(enabled)) {
+    RETURN_FALSE;
+  }
+
+  XHPROF_G(flush_jobs)++;
+  if ((jobs > 0 && XHPROF_G(flush_jobs) >= jobs)
+      || XHPROF_G(flush_due)
+      || (XHPROF_G(flush_deadline_tsc)
+          && cycle_timer() >= XHPROF_G(flush_deadline_tsc))) {
+    RETURN_BOOL(hp_flush(TSRMLS_C) == SUCCESS);
+  }
+  RETURN_FALSE;
+}
+
+/**
+ * Get the spans recorded since the last xhprof_enable() with the "spans"
+ * option. They stay available after xhprof_disable().
+ *
+ * @return array  function => fingerprint => ["ct" => calls, "wt" => us]
+ */
+PHP_FUNCTION(xhprof_spans) {
+  if (Z_TYPE(XHPROF_G(spans)) == IS_ARRAY) {
+    RETURN_ZVAL(&XHPROF_G(spans), 1, 0);
+  }
+  array_init(return_value);
+}
+
+/**
+ * Tag the profile of the request, e.g. with the route or the customer. The
+ * tags are stored with the profiles streamed or sent to the collector, and
+ * last until the end of the request.
+ *
+ * @param  string  key
+ * @param  string  value
+ */
+PHP_FUNCTION(xhprof_tag) {
+  zend_string *key;
+  zend_string *value;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "SS",
+                            &key, &value) == FAILURE) {
+    return;
+  }
+
+  if (Z_TYPE(XHPROF_G(tags)) != IS_ARRAY) {
+    array_init(&XHPROF_G(tags));
+  }
+  add_assoc_str_ex(&XHPROF_G(tags), ZSTR_VAL(key), ZSTR_LEN(key),
+                   zend_string_copy(value));
+}
+
+/**
+ * Get the metadata stored with the profile of the request: the
+ * "request.method", "request.uri", "request.sapi", "request.pmu" (peak
+ * memory) and "request.wt" (time since the request started, in us) of the
+ * request, and the tags set with xhprof_tag().
+ *
+ * @return array  key => value, all strings
+ */
+PHP_FUNCTION(xhprof_tags) {
+  hp_request_meta(return_value TSRMLS_CC);
+}
+
+/**
+ * Keep, or discard, the profile of the request whatever the xhprof.keep_*
+ * thresholds say, e.g. for a request that failed.
+ *
+ * @param  bool  keep (optional) true to keep, false to discard
+ * @return bool  whether the profile would be kept if the request ended now
+ */
+PHP_FUNCTION(xhprof_keep) {
+  zval *decided = NULL;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|z",
+                            &decided) == FAILURE) {
+    return;
+  }
+
+  if (decided) {
+    XHPROF_G(keep) = zend_is_true(decided) ? 1 : -1;
+  }
+  RETURN_BOOL(hp_keep_profile(TSRMLS_C));
+}
+
+/**
+ * Open a code region, profiled as a call of "name" from the current
+ * function until xhprof_span_end(). Regions must be closed in the
+ * function that opened them.
+ *
+ * @param  string  name
+ * @return bool  true if the region is profiled
+ */
+PHP_FUNCTION(xhprof_span_begin) {
+  zend_string *name;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "S",
+                            &name) == FAILURE) {
+    return;
+  }
+  RETURN_BOOL(hp_marker_begin(name TSRMLS_CC) == SUCCESS);
+}
+
+/**
+ * Close the innermost region opened with xhprof_span_begin().
+ *
+ * @return bool  false if no region is open at this level
+ */
+PHP_FUNCTION(xhprof_span_end) {
+  RETURN_BOOL(hp_marker_end(NULL TSRMLS_CC) == SUCCESS);
+}
+
+/**
+ * new XHProfSpan(name): a code region until the object is destroyed,
+ * usually when the variable holding it goes out of scope.
+ */
+PHP_METHOD(XHProfSpan, __construct) {
+  zend_string *name;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "S",
+                            &name) == FAILURE) {
+    return;
+  }
+
+#if PHP_VERSION_ID >= 80000
+  zend_update_property_str(hp_span_ce, Z_OBJ_P(getThis()), "name",
+                           sizeof("name") - 1, name);
+#else
+  zend_update_property_str(hp_span_ce, getThis(), "name",
+                           sizeof("name") - 1, name);
+#endif
+  hp_marker_begin(name TSRMLS_CC);
+}
+
+PHP_METHOD(XHProfSpan, __destruct) {
+  zval *name;
+  zval  tmp;
+
+#if PHP_VERSION_ID >= 80000
+  name = zend_read_property(hp_span_ce, Z_OBJ_P(getThis()), "name",
+                            sizeof("name") - 1, 1, &tmp);
+#else
+  name = zend_read_property(hp_span_ce, getThis(), "name",
+                            sizeof("name") - 1, 1, &tmp);
+#endif
+  if (name && Z_TYPE_P(name) == IS_STRING) {
+    hp_marker_end(Z_STR_P(name) TSRMLS_CC);
+  }
+}
+
+static const zend_function_entry hp_span_methods[] = {
+  PHP_ME(XHProfSpan, __construct, arginfo_xhprof_span_begin, ZEND_ACC_PUBLIC)
+  PHP_ME(XHProfSpan, __destruct, arginfo_xhprof_span_end, ZEND_ACC_PUBLIC)
+  PHP_FE_END
+};
+
+/**
+ * Compare two stored profiles (xhprof.stream files, or what a collector
+ * wrote) without loading them into PHP arrays. Profiles merged from
+ * several runs are compared per run.
+ *
+ * @param  string $before  profile file
+ * @param  string $after   profile file
+ * @param  string $metric  ct, wt, cpu, mu, pmu or io: what the rows are
+ *                         sorted by
+ * @param  long   $limit   rows to return, 0 for all
+ * @return array  rows, biggest change of $metric first, each with "symbol",
+ *                "type" ("function" or "edge"), and "before", "after" and
+ *                "delta" arrays of every metric. Functions have their
+ *                exclusive metrics there and their inclusive ones in
+ *                "before_incl" and "after_incl". false if a profile can't
+ *                be read.
+ */
+PHP_FUNCTION(xhprof_diff) {
+  char             *before_path, *after_path, *metric_name = "wt";
+  size_t            before_len, after_len, metric_len = 2;
+  zend_long         limit = 0;
+  hp_prof_t         before, after;
+  hp_report_diff_t *rows;
+  size_t            nrows, shown, i;
+  int               metric, m;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "pp|sl",
+                            &before_path, &before_len,
+                            &after_path, &after_len,
+                            &metric_name, &metric_len, &limit) == FAILURE) {
+    return;
+  }
+
+  if ((metric = hp_report_metric(metric_name)) < 0) {
+    php_error_docref(NULL, E_WARNING, "Unknown metric '%s'", metric_name);
+    RETURN_FALSE;
+  }
+
+  if (php_check_open_basedir(before_path) || php_check_open_basedir(after_path)) {
+    RETURN_FALSE;
+  }
+
+  if (hp_prof_load(before_path, &before) < 0) {
+    php_error_docref(NULL, E_WARNING, "Can't read profile %s", before_path);
+    RETURN_FALSE;
+  }
+  if (hp_prof_load(after_path, &after) < 0) {
+    php_error_docref(NULL, E_WARNING, "Can't read profile %s", after_path);
+    hp_prof_free(&before);
+    RETURN_FALSE;
+  }
+
+  if (hp_report_diff(&before, &after, metric, &rows, &nrows) < 0) {
+    hp_prof_free(&before);
+    hp_prof_free(&after);
+    RETURN_FALSE;
+  }
+
+  shown = limit > 0 && (size_t)limit < nrows ? (size_t)limit : nrows;
+
+  array_init_size(return_value, shown);
+  for (i = 0; i < shown; i++) {
+    const hp_report_diff_t *row = &rows[i];
+    const int64_t *b = row->is_edge ? row->before : row->before_excl;
+    const int64_t *a = row->is_edge ? row->after : row->after_excl;
+    zval item, vb, va, vd;
+
+    array_init(&item);
+    array_init(&vb);
+    array_init(&va);
+    array_init(&vd);
+    for (m = 0; m < HP_REPORT_METRICS; m++) {
+      add_assoc_long(&vb, hp_report_metric_names[m], b[m]);
+      add_assoc_long(&va, hp_report_metric_names[m], a[m]);
+      add_assoc_long(&vd, hp_report_metric_names[m], a[m] - b[m]);
+    }
+    add_assoc_string(&item, "symbol", row->symbol);
+    add_assoc_string(&item, "type", row->is_edge ? "edge" : "function");
+    add_assoc_zval(&item, "before", &vb);
+    add_assoc_zval(&item, "after", &va);
+    add_assoc_zval(&item, "delta", &vd);
+
+    if (!row->is_edge) {
+      array_init(&vb);
+      array_init(&va);
+      for (m = 0; m < HP_REPORT_METRICS; m++) {
+        add_assoc_long(&vb, hp_report_metric_names[m], row->before[m]);
+        add_assoc_long(&va, hp_report_metric_names[m], row->after[m]);
+      }
+      add_assoc_zval(&item, "before_incl", &vb);
+      add_assoc_zval(&item, "after_incl", &va);
+    }
+    add_next_index_zval(return_value, &item);
+  }
+
+  hp_report_diff_free(rows, nrows);
+  hp_prof_free(&before);
+  hp_prof_free(&after);
+}
+
+/**
+ * Merge stored profiles into one file. This runs in the calling process;
+ * tools/xhprof_merge does the same on all cores for large batches.
+ *
+ * @param  array  $profiles  profile files
+ * @param  string $output    file the merged profile is written to
+ * @param  bool   $per_run   write averages per run instead of totals
+ * @return int  runs merged, or false if a profile can't be read or the
+ *              output can't be written
+ */
+PHP_FUNCTION(xhprof_merge) {
+  zval         *profiles, *path;
+  char         *output;
+  size_t        output_len;
+  zend_bool     per_run = 0;
+  hp_prof_t     merged;
+  hp_prof_buf_t buf;
+  size_t        done = 0;
+  int           fd;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ap|b",
+                            &profiles, &output, &output_len,
+                            &per_run) == FAILURE) {
+    return;
+  }
+
+  hp_prof_init(&merged);
+  merged.runs = 0;
+  memset(&buf, 0, sizeof(buf));
+
+  ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(profiles), path) {
+    hp_prof_t one;
+
+    if (Z_TYPE_P(path) != IS_STRING
+        || php_check_open_basedir(Z_STRVAL_P(path))) {
+      goto out;
+    }
+    if (hp_prof_load(Z_STRVAL_P(path), &one) < 0) {
+      php_error_docref(NULL, E_WARNING, "Can't read profile %s",
+                       Z_STRVAL_P(path));
+      goto out;
+    }
+    if (hp_prof_merge(&merged, &one) < 0) {
+      hp_prof_free(&one);
+      goto out;
+    }
+    hp_prof_free(&one);
+  } ZEND_HASH_FOREACH_END();
+
+  merged.time_us = (uint64)time(NULL) * 1000000;
+  merged.pid     = (uint32)getpid();
+  merged.seq     = 0;
+  if ((per_run && hp_prof_normalize(&merged) < 0)
+      || hp_prof_write(&merged, &buf) < 0) {
+    goto out;
+  }
+
+  if (php_check_open_basedir(output)
+      || (fd = open(output, O_WRONLY | O_TRUNC | O_CREAT, 0644)) < 0) {
+    goto out;
+  }
+  while (done < buf.len) {
+    ssize_t n = write(fd, buf.data + done, buf.len - done);
+
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+
+out:
+  if (buf.len && done == buf.len) {
+    RETVAL_LONG(merged.runs);
+  } else {
+    RETVAL_FALSE;
+  }
+  hp_prof_buf_free(&buf);
+  hp_prof_free(&merged);
+}
+
+/**
+ * The per-function totals of all the processes since the server started,
+ * with xhprof.counters on.
+ *
+ * @param  long $top  keep the most expensive (by wt) functions only
+ * @return array  function => ["ct" => calls, "wt" => us], the most
+ *                expensive first; false when xhprof.counters is off
+ */
+PHP_FUNCTION(xhprof_counters) {
+  zend_long         top = 0;
+  hp_counter_row_t *rows;
+  uint32            count, i;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l",
+                            &top) == FAILURE) {
+    return;
+  }
+  if (!hp_counters) {
+    RETURN_FALSE;
+  }
+
+  rows = hp_counters_collect(top, &count);
+  array_init(return_value);
+  for (i = 0; i < count; i++) {
+    const char *name;
+    size_t      len;
+    zval        totals;
+
+    name = hp_counter_name(rows[i].slot, &len);
+    array_init(&totals);
+    add_assoc_long(&totals, "ct", (zend_long)rows[i].ct);
+    add_assoc_long(&totals, "wt", (zend_long)rows[i].wt);
+    add_assoc_zval_ex(return_value, name, len, &totals);
+  }
+  efree(rows);
+}
+
+/**
+ * xhprof_counters() as OpenMetrics text, which Prometheus reads too, for
+ * a metrics endpoint:
+ *
+ *   header('Content-Type: application/openmetrics-text; version=1.0.0');
+ *   echo xhprof_counters_export(100);
+ *
+ * @param  long $top  export the most expensive (by wt) functions only
+ * @return string  the metrics, or false when xhprof.counters is off
+ */
+PHP_FUNCTION(xhprof_counters_export) {
+  zend_long     top = 0;
+  hp_prof_buf_t buf;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l",
+                            &top) == FAILURE) {
+    return;
+  }
+  if (!hp_counters) {
+    RETURN_FALSE;
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  if (hp_counters_export(top, &buf) < 0) {
+    RETVAL_FALSE;
+  } else {
+    RETVAL_STRINGL((char *)buf.data, buf.len);
+  }
+  hp_prof_buf_free(&buf);
+}
+
+#ifdef XHPROF_BENCH
+/* A typical long namespaced method name */
+#define HP_BENCH_SYMBOL \
+  "App\\Http\\Middleware\\VerifyCsrfToken::handle"
+
+static uint64 hp_bench_now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Time the profiler's hot paths in isolation. Only built with
+ * --enable-md_xhprof_bench, it backs bench/bench.php.
+ *
+ * @param  long $iterations  how many times to run each operation
+ * @return array  operation => nanoseconds per operation. "call" (a whole
+ *                profiled call in the current mode) is only measured while
+ *                profiling is enabled.
+ */
+PHP_FUNCTION(xhprof_microbench) {
+  zend_long     iterations = 100000;
+  zend_long     i;
+  uint64        start;
+  volatile uint8 sink = 0;
+
+  if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC,
+                            "|l", &iterations) == FAILURE) {
+    return;
+  }
+  if (iterations <= 0) {
+    iterations = 1;
+  }
+
+  array_init(return_value);
+
+  /* Function name hashing */
+  start = hp_bench_now_ns();
+  for (i = 0; i < iterations; i++) {
+    sink += hp_inline_hash(HP_BENCH_SYMBOL);
+  }
+  add_assoc_double(return_value, "hash",
+                   (double)(hp_bench_now_ns() - start) / iterations);
+
+  /* Building the "parent==>child" name */
+  {
+    hp_entry_t parent, child;
+    char       symbol[SCRATCH_BUF_LEN];
+
+    memset(&parent, 0, sizeof(parent));
+    memset(&child, 0, sizeof(child));
+    parent.name_hprof = HP_BENCH_SYMBOL;
+    child.name_hprof  = HP_BENCH_SYMBOL;
+    child.rlvl_hprof  = 1;
+    child.prev_hprof  = &parent;
+
+    start = hp_bench_now_ns();
+    for (i = 0; i < iterations; i++) {
+      sink += hp_get_function_stack(&child, 2, symbol, sizeof(symbol));
+    }
+    add_assoc_double(return_value, "name",
+                     (double)(hp_bench_now_ns() - start) / iterations);
+  }
+
+  /* Pushing and popping a stack entry */
+  start = hp_bench_now_ns();
+  for (i = 0; i < iterations; i++) {
+    hp_fast_free_hprof_entry(hp_fast_alloc_hprof_entry());
+  }
+  add_assoc_double(return_value, "stack",
+                   (double)(hp_bench_now_ns() - start) / iterations);
+
+  /* A whole profiled call, with the current mode and flags */
+  if (XHPROF_G(enabled)) {
+    hp_scratch_t saved;
+
+    hp_scratch_enter(&saved TSRMLS_CC);
+    start = hp_bench_now_ns();
+    hp_scratch_calls((int)iterations TSRMLS_CC);
+    add_assoc_double(return_value, "call",
+                     (double)(hp_bench_now_ns() - start) / iterations);
+    hp_scratch_leave(&saved TSRMLS_CC);
+  }
+
+  (void)sink;
+}
+#endif
+
 /**
  * Start XHProf profiling in sampling mode.
  *
@@ -1554,7 +4914,12 @@ PHP_FUNCTION(xhprof_disable) {
  */
 PHP_FUNCTION(xhprof_sample_enable) {
 	long  xhprof_flags = 0;                                    /* XHProf flags */
+  hp_counters_stop(TSRMLS_C);
+  hp_sample_request_stop(TSRMLS_C);
   hp_get_ignored_functions_from_arg(NULL);
+  hp_get_allowed_functions_from_arg(NULL);
+  hp_get_call_sample_rate_from_arg(NULL);
+  hp_get_span_functions_from_arg(NULL);
   hp_begin(XHPROF_MODE_SAMPLED, xhprof_flags TSRMLS_CC);
 }
 
@@ -1567,60 +4932,94 @@ PHP_FUNCTION(xhprof_sample_enable) {
  * @author cjiang
  */
 PHP_FUNCTION(xhprof_sample_disable) {
-  if (hp_globals.enabled) {
+  if (XHPROF_G(enabled)
+      && XHPROF_G(profiler_level) != XHPROF_MODE_COUNTERS) {
     hp_stop(TSRMLS_C);
-    RETURN_ZVAL(&hp_globals.stats_count, 1, 1);
+    RETURN_ZVAL(&XHPROF_G(stats_count), 1, 1);
   }
 }
 
 
 
 
-/* {{{ php_md_xhprof_init_globals
+/* {{{ PHP_GINIT_FUNCTION
  */
-/* Uncomment this function if you have INI entries
-static void php_md_xhprof_init_globals(zend_md_xhprof_globals *md_xhprof_globals)
+PHP_GINIT_FUNCTION(md_xhprof)
 {
-	md_xhprof_globals->global_value = 0;
-	md_xhprof_globals->global_string = NULL;
+#if defined(COMPILE_DL_MD_XHPROF) && defined(ZTS)
+  ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+  memset(md_xhprof_globals, 0, sizeof(*md_xhprof_globals));
+
+  /* Get the number of available logical CPUs. */
+  md_xhprof_globals->cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+
+  /* Initialize cpu_frequencies and cur_cpu_id. They, and the saved cpu
+   * affinity, are filled in lazily by the first xhprof_enable() of the
+   * thread. */
+  md_xhprof_globals->cpu_frequencies = NULL;
+  md_xhprof_globals->cur_cpu_id = 0;
+
+  /* no free hp_entry_t structures to start with */
+  md_xhprof_globals->entry_free_list = NULL;
+
+  /* the collector socket is opened on the first send */
+  md_xhprof_globals->collector_fd = -1;
+}
+/* }}} */
+
+/* {{{ PHP_GSHUTDOWN_FUNCTION
+ */
+PHP_GSHUTDOWN_FUNCTION(md_xhprof)
+{
+  /* Make sure cpu_frequencies is free'ed. */
+  if (md_xhprof_globals->cpu_frequencies) {
+    free(md_xhprof_globals->cpu_frequencies);
+    md_xhprof_globals->cpu_frequencies = NULL;
+  }
+
+  /* free any remaining items in the free list */
+  hp_free_the_free_list(md_xhprof_globals->entry_free_list);
+  md_xhprof_globals->entry_free_list = NULL;
+
+  if (md_xhprof_globals->collector_fd >= 0) {
+    close(md_xhprof_globals->collector_fd);
+    md_xhprof_globals->collector_fd = -1;
+  }
 }
-*/
 /* }}} */
 
 /* {{{ PHP_MINIT_FUNCTION
  */
 PHP_MINIT_FUNCTION(md_xhprof)
 {
-    int i;
+    zend_class_entry ce;
 
     REGISTER_INI_ENTRIES();
     hp_register_constants(INIT_FUNC_ARGS_PASSTHRU);
 
-  	/* Get the number of available logical CPUs. */
-    hp_globals.cpu_num = sysconf(_SC_NPROCESSORS_CONF);
+    INIT_CLASS_ENTRY(ce, "XHProfSpan", hp_span_methods);
+    hp_span_ce = zend_register_internal_class(&ce);
+    hp_span_ce->ce_flags |= ZEND_ACC_FINAL;
+    zend_declare_property_null(hp_span_ce, "name", sizeof("name") - 1,
+                               ZEND_ACC_PRIVATE);
 
-  /* Get the cpu affinity mask. */
-#ifndef __APPLE__
-  	if (GET_AFFINITY(0, sizeof(cpu_set_t), &hp_globals.prev_mask) < 0) {
-    	perror("getaffinity");
-    	return FAILURE;
-  	}
-#else
-  CPU_ZERO(&(hp_globals.prev_mask));
+    hp_hash_init();
+    hp_counters_init();
+#ifdef ZTS
+    hp_install_hooks(1);
 #endif
 
-  	/* Initialize cpu_frequencies and cur_cpu_id. */
-  	hp_globals.cpu_frequencies = NULL;
-  	hp_globals.cur_cpu_id = 0;
-
-  	/* no free hp_entry_t structures to start with */
-  	hp_globals.entry_free_list = NULL;
-
-  	for (i = 0; i < 256; i++) {
-    	hp_globals.func_hash_counters[i] = 0;
-  	}
+#if PHP_VERSION_ID >= 80000
+    hp_resource_handle = zend_get_resource_handle("md_xhprof");
+#else
+    hp_resource_handle = zend_get_resource_handle(&hp_resource_owner);
+#endif
 
-  	hp_ignored_functions_filter_clear();
+#if PHP_VERSION_ID >= 80100
+    zend_observer_fiber_switch_register(hp_fiber_switch_cb);
+#endif
 
 #if defined(DEBUG)
     /* To make it random number generator repeatable to ease testing. */
@@ -1635,11 +5034,10 @@ PHP_MINIT_FUNCTION(md_xhprof)
  */
 PHP_MSHUTDOWN_FUNCTION(md_xhprof)
 {
-	/* Make sure cpu_frequencies is free'ed. */
-  clear_frequencies();
-
-  /* free any remaining items in the free list */
-	hp_free_the_free_list();
+#ifdef ZTS
+	hp_remove_hooks();
+#endif
+	hp_counters_shutdown();
 
 	UNREGISTER_INI_ENTRIES();
 	return SUCCESS;
@@ -1651,6 +5049,23 @@ PHP_MSHUTDOWN_FUNCTION(md_xhprof)
  */
 PHP_RINIT_FUNCTION(md_xhprof)
 {
+#if defined(COMPILE_DL_MD_XHPROF) && defined(ZTS)
+	ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+
+	/* Profile one request in xhprof.sample_requests from the start, for
+	 * hp_end() to keep or discard */
+	if (INI_INT("xhprof.sample_requests") > 0
+	    && hp_sample_request(INI_INT("xhprof.sample_requests"))) {
+		hp_begin(XHPROF_MODE_HIERARCHICAL, INI_INT("xhprof.sample_flags")
+		         TSRMLS_CC);
+		XHPROF_G(request_sampled) = 1;
+	}
+
+	/* Otherwise count the calls in the shared table, with xhprof.counters */
+	if (!XHPROF_G(enabled) && hp_counters) {
+		hp_begin(XHPROF_MODE_COUNTERS, 0 TSRMLS_CC);
+	}
 	return SUCCESS;
 }
 /* }}} */
@@ -1661,6 +5076,11 @@ PHP_RINIT_FUNCTION(md_xhprof)
 PHP_RSHUTDOWN_FUNCTION(md_xhprof)
 {
 	hp_end(TSRMLS_C);
+
+	/* Tags and xhprof_keep() may be set without ever profiling */
+	zval_ptr_dtor(&XHPROF_G(tags));
+	ZVAL_UNDEF(&XHPROF_G(tags));
+	XHPROF_G(keep) = 0;
 	return SUCCESS;
 }
 /* }}} */
@@ -1677,25 +5097,52 @@ PHP_MINFO_FUNCTION(md_xhprof)
 	php_info_print_table_start();
 	php_info_print_table_header(2, "md_xhprof support", "enabled");
 
-  len = snprintf(buf, SCRATCH_BUF_LEN, "%d", hp_globals.cpu_num);
+  len = snprintf(buf, SCRATCH_BUF_LEN, "%d", XHPROF_G(cpu_num));
   buf[len] = 0;
   php_info_print_table_header(2, "CPU num", buf);
 
-  if (hp_globals.cpu_frequencies) {
+  if (XHPROF_G(cpu_frequencies)) {
     
     /* Print available cpu frequencies here. */
     php_info_print_table_header(2, "CPU logical id", " Clock Rate (MHz) ");
 
-    for (i = 0; i < hp_globals.cpu_num; ++i) {
+    for (i = 0; i < XHPROF_G(cpu_num); ++i) {
       len = snprintf(buf, SCRATCH_BUF_LEN, " CPU %d ", i);
       buf[len] = 0;
-      len = snprintf(tmp, SCRATCH_BUF_LEN, "%f", hp_globals.cpu_frequencies[i]);
+      len = snprintf(tmp, SCRATCH_BUF_LEN, "%f", XHPROF_G(cpu_frequencies)[i]);
       tmp[len] = 0;
       php_info_print_table_row(2, buf, tmp);
     }
   }
 
   php_info_print_table_row(2, "Version", XHPROF_VERSION);
+  php_info_print_table_row(2, "Name hashing", hp_hash_name());
+
+  /* Counters of this process (or thread) only */
+  if (INI_STR("xhprof.collector") && *INI_STR("xhprof.collector")) {
+    snprintf(buf, SCRATCH_BUF_LEN, "%llu", XHPROF_G(collector_sent));
+    php_info_print_table_row(2, "Collector profiles sent", buf);
+    snprintf(buf, SCRATCH_BUF_LEN, "%llu", XHPROF_G(collector_busy));
+    php_info_print_table_row(2, "Collector drops (busy)", buf);
+    snprintf(buf, SCRATCH_BUF_LEN, "%llu", XHPROF_G(collector_too_large));
+    php_info_print_table_row(2, "Collector drops (too large)", buf);
+    snprintf(buf, SCRATCH_BUF_LEN, "%llu", XHPROF_G(collector_failed));
+    php_info_print_table_row(2, "Collector drops (error)", buf);
+  }
+  if (XHPROF_G(profiles_discarded)) {
+    snprintf(buf, SCRATCH_BUF_LEN, "%llu", XHPROF_G(profiles_discarded));
+    php_info_print_table_row(2, "Profiles discarded (fast)", buf);
+  }
+  if (hp_counters) {
+    uint32 i, used = 0;
+
+    for (i = 0; i < hp_counters->nslots; i++) {
+      used += hp_counters->names[i].ready;
+    }
+    snprintf(buf, SCRATCH_BUF_LEN, "%u of %u functions, %u shards",
+             used, hp_counters->nslots, hp_counters->nshards);
+    php_info_print_table_row(2, "Counters", buf);
+  }
 
 	php_info_print_table_end();
 
@@ -1711,6 +5158,21 @@ const zend_function_entry md_xhprof_functions[] = {
     PHP_FE(xhprof_disable, arginfo_xhprof_disable)
     PHP_FE(xhprof_sample_enable, arginfo_xhprof_sample_enable)
   	PHP_FE(xhprof_sample_disable, arginfo_xhprof_sample_disable)
+    PHP_FE(xhprof_flush, arginfo_xhprof_flush)
+    PHP_FE(xhprof_job_end, arginfo_xhprof_job_end)
+    PHP_FE(xhprof_spans, arginfo_xhprof_spans)
+    PHP_FE(xhprof_tag, arginfo_xhprof_tag)
+    PHP_FE(xhprof_tags, arginfo_xhprof_tags)
+    PHP_FE(xhprof_keep, arginfo_xhprof_keep)
+    PHP_FE(xhprof_span_begin, arginfo_xhprof_span_begin)
+    PHP_FE(xhprof_span_end, arginfo_xhprof_span_end)
+    PHP_FE(xhprof_diff, arginfo_xhprof_diff)
+    PHP_FE(xhprof_merge, arginfo_xhprof_merge)
+    PHP_FE(xhprof_counters, arginfo_xhprof_counters)
+    PHP_FE(xhprof_counters_export, arginfo_xhprof_counters)
+#ifdef XHPROF_BENCH
+    PHP_FE(xhprof_microbench, arginfo_xhprof_microbench)
+#endif
 	PHP_FE_END	/* Must be the last line in md_xhprof_functions[] */
 };
 /* }}} */
@@ -1727,7 +5189,11 @@ zend_module_entry md_xhprof_module_entry = {
 	PHP_RSHUTDOWN(md_xhprof),	/* Replace with NULL if there's nothing to do at request end */
 	PHP_MINFO(md_xhprof),
 	PHP_MD_XHPROF_VERSION,
-	STANDARD_MODULE_PROPERTIES
+	PHP_MODULE_GLOBALS(md_xhprof),
+	PHP_GINIT(md_xhprof),
+	PHP_GSHUTDOWN(md_xhprof),
+	NULL,
+	STANDARD_MODULE_PROPERTIES_EX
 };
 /* }}} */
 
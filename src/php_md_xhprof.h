@@ -80,21 +80,187 @@ extern zend_module_entry md_xhprof_module_entry;
 #include "TSRM.h"
 #endif
 
-/*
-  	Declare any global variables you may need between the BEGIN
-	and END macros here:
+#include "xhprof.h"
 
+/* Xhprof's per-thread state.
+ *
+ * Under ZTS every thread gets its own copy, so concurrent requests can be
+ * profiled independently. Initialize defaults for attributes in
+ * hp_init_profiler_state() Cleanup/free attributes in
+ * hp_clean_profiler_state() */
 ZEND_BEGIN_MODULE_GLOBALS(md_xhprof)
-	zend_long  global_value;
-	char *global_string;
+
+  /*       ----------   Global attributes:  -----------       */
+
+  /* Indicates if xhprof is currently enabled */
+  int               enabled;
+
+  /* Indicates if xhprof was ever enabled during this request */
+  int               ever_enabled;
+
+  /* Holds all the xhprof statistics */
+  zval              stats_count;
+
+  /* Caps on stats_count read from xhprof.max_edges, xhprof.max_key_bytes
+   * and xhprof.max_samples when profiling starts, 0 for none, and the
+   * bytes of the keys it holds */
+  zend_long         max_edges;
+  zend_long         max_key_bytes;
+  zend_long         max_samples;
+  zend_long         stats_bytes;
+
+  /* Off-CPU time of the blocking builtins profiled so far, in
+   * microseconds. Frames report what it grew by as "io" with
+   * XHPROF_FLAGS_IOWAIT. */
+  uint64            io_wait_us;
+
+  /* Indicates the current xhprof mode or level */
+  int               profiler_level;
+
+  /* Top of the profile stack */
+  hp_entry_t        *entries;
+
+  /* Profile stacks of switched out fibers, keyed by zend_fiber_context.
+   * Allocated on the first fiber switch seen while enabled. */
+  HashTable         *fiber_stacks;
+
+  /* freelist of hp_entry_t chunks for reuse... */
+  hp_entry_t        *entry_free_list;
+
+  /* Callbacks for various xhprof modes */
+  hp_mode_cb        mode_cb;
+
+  /*       ----------   Mode specific attributes:  -----------       */
+
+  /* Global to track the time of the last sample in time and ticks */
+  struct timeval    last_sample_time;
+  uint64            last_sample_tsc;
+  /* XHPROF_SAMPLING_INTERVAL in ticks */
+  uint64            sampling_interval_tsc;
+
+  /* This array is used to store cpu frequencies for all available logical
+   * cpus.  For now, we assume the cpu frequencies will not change for power
+   * saving or other reasons. If we need to worry about that in the future, we
+   * can use a periodical timer to re-calculate this arrary every once in a
+   * while (for example, every 1 or 5 seconds). */
+  double *cpu_frequencies;
+
+  /* The number of logical CPUs this machine has. */
+  uint32 cpu_num;
+
+  /* The saved cpu affinity. */
+  cpu_set_t prev_mask;
+
+  /* The cpu id current thread is bound to. (default 0) */
+  uint32 cur_cpu_id;
+
+  /* XHProf flags */
+  uint32 xhprof_flags;
+
+  /* Number of calls intercepted since xhprof_enable() */
+  uint64 call_count;
+
+  /* call_count at the last hp_flush(), for the "(xhprof)" entry of the
+   * window flushed next */
+  uint64 flush_call_count;
+
+  /* Time only 1 in this many calls of each edge (0 or 1: all of them) */
+  uint32 call_sample_rate;
+
+  /* hp_edge_t of the sampled edges, keyed by hp_sampled_edge_key() */
+  HashTable *sampled_edges;
+
+  /* Streaming (xhprof.stream): when the next timed flush is due, in TSC
+   * ticks (0 = no timed flushes), and whether it is overdue */
+  uint64 flush_deadline_tsc;
+  uint8  flush_due;
+
+  /* Set while frames are closed because a bailout skipped their ends, see
+   * hp_unwind() */
+  uint8  unwinding;
+
+  /* Flushes since xhprof_enable(), and jobs since the last flush */
+  uint32 flush_seq;
+  uint32 flush_jobs;
+
+  /* Collector (xhprof.collector) socket, -1 until the first send, and
+   * what happened to the profiles sent to it */
+  int    collector_fd;
+  uint64 collector_sent;
+  uint64 collector_busy;
+  uint64 collector_failed;
+  uint64 collector_too_large;
+
+  /* Tail-based profiling: when xhprof_enable() was called, the decision
+   * forced with xhprof_keep() (1 keep, -1 discard, 0 by the xhprof.keep_*
+   * thresholds), and the profiles the thresholds discarded */
+  struct timeval begin_time;
+  struct rusage  begin_ru;
+  int    keep;
+  uint64 profiles_discarded;
+
+  /* Set while the profile xhprof.sample_requests started in RINIT runs */
+  zend_bool request_sampled;
+
+  /* Calibrated per-call profiler overhead in TSC ticks, indexed by the
+   * XHPROF_FLAGS_CPU/XHPROF_FLAGS_MEMORY combination (0 = not measured) */
+  uint64 call_overhead_tsc[4];
+
+  /* XHPROF_FLAGS_ADAPTIVE folds builtins averaging less than this many TSC
+   * ticks per call, xhprof.adaptive_threshold_us (0 = the overhead above) */
+  uint64 adaptive_tsc;
+
+  /* counter table indexed by hash value of function names. */
+  uint8  func_hash_counters[256];
+
+  /* Table of ignored function names and their filter */
+  char  **ignored_function_names;
+  size_t *ignored_function_lens;
+  uint8   ignored_function_filter[XHPROF_IGNORED_FUNCTION_FILTER_SIZE];
+
+  /* "profile_only" patterns; when set, only matching functions are
+   * profiled */
+  char  **allowed_function_names;
+
+  /* "spans" functions, NULL when off; and the spans recorded since
+   * xhprof_enable(): name => fingerprint => ["ct", "wt"], with
+   * span_count distinct fingerprints up to xhprof.max_spans */
+  char  **span_function_names;
+  zval    spans;
+  zend_long span_count;
+
+  /* Tags of the request set with xhprof_tag(), key => value */
+  zval    tags;
+
+  /* Bumped whenever the ignore/allow lists change, invalidating the
+   * decisions cached in hp_func_info_t */
+  uint32  filter_gen;
+
+  /* Owns every hp_func_info_t of the request, keyed by zend_function,
+   * op_array or opcodes address */
+  HashTable *func_cache;
+
+  /* Symbol IDs of the request: function name => id, starting at 1 */
+  HashTable *symbols;
+
+  /* Code regions of xhprof_span_begin(): name => hp_func_info_t */
+  HashTable *markers;
+
+  /* Counters mode: the shard of the shared table this request adds to,
+   * and the table slot of each symbol ID, plus 1 (0: not looked up) */
+  uint32  counter_shard;
+  uint32 *counter_slots;
+  uint32  counter_slots_size;
+
 ZEND_END_MODULE_GLOBALS(md_xhprof)
-*/
 
-/* Always refer to the globals in your function as MD_XHPROF_G(variable).
-   You are encouraged to rename these macros something shorter, see
-   examples in any other php module directory.
-*/
+ZEND_EXTERN_MODULE_GLOBALS(md_xhprof)
+
+/* Always refer to the globals in your function as XHPROF_G(variable). With
+ * ZEND_ENABLE_STATIC_TSRMLS_CACHE the ZTS accessor goes through the cached
+ * TSRM pointer, so this is cheap enough for the execute hooks. */
 #define MD_XHPROF_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(md_xhprof, v)
+#define XHPROF_G(v)    MD_XHPROF_G(v)
 
 #if defined(ZTS) && defined(COMPILE_DL_MD_XHPROF)
 ZEND_TSRMLS_CACHE_EXTERN()
@@ -106,6 +272,23 @@ PHP_FUNCTION(xhprof_enable);
 PHP_FUNCTION(xhprof_disable);
 PHP_FUNCTION(xhprof_sample_enable);
 PHP_FUNCTION(xhprof_sample_disable);
+PHP_FUNCTION(xhprof_flush);
+PHP_FUNCTION(xhprof_job_end);
+PHP_FUNCTION(xhprof_spans);
+PHP_FUNCTION(xhprof_tag);
+PHP_FUNCTION(xhprof_tags);
+PHP_FUNCTION(xhprof_keep);
+PHP_FUNCTION(xhprof_span_begin);
+PHP_FUNCTION(xhprof_span_end);
+PHP_METHOD(XHProfSpan, __construct);
+PHP_METHOD(XHProfSpan, __destruct);
+PHP_FUNCTION(xhprof_diff);
+PHP_FUNCTION(xhprof_merge);
+PHP_FUNCTION(xhprof_counters);
+PHP_FUNCTION(xhprof_counters_export);
+#ifdef XHPROF_BENCH
+PHP_FUNCTION(xhprof_microbench);
+#endif
 
 
 
@@ -0,0 +1,39 @@
+--TEST--
+XHProf: Fiber Profiling
+--SKIPIF--
+<?php if (PHP_VERSION_ID < 80100) print "skip: needs fibers (PHP 8.1+)"; ?>
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function inner() {
+}
+
+function work() {
+  Fiber::suspend(1);
+  inner();
+}
+
+function between() {
+}
+
+// Code running while the fiber is suspended must not become a child of
+// the fiber's frames, and the fiber's frames report suspended time as swt.
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+$fiber = new Fiber('work');
+$fiber->start();
+between();
+$fiber->resume();
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+
+?>
+--EXPECT--
+main()                                  : ct=       1; wt=*;
+main()==>between                        : ct=       1; wt=*;
+work==>inner                            : ct=       1; wt=*;
+{fiber}                                 : ct=       1; swt=*; wt=*;
+{fiber}==>work                          : ct=       1; swt=*; wt=*;
@@ -0,0 +1,59 @@
+--TEST--
+XHProf: Profiler Overhead Reporting and Compensation
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function bar() {
+  return 1;
+}
+
+function foo() {
+  bar();
+  bar();
+}
+
+// 1: overhead is reported under "(xhprof)": ct is the number of calls
+//    the profiler intercepted (main(), foo and two bars).
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS | XHPROF_FLAGS_OVERHEAD);
+foo();
+$output = xhprof_disable();
+
+echo "Part 1: Overhead\n";
+print_canonical($output);
+echo "\n";
+
+// 2: compensation implies the report; the call graph is unchanged.
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS | XHPROF_FLAGS_COMPENSATE);
+foo();
+$output = xhprof_disable();
+
+echo "Part 2: Compensate\n";
+print_canonical($output);
+echo "\n";
+
+// 3: compensated times never go negative.
+$negative = false;
+foreach ($output as $metrics) {
+  if ($metrics['wt'] < 0) {
+    $negative = true;
+  }
+}
+echo "Part 3: " . ($negative ? "negative wt" : "ok") . "\n";
+
+?>
+--EXPECT--
+Part 1: Overhead
+(xhprof)                                : cal_ns=*; ct=       4; wt=*;
+foo==>bar                               : ct=       2; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       1; wt=*;
+
+Part 2: Compensate
+(xhprof)                                : cal_ns=*; ct=       4; wt=*;
+foo==>bar                               : ct=       2; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       1; wt=*;
+
+Part 3: ok
@@ -0,0 +1,75 @@
+--TEST--
+XHProf: Profile Only an Allowlist of Functions
+--FILE--
+<?php
+namespace App {
+  function run() {
+    \Lib\Store::get();
+    \other();
+    \helper_fmt();
+  }
+}
+
+namespace Lib {
+  class Store {
+    public static function get() {
+      return self::load();
+    }
+    public static function load() {
+      return 1;
+    }
+  }
+  class Cache {
+    public static function get() {
+      return 1;
+    }
+  }
+}
+
+namespace {
+  include_once dirname(__FILE__).'/common.php';
+
+  function other() {
+    \Lib\Cache::get();
+  }
+
+  function helper_fmt() {
+    return 1;
+  }
+
+  // 1: a namespace prefix, a class and a wildcard pattern. Calls made
+  //    from functions outside the list are charged to the nearest
+  //    profiled caller.
+  xhprof_enable(XHPROF_FLAGS_NO_BUILTINS,
+                array('profile_only' => array('App\\', 'Lib\\Store',
+                                              'helper_*')));
+  App\run();
+  $output = xhprof_disable();
+
+  echo "Part 1: Allowlist\n";
+  print_canonical($output);
+  echo "\n";
+
+  // 2: the decisions are cached per function; a new list takes effect
+  //    on the next xhprof_enable().
+  xhprof_enable(XHPROF_FLAGS_NO_BUILTINS,
+                array('profile_only' => array('lib\\cache::get')));
+  App\run();
+  $output = xhprof_disable();
+
+  echo "Part 2: New allowlist\n";
+  print_canonical($output);
+  echo "\n";
+}
+?>
+--EXPECT--
+Part 1: Allowlist
+App\run==>Lib\Store::get                : ct=       1; wt=*;
+App\run==>helper_fmt                    : ct=       1; wt=*;
+Lib\Store::get==>Lib\Store::load        : ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>App\run                        : ct=       1; wt=*;
+
+Part 2: New allowlist
+main()                                  : ct=       1; wt=*;
+main()==>Lib\Cache::get                 : ct=       1; wt=*;
@@ -0,0 +1,70 @@
+--TEST--
+XHProf: Cached Function Names and Decisions Across Runs
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+class Walker {
+  public function walk($depth) {
+    $next = function ($d) { return $this->walk($d); };
+    return $depth > 0 ? $next($depth - 1) : 0;
+  }
+}
+
+function bar() {
+  return 1;
+}
+
+function foo() {
+  return bar() + bar();
+}
+
+// 1: recursion levels still follow the names, for methods and closures
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+$w = new Walker();
+$w->walk(2);
+$output = xhprof_disable();
+
+echo "Part 1: Recursion\n";
+print_canonical($output);
+echo "\n";
+
+// 2: the functions are cached now; ignoring one takes effect anyway
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS,
+              array('ignored_functions' => array('bar')));
+foo();
+$output = xhprof_disable();
+
+echo "Part 2: Ignored\n";
+print_canonical($output);
+echo "\n";
+
+// 3: and it is profiled again once no longer ignored
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+foo();
+$output = xhprof_disable();
+
+echo "Part 3: Not ignored\n";
+print_canonical($output);
+echo "\n";
+
+?>
+--EXPECT--
+Part 1: Recursion
+Walker::walk==>Walker::{closure:tests/xhprof_016.php:7}: ct=       1; wt=*;
+Walker::walk@1==>Walker::{closure:tests/xhprof_016.php:7}@1: ct=       1; wt=*;
+Walker::{closure:tests/xhprof_016.php:7}==>Walker::walk@1: ct=       1; wt=*;
+Walker::{closure:tests/xhprof_016.php:7}@1==>Walker::walk@2: ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>Walker::walk                   : ct=       1; wt=*;
+
+Part 2: Ignored
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       1; wt=*;
+
+Part 3: Not ignored
+foo==>bar                               : ct=       2; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       1; wt=*;
+
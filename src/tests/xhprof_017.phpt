@@ -0,0 +1,49 @@
+--TEST--
+XHProf: Adaptive Folding of Very Short Builtins
+--INI--
+xhprof.adaptive_threshold_us=50
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function foo() {
+  $n = "";
+  $s = "Abc";
+  for ($i = 0; $i < 1000; $i++) {
+    $n .= lcfirst($s);
+  }
+  for ($i = 0; $i < 40; $i++) {
+    usleep(100);
+  }
+  return $n;
+}
+
+// builtins averaging under 50us per call are folded, whatever the
+// calibrated overhead of this host
+xhprof_enable(XHPROF_FLAGS_ADAPTIVE);
+foo();
+$output = xhprof_disable();
+
+// 1: lcfirst is timed for one window of calls, then only counted
+$timed  = isset($output['foo==>lcfirst']) ? $output['foo==>lcfirst']['ct'] : 0;
+$folded = isset($output['(folded)==>lcfirst'])
+          ? $output['(folded)==>lcfirst']['ct'] : 0;
+echo "Part 1: lcfirst calls " . ($timed + $folded) . "\n";
+echo "Part 1: timed " . $timed . ", folded " . $folded . "\n";
+
+// 2: folded entries only have a call count
+echo "Part 2: " . implode(",", array_keys($output['(folded)==>lcfirst'])) . "\n";
+
+// 3: slow builtins keep being timed
+echo "Part 3: usleep calls " . $output['foo==>usleep']['ct'] . "\n";
+echo "Part 3: folded usleep " .
+     (isset($output['(folded)==>usleep']) ? "yes" : "no") . "\n";
+
+?>
+--EXPECT--
+Part 1: lcfirst calls 1000
+Part 1: timed 32, folded 968
+Part 2: ct
+Part 3: usleep calls 40
+Part 3: folded usleep no
@@ -0,0 +1,49 @@
+--TEST--
+XHProf: Timing 1 in N Calls of Each Edge
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function bar() {
+  return 1;
+}
+
+function foo() {
+  for ($i = 0; $i < 100; $i++) {
+    bar();
+  }
+}
+
+// 1: call counts stay exact, times are estimated from every 10th call
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS, array('sample_calls' => 10));
+foo();
+foo();
+$output = xhprof_disable();
+
+echo "Part 1: Sampled calls\n";
+print_canonical($output);
+echo "timed: " . $output['foo==>bar']['sct'] . "\n";
+echo "\n";
+
+// 2: a rate of 1 times every call
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS, array('sample_calls' => 1));
+foo();
+$output = xhprof_disable();
+
+echo "Part 2: Every call\n";
+print_canonical($output);
+echo "\n";
+
+?>
+--EXPECT--
+Part 1: Sampled calls
+foo==>bar                               : ct=     200; sct=*; wt=*; wt_se=*;
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       2; wt=*;
+timed: 20
+
+Part 2: Every call
+foo==>bar                               : ct=     100; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>foo                            : ct=       1; wt=*;
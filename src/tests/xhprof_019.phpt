@@ -0,0 +1,61 @@
+--TEST--
+XHProf: Streaming Flushes From a Long Running Worker
+--INI--
+xhprof.stream={PWD}/xhprof_019.xhpf
+xhprof.flush_jobs=2
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+$file = dirname(__FILE__).'/xhprof_019.xhpf';
+@unlink($file);
+
+function job_a() {
+  return 1;
+}
+
+function job_b() {
+  return 2;
+}
+
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+
+// 1: a flush writes one frame and starts over with empty counters
+job_a();
+echo "Part 1: " . var_export(xhprof_flush(), true) . "\n";
+$data = file_get_contents($file);
+echo "magic: " . substr($data, 0, 4) . "\n";
+echo "job_a: " . (strpos($data, "job_a") !== false ? "yes" : "no") . "\n";
+echo "\n";
+
+// 2: every xhprof.flush_jobs jobs
+job_b();
+echo "Part 2: " . var_export(xhprof_job_end(), true) . "\n";
+job_b();
+echo "Part 2: " . var_export(xhprof_job_end(), true) . "\n";
+clearstatcache();
+$data = file_get_contents($file);
+echo "frames: " . substr_count($data, "XHPF") . "\n";
+echo "\n";
+
+// 3: xhprof_disable() returns what wasn't flushed yet
+job_a();
+$output = xhprof_disable();
+echo "Part 3:\n";
+print_canonical($output);
+
+unlink($file);
+?>
+--EXPECT--
+Part 1: true
+magic: XHPF
+job_a: yes
+
+Part 2: false
+Part 2: true
+frames: 2
+
+Part 3:
+main()                                  : ct=       1; wt=*;
+main()==>job_a                          : ct=       1; wt=*;
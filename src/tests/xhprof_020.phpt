@@ -0,0 +1,77 @@
+--TEST--
+XHProf: Diff Of Two Stored Profiles
+--INI--
+xhprof.stream={PWD}/xhprof_020.xhpf
+--FILE--
+<?php
+
+$file   = dirname(__FILE__).'/xhprof_020.xhpf';
+$before = dirname(__FILE__).'/xhprof_020_before.xhpf';
+@unlink($file);
+@unlink($before);
+
+function foo() {
+  return 1;
+}
+
+function bar() {
+  return 2;
+}
+
+function run($n) {
+  for ($i = 0; $i < $n; $i++) {
+    foo();
+  }
+  bar();
+}
+
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+
+run(1);
+xhprof_flush();
+rename($file, $before);
+
+run(3);
+xhprof_flush();
+xhprof_disable();
+
+function show($rows) {
+  foreach ($rows as $row) {
+    if (in_array($row['symbol'], array('foo', 'bar', 'run==>foo'))) {
+      printf("%-8s %-10s: %d => %d (%+d)\n", $row['type'], $row['symbol'],
+             $row['before']['ct'], $row['after']['ct'], $row['delta']['ct']);
+    }
+  }
+}
+
+// 1: by call count, functions and edges
+echo "Part 1:\n";
+show(xhprof_diff($before, $file, "ct"));
+echo "\n";
+
+// 2: the biggest change comes first
+echo "Part 2:\n";
+$rows = xhprof_diff($before, $file, "ct", 1);
+echo count($rows) . " " . $rows[0]['symbol'] . "\n";
+echo "\n";
+
+// 3: errors
+echo "Part 3:\n";
+var_dump(@xhprof_diff($before, $file, "nope"));
+var_dump(@xhprof_diff($before, $file . ".missing"));
+
+unlink($file);
+unlink($before);
+?>
+--EXPECT--
+Part 1:
+function foo       : 1 => 3 (+2)
+edge     run==>foo : 1 => 3 (+2)
+function bar       : 1 => 1 (+0)
+
+Part 2:
+1 foo
+
+Part 3:
+bool(false)
+bool(false)
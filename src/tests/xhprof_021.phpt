@@ -0,0 +1,72 @@
+--TEST--
+XHProf: Merge Of Stored Profiles
+--INI--
+xhprof.stream={PWD}/xhprof_021.xhpf
+--FILE--
+<?php
+
+$dir    = dirname(__FILE__);
+$file   = $dir.'/xhprof_021.xhpf';
+$runs   = array($dir.'/xhprof_021_1.xhpf', $dir.'/xhprof_021_2.xhpf');
+$merged = $dir.'/xhprof_021_merged.xhpf';
+$avg    = $dir.'/xhprof_021_avg.xhpf';
+@unlink($file);
+
+function foo() {
+  return 1;
+}
+
+function request($n) {
+  for ($i = 0; $i < $n; $i++) {
+    foo();
+  }
+}
+
+// two "requests", one profile file each
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+request(2);
+xhprof_flush();
+rename($file, $runs[0]);
+request(4);
+xhprof_flush();
+rename($file, $runs[1]);
+xhprof_disable();
+
+function ct($before, $after, $symbol) {
+  foreach (xhprof_diff($before, $after, "ct") as $row) {
+    if ($row['symbol'] == $symbol) {
+      return $row['before']['ct'] . " => " . $row['after']['ct'];
+    }
+  }
+}
+
+// 1: totals, which the diff compares per run
+echo "Part 1: " . xhprof_merge($runs, $merged) . " runs\n";
+echo "foo: " . ct($runs[0], $merged, "foo") . "\n";
+echo "\n";
+
+// 2: averages per run, the same as the totals to the diff
+echo "Part 2: " . xhprof_merge($runs, $avg, true) . " runs\n";
+echo "foo: " . ct($runs[0], $avg, "foo") . "\n";
+echo "foo: " . ct($merged, $avg, "foo") . "\n";
+echo "\n";
+
+// 3: a file that isn't a profile
+echo "Part 3:\n";
+var_dump(@xhprof_merge(array(__FILE__), $merged));
+
+unlink($runs[0]);
+unlink($runs[1]);
+unlink($merged);
+unlink($avg);
+?>
+--EXPECT--
+Part 1: 2 runs
+foo: 2 => 3
+
+Part 2: 2 runs
+foo: 2 => 3
+foo: 3 => 3
+
+Part 3:
+bool(false)
@@ -0,0 +1,92 @@
+--TEST--
+XHProf: Per Function Summary From xhprof_disable()
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function baz() {
+  return 1;
+}
+
+function foo() {
+  baz();
+  baz();
+}
+
+function bar() {
+  return 2;
+}
+
+function run() {
+  foo();
+  foo();
+  foo();
+  bar();
+}
+
+// 1: the summary next to the usual profile
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+run();
+$output = xhprof_disable(XHPROF_SUMMARY);
+echo "Part 1:\n";
+echo implode(", ", array_keys($output)) . "\n";
+print_canonical($output['edges']);
+echo "\n";
+print_canonical($output['summary']['functions']);
+echo "\n";
+
+// 2: only the summary, and the top lists
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+run();
+$output = xhprof_disable(XHPROF_SUMMARY_ONLY, 2);
+echo "Part 2:\n";
+echo implode(", ", array_keys($output)) . "\n";
+echo implode(", ", array_keys($output['top'])) . "\n";
+echo "ct: " . json_encode($output['top']['ct']) . "\n";
+echo "excl_wt: " . count($output['top']['excl_wt']) . "\n";
+
+// exclusive times add up to the time of the whole run
+$sum = 0;
+foreach ($output['functions'] as $function) {
+  $sum += $function['excl_wt'];
+}
+echo "sum: " . ($sum == $output['functions']['main()']['wt'] ? "yes" : "no") . "\n";
+
+// 3: a negative top is refused and profiling goes on, a huge one lists
+// every function
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+run();
+echo "Part 3:\n";
+var_dump(xhprof_disable(XHPROF_SUMMARY_ONLY, -1));
+$output = xhprof_disable(XHPROF_SUMMARY_ONLY, PHP_INT_MAX);
+$top = $output['top']['ct'];
+ksort($top);
+echo "ct: " . json_encode($top) . "\n";
+?>
+--EXPECTF--
+Part 1:
+edges, summary
+foo==>baz                               : ct=       6; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>run                            : ct=       1; wt=*;
+run==>bar                               : ct=       1; wt=*;
+run==>foo                               : ct=       3; wt=*;
+
+bar                                     : ct=       1; excl_wt=*; wt=*;
+baz                                     : ct=       6; excl_wt=*; wt=*;
+foo                                     : ct=       3; excl_wt=*; wt=*;
+main()                                  : ct=       1; excl_wt=*; wt=*;
+run                                     : ct=       1; excl_wt=*; wt=*;
+
+Part 2:
+functions, top
+ct, excl_wt, wt
+ct: {"baz":6,"foo":3}
+excl_wt: 2
+sum: yes
+Part 3:
+
+Warning: xhprof_disable(): top must not be negative in %s on line %d
+bool(false)
+ct: {"bar":1,"baz":6,"foo":3,"main()":1,"run":1}
@@ -0,0 +1,65 @@
+--TEST--
+XHProf: Caps On The Size Of The Profile
+--INI--
+xhprof.max_edges=4
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function f1() { return 1; }
+function f2() { return 2; }
+function f3() { return 3; }
+function f4() { return 4; }
+function f5() { return 5; }
+function f6() { return 6; }
+
+function run() {
+  f1(); f2(); f3(); f4(); f5(); f6();
+  f5();
+}
+
+// 1: xhprof.max_edges, new edges past it go to "(other)"
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+f1(); f2(); f3(); f4(); f5(); f6();
+$output = xhprof_disable();
+echo "Part 1:\n";
+print_canonical($output);
+echo "\n";
+
+// 2: xhprof.max_key_bytes
+ini_set("xhprof.max_edges", 0);
+ini_set("xhprof.max_key_bytes", 30);
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+run();
+f1();
+$output = xhprof_disable();
+echo "Part 2:\n";
+print_canonical($output);
+echo "\n";
+
+// 3: no caps
+ini_set("xhprof.max_key_bytes", 0);
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+run();
+$output = xhprof_disable();
+echo "Part 3: " . (isset($output["(other)"]) ? "other" : "no other") . ", "
+  . count($output) . " entries\n";
+?>
+--EXPECT--
+Part 1:
+(other)                                 : ct=       2; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>f1                             : ct=       1; wt=*;
+main()==>f2                             : ct=       1; wt=*;
+main()==>f3                             : ct=       1; wt=*;
+main()==>f4                             : ct=       1; wt=*;
+
+Part 2:
+(other)                                 : ct=       6; wt=*;
+main()                                  : ct=       1; wt=*;
+run==>f1                                : ct=       1; wt=*;
+run==>f2                                : ct=       1; wt=*;
+run==>f3                                : ct=       1; wt=*;
+
+Part 3: no other, 8 entries
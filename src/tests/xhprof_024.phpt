@@ -0,0 +1,46 @@
+--TEST--
+XHProf: Closures And Anonymous Classes Named After Their Declaration
+--FILE--
+<?php
+include_once dirname(__FILE__).'/common.php';
+
+function pipeline($handlers) {
+  foreach ($handlers as $handler) {
+    $handler();
+  }
+}
+
+$auth  = function () { return 1; };
+$cache = function () { return 2; };
+$job   = new class {
+  public function handle() { return 3; }
+};
+
+class Step {
+  public function run() { return 4; }
+}
+
+function step() {
+  return 5;
+}
+
+// closures made from a function or a method, like first-class callables
+// (step(...)), keep its name
+$callables = array(Closure::fromCallable('step'),
+                   Closure::fromCallable(array(new Step(), 'run')));
+
+xhprof_enable(XHPROF_FLAGS_NO_BUILTINS);
+pipeline(array($auth, $cache, $auth, array($job, 'handle')));
+pipeline($callables);
+$output = xhprof_disable();
+
+print_canonical($output);
+?>
+--EXPECT--
+main()                                  : ct=       1; wt=*;
+main()==>pipeline                       : ct=       2; wt=*;
+pipeline==>Step::run                    : ct=       1; wt=*;
+pipeline==>class@anonymous/tests/xhprof_024.php:12::handle: ct=       1; wt=*;
+pipeline==>step                         : ct=       1; wt=*;
+pipeline==>{closure:tests/xhprof_024.php:10}: ct=       2; wt=*;
+pipeline==>{closure:tests/xhprof_024.php:11}: ct=       1; wt=*;
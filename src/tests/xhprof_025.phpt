@@ -0,0 +1,49 @@
+--TEST--
+XHProf: Time Off The CPU In Blocking Builtins
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function wait() {
+  usleep(20000);
+}
+
+function work() {
+  $x = 0;
+  for ($i = 0; $i < 200000; $i++) {
+    $x += $i;
+  }
+  return $x;
+}
+
+function handler() {
+  wait();
+  work();
+}
+
+xhprof_enable(XHPROF_FLAGS_IOWAIT);
+handler();
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+
+// sleeping is all off the CPU, and callers include it
+echo "usleep: " . ($output["wait==>usleep"]["io"] >= 15000 ? "waits" : "runs") . "\n";
+echo "wait: " . ($output["handler==>wait"]["io"] >= 15000 ? "waits" : "runs") . "\n";
+echo "work: " . ($output["handler==>work"]["io"] < 15000 ? "runs" : "waits") . "\n";
+echo "main: " . ($output["main()"]["io"] >= $output["handler==>wait"]["io"] ? "yes" : "no") . "\n";
+?>
+--EXPECT--
+handler==>wait                          : ct=       1; io=*; wt=*;
+handler==>work                          : ct=       1; io=*; wt=*;
+main()                                  : ct=       1; io=*; wt=*;
+main()==>handler                        : ct=       1; io=*; wt=*;
+main()==>xhprof_disable                 : ct=       1; io=*; wt=*;
+wait==>usleep                           : ct=       1; io=*; wt=*;
+
+usleep: waits
+wait: waits
+work: runs
+main: yes
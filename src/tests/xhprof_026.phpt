@@ -0,0 +1,49 @@
+--TEST--
+XHProf: Spans Grouped By Argument Fingerprint
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function fetch($id) {
+  return str_pad("user:$id", 16);
+}
+
+xhprof_enable(0, array('spans' => array('str_pad', 'strtolower')));
+for ($i = 0; $i < 5; $i++) {
+  fetch($i * 1000);
+}
+fetch("0f3a9c2e7b1d4a6c");
+strtolower("Session:" . md5("x"));
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+
+// spans stay available after xhprof_disable()
+$spans = xhprof_spans();
+ksort($spans);
+foreach ($spans as $fn => $fps) {
+  ksort($fps);
+  foreach ($fps as $fp => $counts) {
+    echo "$fn $fp: ct=" . $counts["ct"] . "; wt=" . ($counts["wt"] >= 0 ? "*" : "?") . "\n";
+  }
+}
+
+// without the option nothing is recorded
+xhprof_enable();
+fetch(1);
+xhprof_disable();
+echo "spans: " . count(xhprof_spans()) . "\n";
+?>
+--EXPECT--
+fetch==>str_pad                         : ct=       6; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>fetch                          : ct=       6; wt=*;
+main()==>md5                            : ct=       1; wt=*;
+main()==>strtolower                     : ct=       1; wt=*;
+main()==>xhprof_disable                 : ct=       1; wt=*;
+
+str_pad user:?: ct=6; wt=*
+strtolower Session:?: ct=1; wt=*
+spans: 0
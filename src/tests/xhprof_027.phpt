@@ -0,0 +1,24 @@
+--TEST--
+XHProf: eval() Compile Time
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function run() {
+  return eval('return str_repeat("x", 3);');
+}
+
+xhprof_enable();
+run();
+$output = xhprof_disable();
+
+print_canonical($output);
+?>
+--EXPECT--
+eval::tests/xhprof_027.php(9)==>str_repeat: ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>run                            : ct=       1; wt=*;
+main()==>xhprof_disable                 : ct=       1; wt=*;
+run==>eval::tests/xhprof_027.php(9)     : ct=       1; wt=*;
+run==>eval_compile::tests/xhprof_027.php(9): ct=       1; wt=*;
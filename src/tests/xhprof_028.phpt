@@ -0,0 +1,34 @@
+--TEST--
+XHProf: Request Metadata And Tags
+--FILE--
+<?php
+
+xhprof_tag("route", "/users/{id}");
+xhprof_tag("customer", "acme");
+xhprof_tag("customer", "initech");
+
+xhprof_enable();
+$x = str_repeat("x", 1000);
+xhprof_disable();
+
+$tags = xhprof_tags();
+ksort($tags);
+foreach ($tags as $key => $value) {
+  if ($key == "request.pmu" || $key == "request.wt") {
+    $value = is_numeric($value) ? "*" : $value;
+  }
+  echo "$key: $value\n";
+}
+
+// tags win over the request's own metadata
+xhprof_tag("request.sapi", "worker");
+$tags = xhprof_tags();
+echo "sapi: " . $tags["request.sapi"] . "\n";
+?>
+--EXPECT--
+customer: initech
+request.pmu: *
+request.sapi: cli
+request.wt: *
+route: /users/{id}
+sapi: worker
@@ -0,0 +1,48 @@
+--TEST--
+XHProf: Tail-Based Profiling Of Sampled Requests
+--INI--
+xhprof.sample_requests=1
+xhprof.keep_wt=60000
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function foo() {
+  return str_repeat("x", 10);
+}
+
+// every request is sampled, the profile started before the script
+foo();
+
+// fast so far, it would be discarded
+echo "fast: " . var_export(xhprof_keep(), true) . "\n";
+
+ini_set("xhprof.keep_pmu", 1);
+echo "pmu: " . var_export(xhprof_keep(), true) . "\n";
+ini_set("xhprof.keep_pmu", 0);
+
+// userland decides last
+echo "forced: " . var_export(xhprof_keep(true), true) . "\n";
+echo "dropped: " . var_export(xhprof_keep(false), true) . "\n";
+
+$output = xhprof_disable();
+print_canonical($output);
+?>
+--EXPECT--
+fast: false
+pmu: true
+forced: true
+dropped: false
+foo==>str_repeat                        : ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>load::tests/xhprof_029.php     : ct=       1; wt=*;
+main()==>run_init::tests/xhprof_029.php : ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>dirname: ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>foo    : ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>ini_set: ct=       2; wt=*;
+run_init::tests/xhprof_029.php==>load::tests/common.php: ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>run_init::tests/common.php: ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>var_export: ct=       4; wt=*;
+run_init::tests/xhprof_029.php==>xhprof_disable: ct=       1; wt=*;
+run_init::tests/xhprof_029.php==>xhprof_keep: ct=       4; wt=*;
@@ -0,0 +1,66 @@
+--TEST--
+XHProf: Code Regions With xhprof_span_begin() And XHProfSpan
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function import($rows) {
+  xhprof_span_begin("import:parse");
+  for ($i = 0; $i < $rows; $i++) {
+    explode(",", "a,b,c");
+  }
+  xhprof_span_begin("import:nested");
+  strtoupper("x");
+  xhprof_span_end();
+  xhprof_span_end();
+
+  xhprof_span_begin("import:write");
+  implode(",", array(1, 2));
+  xhprof_span_end();
+}
+
+function scoped() {
+  $span = new XHProfSpan("scoped:body");
+  str_repeat("x", 3);
+}
+
+function leaky() {
+  // left open, closed when the function returns, not counted as failed
+  xhprof_span_begin("leaky:open");
+  strlen("x");
+}
+
+xhprof_enable();
+import(3);
+import(2);
+scoped();
+leaky();
+// nothing to close here
+$closed = xhprof_span_end();
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+echo "closed: " . var_export($closed, true) . "\n";
+echo "off: " . var_export(xhprof_span_begin("x"), true) . "\n";
+?>
+--EXPECT--
+import:nested==>strtoupper              : ct=       2; wt=*;
+import:parse==>explode                  : ct=       5; wt=*;
+import:parse==>import:nested            : ct=       2; wt=*;
+import:write==>implode                  : ct=       2; wt=*;
+import==>import:parse                   : ct=       2; wt=*;
+import==>import:write                   : ct=       2; wt=*;
+leaky:open==>strlen                     : ct=       1; wt=*;
+leaky==>leaky:open                      : ct=       1; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>import                         : ct=       2; wt=*;
+main()==>leaky                          : ct=       1; wt=*;
+main()==>scoped                         : ct=       1; wt=*;
+main()==>xhprof_disable                 : ct=       1; wt=*;
+scoped:body==>str_repeat                : ct=       1; wt=*;
+scoped==>scoped:body                    : ct=       1; wt=*;
+
+closed: false
+off: false
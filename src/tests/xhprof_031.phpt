@@ -0,0 +1,52 @@
+--TEST--
+XHProf: Generator Resumes Are Not Calls
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function rows($n) {
+  for ($i = 0; $i < $n; $i++) {
+    yield str_repeat("x", $i);
+  }
+}
+
+function consume() {
+  $total = 0;
+  foreach (rows(3) as $row) {
+    $total += strlen($row);
+  }
+  return $total;
+}
+
+function manual() {
+  $rows = rows(2);
+  $rows->current();
+  $rows->next();
+  return $rows->current();
+}
+
+xhprof_enable();
+consume();
+manual();
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+
+// runs up to each yield, and the last one to the end of the generator
+echo "consume: " . $output["consume==>rows"]["rs"] . "\n";
+// Generator::current() and next() are left out, the consumer resumes
+echo "manual: " . $output["manual==>rows"]["rs"] . "\n";
+?>
+--EXPECT--
+consume==>rows                          : ct=       1; rs=*; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>consume                        : ct=       1; wt=*;
+main()==>manual                         : ct=       1; wt=*;
+main()==>xhprof_disable                 : ct=       1; wt=*;
+manual==>rows                           : ct=       1; rs=*; wt=*;
+rows==>str_repeat                       : ct=       5; wt=*;
+
+consume: 4
+manual: 2
@@ -0,0 +1,77 @@
+--TEST--
+XHProf: Calls Ended by Exceptions and Fatal Errors
+--INI--
+memory_limit=16M
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+$error = new RuntimeException("no");
+
+function thrower() {
+  global $error;
+  throw $error;
+}
+
+function middle() {
+  thrower();
+}
+
+function catcher() {
+  try {
+    middle();
+  } catch (RuntimeException $e) {
+    return 1;
+  }
+}
+
+function divide() {
+  try {
+    return intdiv(1, 0);
+  } catch (DivisionByZeroError $e) {
+    return 0;
+  }
+}
+
+function fatal() {
+  return array_fill(0, 16 * 1024 * 1024, 1);
+}
+
+function report() {
+  $output = xhprof_disable();
+
+  print_canonical($output);
+  echo "\n";
+
+  // both the call that threw and the one the exception went through
+  echo "thrower: " . $output["middle==>thrower"]["ex"] . "\n";
+  echo "middle: " . $output["catcher==>middle"]["ex"] . "\n";
+  echo "catcher: " . (isset($output["main()==>catcher"]["ex"]) ? "ex" : "ok") . "\n";
+}
+
+xhprof_enable();
+register_shutdown_function('report');
+catcher();
+catcher();
+divide();
+fatal();
+?>
+--EXPECTF--
+Fatal error: Allowed memory size of %d bytes exhausted%s
+
+catcher==>middle                        : ct=       2; ex=*; exwt=*; wt=*;
+divide==>intdiv                         : ct=       1; ex=*; exwt=*; wt=*;
+fatal==>array_fill                      : ct=       1; ex=*; exwt=*; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>catcher                        : ct=       2; wt=*;
+main()==>divide                         : ct=       1; wt=*;
+main()==>fatal                          : ct=       1; ex=*; exwt=*; wt=*;
+main()==>register_shutdown_function     : ct=       1; wt=*;
+main()==>report                         : ct=       1; wt=*;
+middle==>thrower                        : ct=       2; ex=*; exwt=*; wt=*;
+report==>xhprof_disable                 : ct=       1; wt=*;
+
+thrower: 2
+middle: 2
+catcher: ok
@@ -0,0 +1,59 @@
+--TEST--
+XHProf: Ignoring Long Namespaced Method Names
+--FILE--
+<?php
+
+namespace App\Infrastructure\Persistence\Doctrine\Repositories\Accounting {
+
+  class LedgerEntryRepository {
+    public function findByAccount() {
+      return \helper();
+    }
+
+    public function findByAccountAndPeriod() {
+      return 2;
+    }
+
+    public function findByAccounu() {
+      return 3;
+    }
+  }
+}
+
+namespace {
+
+  include_once dirname(__FILE__).'/common.php';
+
+  define('REPO', 'App\Infrastructure\Persistence\Doctrine\Repositories'
+                 . '\Accounting\LedgerEntryRepository');
+
+  function helper() {
+    return 1;
+  }
+
+  function run() {
+    $class = REPO;
+    $repo  = new $class();
+    $repo->findByAccount();
+    $repo->findByAccountAndPeriod();
+    $repo->findByAccounu();
+  }
+
+  // Only the exact name is ignored: not a longer name it is a prefix of,
+  // nor one of the same length that differs in the last byte
+  xhprof_enable(XHPROF_FLAGS_NO_BUILTINS,
+                array('ignored_functions' =>
+                      array(REPO . '::findByAccount')));
+  run();
+  $output = xhprof_disable();
+
+  print_canonical($output);
+  echo "\n";
+}
+?>
+--EXPECT--
+main()                                  : ct=       1; wt=*;
+main()==>run                            : ct=       1; wt=*;
+run==>App\Infrastructure\Persistence\Doctrine\Repositories\Accounting\LedgerEntryRepository::findByAccountAndPeriod: ct=       1; wt=*;
+run==>App\Infrastructure\Persistence\Doctrine\Repositories\Accounting\LedgerEntryRepository::findByAccounu: ct=       1; wt=*;
+run==>helper                            : ct=       1; wt=*;
@@ -0,0 +1,70 @@
+--TEST--
+XHProf: Counters Shared by All Requests
+--INI--
+xhprof.counters=1
+--FILE--
+<?php
+
+namespace App\Util {
+  function fmt($n) {
+    return "n=" . $n;
+  }
+}
+
+namespace {
+
+  function bar($n) {
+    return App\Util\fmt($n);
+  }
+
+  function foo() {
+    return bar(1) . bar(2);
+  }
+
+  foo();
+  foo();
+  foo();
+
+  // Counted since the request started, nothing to disable
+  var_dump(xhprof_disable());
+
+  $counters = xhprof_counters();
+  echo "foo: " . $counters["foo"]["ct"] . "\n";
+  echo "bar: " . $counters["bar"]["ct"] . "\n";
+  echo "fmt: " . $counters["App\\Util\\fmt"]["ct"] . "\n";
+  // main() is only counted when the request ends
+  echo "main: " . (isset($counters["main()"]) ? "yes" : "no") . "\n";
+  echo "top: " . count(xhprof_counters(2)) . "\n";
+
+  $text = xhprof_counters_export();
+  foreach (explode("\n", $text) as $line) {
+    if (strpos($line, "_calls_total{") && strpos($line, "fmt")
+        || !strncmp($line, "# TYPE", 6) || $line == "# EOF") {
+      echo $line . "\n";
+    }
+  }
+
+  // xhprof_enable() takes over for the rest of the request
+  xhprof_enable();
+  foo();
+  $output = xhprof_disable();
+  echo "profiled: " . $output["main()==>foo"]["ct"] . "\n";
+
+  $counters = xhprof_counters();
+  echo "foo: " . $counters["foo"]["ct"] . "\n";
+}
+?>
+--EXPECT--
+NULL
+foo: 3
+bar: 6
+fmt: 6
+main: no
+top: 2
+# TYPE xhprof_function_calls counter
+xhprof_function_calls_total{function="App\\Util\\fmt"} 6
+# TYPE xhprof_function_wall_seconds counter
+# TYPE xhprof_dropped_calls counter
+# EOF
+profiled: 1
+foo: 3
@@ -0,0 +1,43 @@
+--TEST--
+XHProf: Garbage Collector Runs
+--SKIPIF--
+<?php if (PHP_VERSION_ID < 70300) print "skip: gc_collect_cycles can't be hooked before PHP 7.3"; ?>
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function cycles($n) {
+  for ($i = 0; $i < $n; $i++) {
+    $a = new stdClass;
+    $a->self = $a;
+  }
+}
+
+xhprof_enable();
+cycles(10);
+$freed = gc_collect_cycles();
+$output = xhprof_disable();
+
+print_canonical($output);
+echo "\n";
+
+// the number of freed cycles is reported with the run
+echo "gc: " . ($output["gc_collect_cycles==>(gc)"]["gc"] == $freed ? "ok" : "wrong") . "\n";
+
+// runs the engine starts itself go under the function that triggered them
+gc_enable();
+xhprof_enable();
+cycles(50000);
+$output = xhprof_disable();
+echo "implicit: " . (isset($output["cycles==>(gc)"]) ? "yes" : "no") . "\n";
+?>
+--EXPECT--
+gc_collect_cycles==>(gc)                : ct=       1; gc=*; wt=*;
+main()                                  : ct=       1; wt=*;
+main()==>cycles                         : ct=       1; wt=*;
+main()==>gc_collect_cycles              : ct=       1; wt=*;
+main()==>xhprof_disable                 : ct=       1; wt=*;
+
+gc: ok
+implicit: yes
@@ -0,0 +1,33 @@
+--TEST--
+XHProf: xhprof_enable() In A Sampled Request
+--INI--
+xhprof.sample_requests=1
+--FILE--
+<?php
+
+include_once dirname(__FILE__).'/common.php';
+
+function foo() {
+  return str_repeat("x", 10);
+}
+
+function bar() {
+  return strlen(foo());
+}
+
+// every request is sampled, the profile started before the script
+foo();
+
+// the script's own profile replaces it, with its flags and options
+xhprof_enable(XHPROF_FLAGS_MEMORY, array('ignored_functions' => array('bar')));
+bar();
+$output = xhprof_disable();
+
+print_canonical($output);
+?>
+--EXPECT--
+foo==>str_repeat                        : ct=       1; mu=*; pmu=*; wt=*;
+main()                                  : ct=       1; mu=*; pmu=*; wt=*;
+main()==>foo                            : ct=       1; mu=*; pmu=*; wt=*;
+main()==>strlen                         : ct=       1; mu=*; pmu=*; wt=*;
+main()==>xhprof_disable                 : ct=       1; mu=*; pmu=*; wt=*;
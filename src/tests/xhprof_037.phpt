@@ -0,0 +1,28 @@
+--TEST--
+XHProf: Counters Of Suspended Fibers
+--SKIPIF--
+<?php if (PHP_VERSION_ID < 80100) print "skip: fibers need PHP 8.1"; ?>
+--INI--
+xhprof.counters=1
+--FILE--
+<?php
+
+function work() {
+  return Fiber::suspend(1) + 1;
+}
+
+$fiber = new Fiber('work');
+$fiber->start();
+// the fiber's frames don't count the time it is switched out
+usleep(50000);
+$fiber->resume(1);
+
+$counters = xhprof_counters();
+echo "work: " . $counters["work"]["ct"] . "\n";
+echo "wt: " . ($counters["work"]["wt"] < 50000 ? "ok" : $counters["work"]["wt"]) . "\n";
+echo "result: " . $fiber->getReturn() . "\n";
+?>
+--EXPECT--
+work: 1
+wt: ok
+result: 2
@@ -0,0 +1,213 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+ * Reference collector for xhprof.collector: receives the profile of every
+ * request on a Unix datagram socket, merges them, and appends the merged
+ * profile to a file every interval.
+ *
+ *   xhprof_collector -s /run/xhprof.sock -o /var/log/xhprof.xhpf -i 60
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "xhprof_format.h"
+
+/* Largest datagram accepted */
+#define COLLECTOR_MAX_DATAGRAM   (16 * 1024 * 1024)
+
+static volatile sig_atomic_t collector_stop = 0;
+
+static void collector_on_signal(int sig) {
+  (void)sig;
+  collector_stop = 1;
+}
+
+static uint64_t collector_now_us(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void collector_usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s -s socket -o output [-i seconds]\n"
+          "  -s  Unix datagram socket to listen on (xhprof.collector)\n"
+          "  -o  file the merged profiles are appended to\n"
+          "  -i  seconds between writes of the merged profile (60)\n",
+          prog);
+}
+
+/**
+ * Append the merged profile to the output file and start a new one.
+ */
+static int collector_write(hp_prof_t *merged, const char *output) {
+  hp_prof_buf_t buf;
+  FILE         *fp;
+  uint32_t      seq;
+  int           ret = -1;
+
+  if (!merged->runs) {
+    return 0;
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  merged->time_us = collector_now_us();
+  merged->pid     = (uint32_t)getpid();
+
+  if (hp_prof_write(merged, &buf) == 0 && (fp = fopen(output, "ab"))) {
+    if (fwrite(buf.data, 1, buf.len, fp) == buf.len) {
+      ret = 0;
+    }
+    if (fclose(fp)) {
+      ret = -1;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "xhprof_collector: can't write %s: %s\n", output,
+            strerror(errno));
+  }
+
+  hp_prof_buf_free(&buf);
+  seq = merged->seq;
+  hp_prof_free(merged);
+  merged->runs = 0;
+  merged->seq  = seq + 1;
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  const char         *path     = NULL;
+  const char         *output   = NULL;
+  long                interval = 60;
+  struct sockaddr_un  addr;
+  struct sigaction    sa;
+  hp_prof_t           merged;
+  unsigned char      *data;
+  uint64_t            next;
+  unsigned long       received = 0, bad = 0;
+  int                 rcvbuf   = 4 * 1024 * 1024;
+  int                 fd, opt;
+
+  while ((opt = getopt(argc, argv, "s:o:i:h")) != -1) {
+    switch (opt) {
+      case 's': path     = optarg;       break;
+      case 'o': output   = optarg;       break;
+      case 'i': interval = atol(optarg); break;
+      default:
+        collector_usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!path || !output || interval <= 0) {
+    collector_usage(argv[0]);
+    return 2;
+  }
+
+  if (!(data = malloc(COLLECTOR_MAX_DATAGRAM))) {
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "xhprof_collector: socket path too long\n");
+    return 2;
+  }
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    perror("xhprof_collector: socket");
+    return 1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("xhprof_collector: bind");
+    return 1;
+  }
+  /* Let PHP processes that aren't running as the collector's user send */
+  chmod(path, 0666);
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = collector_on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  hp_prof_init(&merged);
+  merged.runs = 0;
+  next = collector_now_us() + (uint64_t)interval * 1000000;
+
+  while (!collector_stop) {
+    struct pollfd pfd;
+    uint64_t      now = collector_now_us();
+    int           timeout;
+
+    if (now >= next) {
+      fprintf(stderr, "xhprof_collector: %lu received, %lu bad, %u merged\n",
+              received, bad, merged.runs);
+      collector_write(&merged, output);
+      next = now + (uint64_t)interval * 1000000;
+      continue;
+    }
+
+    pfd.fd     = fd;
+    pfd.events = POLLIN;
+    timeout    = (int)((next - now) / 1000) + 1;
+    if (poll(&pfd, 1, timeout) <= 0) {
+      continue;
+    }
+
+    /* Drain what is queued */
+    for (;;) {
+      ssize_t   n = recv(fd, data, COLLECTOR_MAX_DATAGRAM, MSG_DONTWAIT);
+      hp_prof_t prof;
+      size_t    used;
+
+      if (n < 0) {
+        break;
+      }
+      received++;
+
+      hp_prof_init(&prof);
+      if (hp_prof_read(data, (size_t)n, &prof, &used) != 0
+          || hp_prof_merge(&merged, &prof) != 0) {
+        bad++;
+      }
+      hp_prof_free(&prof);
+    }
+  }
+
+  collector_write(&merged, output);
+  close(fd);
+  unlink(path);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+ * Compare two profile files (xhprof.stream, xhprof_collector output) and
+ * print what changed, biggest change first, as tab separated rows:
+ *
+ *   type  symbol  before  after  delta
+ *
+ * Functions are compared by their exclusive metric, edges by the metric of
+ * the edge.
+ *
+ *   xhprof_diff -m wt -n 20 before.xhpf after.xhpf
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xhprof_format.h"
+#include "xhprof_report.h"
+
+static void diff_usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-m metric] [-n rows] [-e] before after\n"
+          "  -m  ct, wt, cpu, mu, pmu or io (wt)\n"
+          "  -n  rows to print, 0 for all (50)\n"
+          "  -e  print edges too, not only functions\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  hp_prof_t         before, after;
+  hp_report_diff_t *rows;
+  size_t            nrows, i, printed = 0;
+  long              limit  = 50;
+  int               metric = HP_REPORT_WT;
+  int               edges  = 0;
+  int               opt;
+
+  while ((opt = getopt(argc, argv, "m:n:eh")) != -1) {
+    switch (opt) {
+      case 'm':
+        if ((metric = hp_report_metric(optarg)) < 0) {
+          fprintf(stderr, "unknown metric: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        limit = strtol(optarg, NULL, 10);
+        break;
+      case 'e':
+        edges = 1;
+        break;
+      default:
+        diff_usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (argc - optind != 2) {
+    diff_usage(argv[0]);
+    return 1;
+  }
+
+  if (hp_prof_load(argv[optind], &before) < 0) {
+    fprintf(stderr, "can't read profile %s\n", argv[optind]);
+    return 1;
+  }
+  if (hp_prof_load(argv[optind + 1], &after) < 0) {
+    fprintf(stderr, "can't read profile %s\n", argv[optind + 1]);
+    hp_prof_free(&before);
+    return 1;
+  }
+
+  if (hp_report_diff(&before, &after, metric, &rows, &nrows) < 0) {
+    fprintf(stderr, "out of memory\n");
+    hp_prof_free(&before);
+    hp_prof_free(&after);
+    return 1;
+  }
+
+  printf("# %s per run, before: %u runs, after: %u runs\n",
+         hp_report_metric_names[metric], before.runs, after.runs);
+
+  for (i = 0; i < nrows && (limit <= 0 || (long)printed < limit); i++) {
+    const hp_report_diff_t *row = &rows[i];
+    int64_t b = row->is_edge ? row->before[metric] : row->before_excl[metric];
+    int64_t a = row->is_edge ? row->after[metric] : row->after_excl[metric];
+
+    if (row->is_edge && !edges) {
+      continue;
+    }
+    printf("%s\t%s\t%lld\t%lld\t%+lld\n",
+           row->is_edge ? "edge" : "function", row->symbol,
+           (long long)b, (long long)a, (long long)(a - b));
+    printed++;
+  }
+
+  hp_report_diff_free(rows, nrows);
+  hp_prof_free(&before);
+  hp_prof_free(&after);
+  return 0;
+}
@@ -0,0 +1,273 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+ * Merge many stored profiles (xhprof.stream files, per-request dumps,
+ * collector output) into one, on all cores: every thread merges the files
+ * it takes into its own profile, and those are merged at the end.
+ *
+ *   xhprof_merge -o endpoint.xhpf -a /var/log/xhprof/checkout.*.xhpf
+ *   find /var/log/xhprof -name '*.xhpf' | xhprof_merge -o day.xhpf
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "xhprof_format.h"
+
+/* Most threads started, whatever -j says */
+#define MERGE_MAX_THREADS        256
+
+typedef struct merge_job_t {
+  char              **paths;
+  size_t              npaths;
+  size_t              next;          /* next path to take, under lock   */
+  pthread_mutex_t     lock;
+} merge_job_t;
+
+typedef struct merge_worker_t {
+  pthread_t           thread;
+  merge_job_t        *job;
+  hp_prof_t           merged;
+  size_t              files;
+  size_t              failed;
+  int                 oom;
+} merge_worker_t;
+
+static void merge_usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s -o output [-j threads] [-a] [profile ...]\n"
+          "  -o  file to write the merged profile to, - for stdout\n"
+          "  -j  threads (one per core)\n"
+          "  -a  write averages per run instead of totals\n"
+          "  the profiles are read from stdin, one path per line, when none\n"
+          "  are given\n",
+          prog);
+}
+
+static void *merge_worker(void *arg) {
+  merge_worker_t *w   = arg;
+  merge_job_t    *job = w->job;
+
+  for (;;) {
+    hp_prof_t one;
+    size_t    i;
+
+    pthread_mutex_lock(&job->lock);
+    i = job->next < job->npaths ? job->next++ : job->npaths;
+    pthread_mutex_unlock(&job->lock);
+    if (i == job->npaths) {
+      break;
+    }
+
+    if (hp_prof_load(job->paths[i], &one) < 0) {
+      fprintf(stderr, "xhprof_merge: can't read profile %s\n",
+              job->paths[i]);
+      w->failed++;
+      continue;
+    }
+    if (hp_prof_merge(&w->merged, &one) < 0) {
+      hp_prof_free(&one);
+      w->oom = 1;
+      break;
+    }
+    hp_prof_free(&one);
+    w->files++;
+  }
+
+  return NULL;
+}
+
+/**
+ * Read the paths of the profiles from stdin, one per line.
+ */
+static int merge_read_paths(char ***paths, size_t *npaths) {
+  char   line[4096];
+  size_t cap = 0;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    size_t len = strcspn(line, "\r\n");
+
+    if (!len) {
+      continue;
+    }
+    line[len] = 0;
+    if (*npaths == cap) {
+      char **tmp;
+
+      cap = cap ? cap * 2 : 1024;
+      if (!(tmp = realloc(*paths, cap * sizeof(char *)))) {
+        return -1;
+      }
+      *paths = tmp;
+    }
+    if (!((*paths)[*npaths] = strdup(line))) {
+      return -1;
+    }
+    (*npaths)++;
+  }
+  return 0;
+}
+
+static int merge_write(const hp_prof_t *merged, const char *output) {
+  hp_prof_buf_t buf;
+  FILE         *fp;
+  int           ret = -1;
+
+  memset(&buf, 0, sizeof(buf));
+  if (hp_prof_write(merged, &buf) == 0
+      && (fp = strcmp(output, "-") ? fopen(output, "wb") : stdout)) {
+    if (fwrite(buf.data, 1, buf.len, fp) == buf.len) {
+      ret = 0;
+    }
+    if (fp == stdout ? fflush(fp) : fclose(fp)) {
+      ret = -1;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "xhprof_merge: can't write %s: %s\n", output,
+            strerror(errno));
+  }
+
+  hp_prof_buf_free(&buf);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  const char     *output  = NULL;
+  long            threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int             average = 0;
+  merge_job_t     job;
+  merge_worker_t *workers;
+  hp_prof_t       merged;
+  struct timeval  tv;
+  size_t          files = 0, failed = 0, i;
+  int             oom = 0, from_stdin = 0, opt;
+  long            t;
+
+  while ((opt = getopt(argc, argv, "o:j:ah")) != -1) {
+    switch (opt) {
+      case 'o':
+        output = optarg;
+        break;
+      case 'j':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      case 'a':
+        average = 1;
+        break;
+      default:
+        merge_usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (!output) {
+    merge_usage(argv[0]);
+    return 1;
+  }
+
+  memset(&job, 0, sizeof(job));
+  pthread_mutex_init(&job.lock, NULL);
+  if (optind < argc) {
+    job.paths  = argv + optind;
+    job.npaths = (size_t)(argc - optind);
+  } else {
+    from_stdin = 1;
+    if (merge_read_paths(&job.paths, &job.npaths) < 0) {
+      fprintf(stderr, "xhprof_merge: out of memory\n");
+      return 1;
+    }
+  }
+
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > MERGE_MAX_THREADS) {
+    threads = MERGE_MAX_THREADS;
+  }
+  if ((size_t)threads > job.npaths) {
+    threads = job.npaths ? (long)job.npaths : 1;
+  }
+
+  if (!(workers = calloc((size_t)threads, sizeof(merge_worker_t)))) {
+    fprintf(stderr, "xhprof_merge: out of memory\n");
+    return 1;
+  }
+
+  for (t = 0; t < threads; t++) {
+    workers[t].job = &job;
+    hp_prof_init(&workers[t].merged);
+    workers[t].merged.runs = 0;
+    if (pthread_create(&workers[t].thread, NULL, merge_worker, &workers[t])) {
+      fprintf(stderr, "xhprof_merge: can't start thread\n");
+      return 1;
+    }
+  }
+
+  /* Reduce: the per thread profiles into the first one */
+  for (t = 0; t < threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+    files  += workers[t].files;
+    failed += workers[t].failed;
+    oom    |= workers[t].oom;
+    if (t && !oom && hp_prof_merge(&workers[0].merged, &workers[t].merged) < 0) {
+      oom = 1;
+    }
+    if (t) {
+      hp_prof_free(&workers[t].merged);
+    }
+  }
+  merged = workers[0].merged;
+  free(workers);
+
+  if (from_stdin) {
+    for (i = 0; i < job.npaths; i++) {
+      free(job.paths[i]);
+    }
+    free(job.paths);
+  }
+  pthread_mutex_destroy(&job.lock);
+
+  if (oom) {
+    fprintf(stderr, "xhprof_merge: out of memory\n");
+    hp_prof_free(&merged);
+    return 1;
+  }
+
+  gettimeofday(&tv, NULL);
+  merged.time_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  merged.pid     = (uint32_t)getpid();
+  merged.seq     = 0;
+
+  if ((average && hp_prof_normalize(&merged) < 0)
+      || merge_write(&merged, output) < 0) {
+    hp_prof_free(&merged);
+    return 1;
+  }
+
+  fprintf(stderr, "xhprof_merge: %zu files, %u runs, %u edges, %zu failed\n",
+          files, merged.runs, merged.nedges, failed);
+  hp_prof_free(&merged);
+  return failed ? 2 : 0;
+}
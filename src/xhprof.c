@@ -136,28 +136,112 @@ double get_cpu_frequency() {
 
 
 /**
- * A hash function to calculate a 8-bit hash code for a function name.
- * This is based on a small modification to 'zend_inline_hash_func' by summing
- * up all bytes of the ulong returned by 'zend_inline_hash_func'.
+ * ***********************
+ * Function name hashing.
+ * ***********************
+ */
+
+/* Fold a 64 bit hash into the 8 bit code the filters are indexed by */
+static inline uint8 hp_hash_fold(uint64 h) {
+  h ^= h >> 32;
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return (uint8)h;
+}
+
+/**
+ * Portable hash, a word at a time rather than a byte at a time: long
+ * namespaced method names are the common case.
+ */
+static uint8 hp_hash_words(const char *str, size_t len) {
+  uint64 h = 5381 ^ len;
+  uint64 w;
+
+  for (; len >= sizeof(w); str += sizeof(w), len -= sizeof(w)) {
+    memcpy(&w, str, sizeof(w));
+    h  = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  if (len) {
+    w = 0;
+    memcpy(&w, str, len);
+    h  = (h ^ w) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+  return hp_hash_fold(h);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define HP_HAVE_CRC32 1
+# include <nmmintrin.h>
+
+/**
+ * The same with the SSE4.2 crc32 instruction, 8 bytes per instruction.
+ * Only called when the CPU has it, see hp_hash_init().
+ */
+__attribute__((target("sse4.2")))
+static uint8 hp_hash_crc32(const char *str, size_t len) {
+  uint64 h = len;
+  uint64 w;
+
+  for (; len >= sizeof(w); str += sizeof(w), len -= sizeof(w)) {
+    memcpy(&w, str, sizeof(w));
+    h = _mm_crc32_u64(h, w);
+  }
+  for (; len; str++, len--) {
+    h = _mm_crc32_u8((uint32)h, (unsigned char)*str);
+  }
+  return hp_hash_fold(h);
+}
+#endif
+
+static uint8 (*hp_hash_func)(const char *str, size_t len) = hp_hash_words;
+
+/**
+ * Pick the fastest hash the CPU supports. Called once at startup, before
+ * any name is hashed: codes from different functions can't be mixed.
+ */
+void hp_hash_init() {
+#ifdef HP_HAVE_CRC32
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    hp_hash_func = hp_hash_crc32;
+  }
+#endif
+}
+
+/**
+ * The hash hp_hash_init() picked, for phpinfo().
+ */
+const char *hp_hash_name() {
+#ifdef HP_HAVE_CRC32
+  if (hp_hash_func == hp_hash_crc32) {
+    return "crc32 (sse4.2)";
+  }
+#endif
+  return "scalar";
+}
+
+/**
+ * Calculate the 8-bit hash code of a function name, used to filter most
+ * of the name comparisons (ignored functions, recursion levels).
+ *
+ * @param str, the name
+ * @param len, its length
+ */
+uint8 hp_inline_hash_len(const char *str, size_t len) {
+  return hp_hash_func(str, len);
+}
+
+/**
+ * hp_inline_hash_len() of a null terminated name.
  *
  * @param str, char *, string to be calculated hash code for.
  *
  * @author cjiang
  */
 uint8 hp_inline_hash(char * str) {
-  ulong h = 5381;
-  uint i = 0;
-  uint8 res = 0;
-
-  while (*str) {
-    h += (h << 5);
-    h ^= (ulong) *str++;
-  }
-
-  for (i = 0; i < sizeof(ulong); i++) {
-    res += ((uint8 *)&h)[i];
-  }
-  return res;
+  return hp_hash_func(str, strlen(str));
 }
 
 /* Free this memory at the end of profiling */
@@ -198,6 +282,193 @@ const char *hp_get_base_filename(const char *filename) {
 }
 
 
+/**
+ * ***********************
+ * Span fingerprints: arguments of database and HTTP calls with their
+ * literal values masked, so that calls of the same shape group together.
+ * ***********************
+ */
+
+/* Append c to out if there is room, always leaving room for the NUL */
+#define HP_FP_PUT(c)                                                    \
+  do {                                                                  \
+    if (n + 1 < size) {                                                 \
+      out[n++] = (c);                                                   \
+    }                                                                   \
+  } while (0)
+
+static int hp_fp_ident(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+/**
+ * Fingerprint a SQL statement: string and number literals become "?",
+ * lists of them (or of "?" placeholders) become a single "?", comments are
+ * dropped and runs of white space become one space.
+ * "SELECT * FROM t WHERE id IN (1, 2, 3) AND a = 'x'" gives
+ * "SELECT * FROM t WHERE id IN (?) AND a = ?".
+ *
+ * @return the length of the fingerprint written to out
+ */
+size_t hp_sql_fingerprint(const char *sql, size_t len, char *out,
+                          size_t size) {
+  const char *p   = sql;
+  const char *end = sql + len;
+  size_t      n   = 0;
+  size_t      list = 0;            /* where a "?, ?, ..." list starts + 1 */
+  int         space = 0;
+
+  if (!size) {
+    return 0;
+  }
+
+  while (p < end && n + 1 < size) {
+    char c = *p;
+
+    if (isspace((unsigned char)c)) {
+      space = n > 0;
+      p++;
+      continue;
+    }
+
+    /* comments */
+    if (c == '-' && p + 1 < end && p[1] == '-') {
+      while (p < end && *p != '\n') {
+        p++;
+      }
+      continue;
+    }
+    if (c == '/' && p + 1 < end && p[1] == '*') {
+      for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++);
+      p += 2;
+      continue;
+    }
+
+    if (space) {
+      HP_FP_PUT(' ');
+      space = 0;
+    }
+
+    if (c == '\'' || c == '"' || c == '?'
+        || (isdigit((unsigned char)c) && (n == 0 || !hp_fp_ident(out[n - 1])))
+        || ((c == '-' || c == '.') && p + 1 < end
+            && isdigit((unsigned char)p[1])
+            && (n == 0 || strchr("(,=<>+-*/ ", out[n - 1])))) {
+      /* a literal */
+      if (c == '\'' || c == '"') {
+        for (p++; p < end; p++) {
+          if (*p == '\\' && p + 1 < end) {
+            p++;
+          } else if (*p == c) {
+            if (p + 1 < end && p[1] == c) {
+              p++;                  /* doubled quote */
+            } else {
+              break;
+            }
+          }
+        }
+        p++;
+      } else if (c == '?') {
+        p++;                        /* already a placeholder */
+      } else {
+        for (p++; p < end && (hp_fp_ident(*p) || *p == '.'); p++);
+      }
+
+      /* "?, ?" => "?" */
+      if (list && n >= 2 && (out[n - 1] == ',' || out[n - 2] == ',')) {
+        n = list - 1;
+      } else {
+        list = n + 1;
+      }
+      HP_FP_PUT('?');
+      continue;
+    }
+
+    if (c != ',') {
+      list = 0;
+    }
+    HP_FP_PUT(c);
+    p++;
+  }
+
+  out[n] = 0;
+  return n;
+}
+
+/**
+ * Fingerprint a key, a path or a URL: runs of digits, and long runs of hex
+ * digits (ids, hashes, UUIDs) become "?". For a URL, only the path is
+ * masked and the query string and fragment are dropped:
+ * "https://api.example.com/users/42?x=1" gives
+ * "https://api.example.com/users/?".
+ *
+ * @return the length of the fingerprint written to out
+ */
+size_t hp_key_fingerprint(const char *key, size_t len, char *out,
+                          size_t size) {
+  const char *p   = key;
+  const char *end = key + len;
+  size_t      n   = 0;
+  const char *host = NULL;           /* after "scheme://" of a URL       */
+  size_t      i;
+
+  if (!size) {
+    return 0;
+  }
+
+  for (i = 0; i + 3 <= len && !host; i++) {
+    if (!memcmp(key + i, "://", 3)) {
+      host = key + i + 3;
+    }
+  }
+
+  /* the scheme, host and port of a URL are kept as they are */
+  if (host) {
+    for (; p < end && (p < host || (*p != '/' && *p != '?' && *p != '#'));
+         p++) {
+      HP_FP_PUT(*p);
+    }
+  }
+
+  while (p < end && n + 1 < size) {
+    const char *q;
+    int         digits = 0;
+
+    if (host && (*p == '?' || *p == '#')) {
+      break;
+    }
+
+    /* a run of hex digits, and whether it has any decimal digit */
+    for (q = p; q < end && isxdigit((unsigned char)*q); q++) {
+      digits |= isdigit((unsigned char)*q) != 0;
+    }
+    if (q > p && digits
+        && (q - p >= 8 || !isalpha((unsigned char)*p) || p == key
+            || !isalnum((unsigned char)p[-1]))
+        && (q == end || !isalpha((unsigned char)*q))) {
+      HP_FP_PUT('?');
+      p = q;
+      continue;
+    }
+
+    /* a word: copy it whole, so "v2" or "md5" stay */
+    for (q = p; q < end && isalnum((unsigned char)*q); q++) {
+      HP_FP_PUT(*q);
+    }
+    if (q == p) {
+      HP_FP_PUT(*p);
+      q++;
+    }
+    p = q;
+  }
+
+  out[n] = 0;
+  return n;
+}
+
+#undef HP_FP_PUT
+
+
 /*
  * Local variables:
  * tab-width: 4
@@ -15,14 +15,37 @@
   | Author: midoks(midoks@163.com)                                       |
   +----------------------------------------------------------------------+
 */
+#ifndef XHPROF_H
+#define XHPROF_H
+
 #include "php.h"
 
+/* PHP 8 dropped the TSRMLS_* argument macros, keep them around as no-ops */
+#ifndef TSRMLS_D
+# define TSRMLS_D   void
+# define TSRMLS_DC
+# define TSRMLS_C
+# define TSRMLS_CC
+#endif
+
+#ifndef zval_dtor
+# define zval_dtor(zv) zval_ptr_dtor_nogc(zv)
+#endif
+
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/mman.h>
 
 #ifdef __FreeBSD__
 # if __FreeBSD_version >= 700110
@@ -71,6 +94,24 @@
  * in the name is to ensure we don't conflict with user function names.  */
 #define ROOT_SYMBOL                "main()"
 
+/* Fictitious function name for the bottom of a fiber's own call tree. */
+#define FIBER_SYMBOL               "{fiber}"
+
+/* Key of the pseudo entry holding the profiler's own overhead, see
+ * XHPROF_FLAGS_OVERHEAD. */
+#define OVERHEAD_SYMBOL            "(xhprof)"
+
+/* Caller recorded for builtins folded by XHPROF_FLAGS_ADAPTIVE. */
+#define FOLDED_SYMBOL              "(folded)"
+
+/* Entry the calls of new edges (and samples) go to once the profile has
+ * reached xhprof.max_edges, xhprof.max_key_bytes or xhprof.max_samples. */
+#define OTHER_SYMBOL               "(other)"
+
+/* Fictitious function name for a run of the cycle collector, under the
+ * function that triggered it. */
+#define GC_SYMBOL                  "(gc)"
+
 /* Size of a temp scratch buffer            */
 #define SCRATCH_BUF_LEN            512
 
@@ -78,6 +119,7 @@
  * callbacks in hp_begin() */
 #define XHPROF_MODE_HIERARCHICAL            1
 #define XHPROF_MODE_SAMPLED            620002      /* Rockfort's zip code */
+#define XHPROF_MODE_COUNTERS                3      /* xhprof.counters    */
 
 /* Hierarchical profiling flags.
  *
@@ -88,6 +130,50 @@
 #define XHPROF_FLAGS_NO_BUILTINS   0x0001         /* do not profile builtins */
 #define XHPROF_FLAGS_CPU           0x0002         /* gather CPU times for funcs */
 #define XHPROF_FLAGS_MEMORY        0x0004         /* gather memory usage for funcs */
+#define XHPROF_FLAGS_OVERHEAD      0x0008         /* report profiler overhead */
+#define XHPROF_FLAGS_COMPENSATE    0x0010         /* subtract overhead from wt */
+#define XHPROF_FLAGS_ADAPTIVE      0x0020         /* fold very short builtins */
+#define XHPROF_FLAGS_IOWAIT        0x0040         /* off-CPU time of blocking
+                                                   * builtins ("io")         */
+
+/* Modes of xhprof_disable(): also return, or return only, a summary per
+ * function with the XHPROF_SUMMARY_TOP top functions of each metric. */
+#define XHPROF_SUMMARY             0x0001
+#define XHPROF_SUMMARY_ONLY        0x0002
+#define XHPROF_SUMMARY_TOP               20
+
+/* Spans ("spans" option of xhprof_enable()): where the fingerprint of a
+ * call comes from, see hp_span_kind() */
+#define XHPROF_SPAN_NONE                  0
+#define XHPROF_SPAN_SQL                   1  /* first string argument    */
+#define XHPROF_SPAN_STMT                  2  /* PDOStatement queryString */
+#define XHPROF_SPAN_URL                   3  /* first argument, if a URL */
+#define XHPROF_SPAN_CURL                  4  /* curl handle's URL        */
+#define XHPROF_SPAN_KEY                   5  /* first string argument    */
+
+/* Longest span fingerprint */
+#define XHPROF_SPAN_FINGERPRINT_LEN     256
+
+/* Calibration of the per-call profiler overhead: the cheapest of
+ * XHPROF_CALIBRATION_BATCHES runs of XHPROF_CALIBRATION_CALLS calls. */
+#define XHPROF_CALIBRATION_BATCHES        5
+#define XHPROF_CALIBRATION_CALLS        100
+#define XHPROF_CALIBRATION_SYMBOL  "(calibration)"
+
+/* XHPROF_FLAGS_ADAPTIVE times builtins in windows of this many calls. A
+ * builtin whose average over a window is below the per-call profiler
+ * overhead is no longer profiled, only counted. */
+#define XHPROF_ADAPTIVE_WINDOW           32
+
+/* Call sampling ("sample_calls" option of xhprof_enable()) keys edges by
+ * the symbol ids and recursion levels of both ends, packed in 64 bits.
+ * Edges that don't fit are timed on every call. */
+#define XHPROF_EDGE_ID_BITS              24
+#define XHPROF_EDGE_RLVL_BITS             8
+
+/* Largest profile sent to xhprof.collector, tools/xhprof_collector
+ * receives datagrams of up to this size. */
+#define XHPROF_COLLECTOR_MAX_DATAGRAM  (16 * 1024 * 1024)
 
 /* Constants for XHPROF_MODE_SAMPLED        */
 #define XHPROF_SAMPLING_INTERVAL       100000     /* In microsecs        */
@@ -115,6 +201,122 @@ typedef unsigned char uint8;
 #define INDEX_2_BYTE(index)  (index >> 3)
 #define INDEX_2_BIT(index)   (1 << (index & 0x7));
 
+/**
+ * *****************************
+ * GLOBAL DATATYPES AND TYPEDEFS
+ * *****************************
+ */
+
+/* XHProf maintains a stack of entries being profiled. The memory for the entry
+ * is passed by the layer that invokes BEGIN_PROFILING(), e.g. the hp_execute()
+ * function. Often, this is just C-stack memory.
+ *
+ * This structure is a convenient place to track start time of a particular
+ * profile operation, recursion depth, and the name of the function being
+ * profiled. */
+typedef struct hp_entry_t {
+  char                   *name_hprof;                       /* function name */
+  int                     rlvl_hprof;        /* recursion level for function */
+  uint64                  tsc_start;         /* start value for TSC counter  */
+  long int                mu_start_hprof;                    /* memory usage */
+  long int                pmu_start_hprof;              /* peak memory usage */
+  struct rusage           ru_start_hprof;             /* user/sys time start */
+  uint64                  suspended_tsc;     /* TSC ticks spent in a suspended
+                                              * fiber, excluded from wt    */
+  uint64                  calls_start;       /* intercepted calls at start   */
+  uint64                  io_start;          /* XHPROF_G(io_wait_us) at start*/
+  uint64                  cpu_start_ns;      /* thread CPU time at start, for
+                                              * blocking builtins          */
+  struct hp_entry_t      *prev_hprof;    /* ptr to prev entry being profiled */
+  struct hp_edge_t       *edge;          /* edge when sampling calls, or NULL*/
+  uint32                  symbol_id;     /* id of name_hprof, 0 if unknown   */
+  uint8                   hash_code;     /* hash_code for the function name  */
+  uint8                   untimed;       /* call sampling skipped this call  */
+  uint8                   blocking;      /* builtin that may wait for I/O    */
+  uint8                   resume;        /* a generator resumed, not called  */
+} hp_entry_t;
+
+/* A caller==>callee edge when only 1 in XHPROF_G(call_sample_rate) calls
+ * is timed. Calls are counted exactly here; the timed ones are recorded in
+ * stats_count as usual and scaled up by hp_sampled_edges_finish(). */
+typedef struct hp_edge_t {
+  char                   *symbol;            /* key in stats_count         */
+  uint64                  ct;                /* calls                      */
+  uint64                  timed;             /* calls that were timed      */
+  double                  wt_sum;            /* their wall time in us      */
+  double                  wt_sq;             /* and its sum of squares     */
+  uint32                  countdown;         /* calls until the next timed */
+} hp_edge_t;
+
+/* Function names longer than this are cut in the counters table */
+#define HP_COUNTER_NAME_LEN      240
+
+/* A function name in the counters table, shared by all the processes (see
+ * hp_counters_init()). A slot is taken by setting hash from 0, and its
+ * name can be read once ready is set. */
+typedef struct hp_counter_name_t {
+  uint64                  hash;              /* of the whole name, 0: free */
+  uint32                  ready;
+  uint32                  len;               /* may exceed the name kept   */
+  char                    name[HP_COUNTER_NAME_LEN];
+} hp_counter_name_t;
+
+/* Totals of a function in one shard of the counters table */
+typedef struct hp_counter_t {
+  uint64                  ct;                /* calls                      */
+  uint64                  wt;                /* inclusive wall time in us  */
+} hp_counter_t;
+
+/* Header of the counters table. Counts are kept per CPU, in shards of
+ * nslots hp_counter_t after the names, so that workers on different CPUs
+ * don't write to the same cache lines. */
+typedef struct hp_counters_t {
+  uint32                  nslots;            /* a power of 2               */
+  uint32                  nshards;
+  uint64                  dropped;           /* calls of names not kept    */
+  hp_counter_name_t      *names;
+  hp_counter_t           *counts;            /* [nshards][nslots]          */
+} hp_counters_t;
+
+/* Per-request facts about a zend_function that don't change between calls,
+ * computed on its first call and cached (see hp_get_func_info()) in the
+ * op_array's reserved slot or in a side table. */
+typedef struct hp_func_info_t {
+  char                   *name;            /* qualified function name      */
+  uint32                  symbol_id;       /* id of name, see hp_symbol_id */
+  uint32                  filter_gen;      /* XHPROF_G(filter_gen) that the
+                                            * decision below was made for  */
+  uint32                  name_len;        /* strlen(name)                 */
+  uint8                   hash_code;       /* hp_inline_hash(name)         */
+  uint8                   profile;         /* 0: skip all profiler work    */
+  uint8                   folded;          /* XHPROF_FLAGS_ADAPTIVE gave up
+                                            * timing this builtin          */
+  uint8                   blocking;        /* builtin that may wait for I/O,
+                                            * see hp_blocking_function()   */
+  uint8                   span;            /* XHPROF_SPAN_* kind           */
+  uint32                  timed_calls;     /* calls in the current window  */
+  uint64                  timed_tsc;       /* and the TSC ticks they took  */
+  uint64                  folded_calls;    /* calls since it was folded    */
+  void                  **slot;            /* reserved[] slot pointing here,
+                                            * cleared at request shutdown  */
+  void                   *scope;           /* scope the entry was made for */
+} hp_func_info_t;
+
+/* Various types for XHPROF callbacks       */
+typedef void (*hp_init_cb)           (TSRMLS_D);
+typedef void (*hp_exit_cb)           (TSRMLS_D);
+typedef void (*hp_begin_function_cb) (hp_entry_t **entries,
+                                      hp_entry_t *current   TSRMLS_DC);
+typedef void (*hp_end_function_cb)   (hp_entry_t **entries  TSRMLS_DC);
+
+/* Struct to hold the various callbacks for a single xhprof mode */
+typedef struct hp_mode_cb {
+  hp_init_cb             init_cb;
+  hp_exit_cb             exit_cb;
+  hp_begin_function_cb   begin_fn_cb;
+  hp_end_function_cb     end_fn_cb;
+} hp_mode_cb;
+
 uint64 cycle_timer();
 void hp_trunc_time(struct timeval *tv,uint64 intr);
 
@@ -125,9 +327,18 @@ void incr_us_interval(struct timeval *start, uint64 incr);
 double get_us_from_tsc(uint64 count, double cpu_frequency);
 uint64 get_tsc_from_us(uint64 usecs, double cpu_frequency);
 
+void hp_hash_init();
+const char *hp_hash_name();
 uint8 hp_inline_hash(char * str);
+uint8 hp_inline_hash_len(const char *str, size_t len);
 void hp_array_del(char **name_array);
 const char *hp_get_base_filename(const char *filename);
+size_t hp_sql_fingerprint(const char *sql, size_t len, char *out,
+                          size_t size);
+size_t hp_key_fingerprint(const char *key, size_t len, char *out,
+                          size_t size);
+
+#endif /* XHPROF_H */
 
 /*
  * Local variables:
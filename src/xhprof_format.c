@@ -0,0 +1,793 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xhprof_format.h"
+
+/**
+ * ***********************
+ * STRING TABLES
+ * ***********************
+ */
+
+/* FNV-1a */
+static uint32_t hp_prof_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  size_t   i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void hp_prof_strtab_free(hp_prof_strtab_t *t) {
+  uint32_t i;
+
+  for (i = 0; i < t->count; i++) {
+    free(t->strs[i]);
+  }
+  free(t->strs);
+  free(t->lens);
+  free(t->slots);
+  memset(t, 0, sizeof(*t));
+}
+
+static int64_t hp_prof_strtab_find(const hp_prof_strtab_t *t,
+                                   const char *s, size_t len) {
+  uint32_t i;
+
+  if (!t->nslots) {
+    return -1;
+  }
+
+  for (i = hp_prof_hash(s, len) & (t->nslots - 1);
+       t->slots[i];
+       i = (i + 1) & (t->nslots - 1)) {
+    uint32_t idx = t->slots[i] - 1;
+
+    if (t->lens[idx] == len && !memcmp(t->strs[idx], s, len)) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+/* Keep the slots at most half full */
+static int hp_prof_strtab_grow(hp_prof_strtab_t *t) {
+  uint32_t  nslots = t->nslots ? t->nslots * 2 : 64;
+  uint32_t *slots  = calloc(nslots, sizeof(uint32_t));
+  uint32_t  idx;
+
+  if (!slots) {
+    return -1;
+  }
+
+  for (idx = 0; idx < t->count; idx++) {
+    uint32_t i = hp_prof_hash(t->strs[idx], t->lens[idx]) & (nslots - 1);
+
+    while (slots[i]) {
+      i = (i + 1) & (nslots - 1);
+    }
+    slots[i] = idx + 1;
+  }
+
+  free(t->slots);
+  t->slots  = slots;
+  t->nslots = nslots;
+  return 0;
+}
+
+static int64_t hp_prof_strtab_add(hp_prof_strtab_t *t,
+                                  const char *s, size_t len) {
+  int64_t  found = hp_prof_strtab_find(t, s, len);
+  uint32_t i;
+  char    *copy;
+
+  if (found >= 0) {
+    return found;
+  }
+
+  if (len > UINT32_MAX || t->count == HP_PROF_NONE) {
+    return -1;
+  }
+
+  if (t->count == t->cap) {
+    uint32_t  cap  = t->cap ? t->cap * 2 : 64;
+    char    **strs = realloc(t->strs, cap * sizeof(char *));
+    uint32_t *lens;
+
+    if (!strs) {
+      return -1;
+    }
+    t->strs = strs;
+    if (!(lens = realloc(t->lens, cap * sizeof(uint32_t)))) {
+      return -1;
+    }
+    t->lens = lens;
+    t->cap  = cap;
+  }
+
+  if ((t->count + 1) * 2 > t->nslots && hp_prof_strtab_grow(t) < 0) {
+    return -1;
+  }
+
+  if (!(copy = malloc(len + 1))) {
+    return -1;
+  }
+  memcpy(copy, s, len);
+  copy[len] = 0;
+
+  t->strs[t->count] = copy;
+  t->lens[t->count] = (uint32_t)len;
+
+  for (i = hp_prof_hash(s, len) & (t->nslots - 1);
+       t->slots[i];
+       i = (i + 1) & (t->nslots - 1));
+  t->slots[i] = ++t->count;
+
+  return t->count - 1;
+}
+
+/**
+ * ***********************
+ * PROFILES
+ * ***********************
+ */
+
+void hp_prof_init(hp_prof_t *p) {
+  memset(p, 0, sizeof(*p));
+  p->runs = 1;
+}
+
+void hp_prof_free(hp_prof_t *p) {
+  hp_prof_strtab_free(&p->metrics);
+  hp_prof_strtab_free(&p->strings);
+  free(p->tags);
+  free(p->edges);
+  free(p->edge_slots);
+  hp_prof_init(p);
+}
+
+/**
+ * Intern a function name (or tag string).
+ *
+ * @return its index, or -1 when out of memory
+ */
+int64_t hp_prof_string(hp_prof_t *p, const char *s, size_t len) {
+  return hp_prof_strtab_add(&p->strings, s, len);
+}
+
+int64_t hp_prof_string_find(const hp_prof_t *p, const char *s, size_t len) {
+  return hp_prof_strtab_find(&p->strings, s, len);
+}
+
+/**
+ * Get the column of a metric, adding it if needed.
+ *
+ * @return the column, or -1 if the profile has HP_PROF_MAX_METRICS already
+ */
+int hp_prof_metric(hp_prof_t *p, const char *name) {
+  int64_t i = hp_prof_strtab_find(&p->metrics, name, strlen(name));
+
+  if (i < 0 && p->metrics.count < HP_PROF_MAX_METRICS) {
+    i = hp_prof_strtab_add(&p->metrics, name, strlen(name));
+  }
+  return (int)i;
+}
+
+int hp_prof_metric_find(const hp_prof_t *p, const char *name) {
+  return (int)hp_prof_strtab_find(&p->metrics, name, strlen(name));
+}
+
+/**
+ * Add a key/value tag, replacing the value of an existing key.
+ */
+int hp_prof_tag(hp_prof_t *p, const char *key, const char *value) {
+  int64_t  k = hp_prof_string(p, key, strlen(key));
+  int64_t  v = hp_prof_string(p, value, strlen(value));
+  uint32_t i;
+
+  if (k < 0 || v < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < p->ntags; i++) {
+    if (p->tags[2 * i] == (uint32_t)k) {
+      p->tags[2 * i + 1] = (uint32_t)v;
+      return 0;
+    }
+  }
+
+  if (p->ntags == p->tags_cap) {
+    uint32_t  cap  = p->tags_cap ? p->tags_cap * 2 : 8;
+    uint32_t *tags = realloc(p->tags, cap * 2 * sizeof(uint32_t));
+
+    if (!tags) {
+      return -1;
+    }
+    p->tags     = tags;
+    p->tags_cap = cap;
+  }
+
+  p->tags[2 * p->ntags]     = (uint32_t)k;
+  p->tags[2 * p->ntags + 1] = (uint32_t)v;
+  p->ntags++;
+  return 0;
+}
+
+static uint32_t hp_prof_edge_hash(uint32_t parent, uint32_t child) {
+  return (parent * 2654435761u) ^ (child * 2246822519u) ^ (child >> 15);
+}
+
+hp_prof_edge_t *hp_prof_edge_find(const hp_prof_t *p, uint32_t parent,
+                                  uint32_t child) {
+  uint32_t i;
+
+  if (!p->edge_nslots) {
+    return NULL;
+  }
+
+  for (i = hp_prof_edge_hash(parent, child) & (p->edge_nslots - 1);
+       p->edge_slots[i];
+       i = (i + 1) & (p->edge_nslots - 1)) {
+    hp_prof_edge_t *edge = &p->edges[p->edge_slots[i] - 1];
+
+    if (edge->parent == parent && edge->child == child) {
+      return edge;
+    }
+  }
+  return NULL;
+}
+
+static int hp_prof_edges_grow(hp_prof_t *p) {
+  uint32_t  nslots = p->edge_nslots ? p->edge_nslots * 2 : 256;
+  uint32_t *slots  = calloc(nslots, sizeof(uint32_t));
+  uint32_t  idx;
+
+  if (!slots) {
+    return -1;
+  }
+
+  for (idx = 0; idx < p->nedges; idx++) {
+    uint32_t i = hp_prof_edge_hash(p->edges[idx].parent,
+                                   p->edges[idx].child) & (nslots - 1);
+
+    while (slots[i]) {
+      i = (i + 1) & (nslots - 1);
+    }
+    slots[i] = idx + 1;
+  }
+
+  free(p->edge_slots);
+  p->edge_slots  = slots;
+  p->edge_nslots = nslots;
+  return 0;
+}
+
+/**
+ * Find the edge from parent to child, adding an empty one if needed.
+ *
+ * @return the edge, or NULL when out of memory. Valid until the next edge
+ *         is added.
+ */
+hp_prof_edge_t *hp_prof_edge(hp_prof_t *p, uint32_t parent, uint32_t child) {
+  hp_prof_edge_t *edge = hp_prof_edge_find(p, parent, child);
+  uint32_t        i;
+
+  if (edge) {
+    return edge;
+  }
+
+  if (p->nedges == p->edges_cap) {
+    uint32_t        cap   = p->edges_cap ? p->edges_cap * 2 : 256;
+    hp_prof_edge_t *edges = realloc(p->edges, cap * sizeof(hp_prof_edge_t));
+
+    if (!edges) {
+      return NULL;
+    }
+    p->edges     = edges;
+    p->edges_cap = cap;
+  }
+
+  if ((p->nedges + 1) * 2 > p->edge_nslots && hp_prof_edges_grow(p) < 0) {
+    return NULL;
+  }
+
+  edge = &p->edges[p->nedges];
+  memset(edge, 0, sizeof(*edge));
+  edge->parent = parent;
+  edge->child  = child;
+
+  for (i = hp_prof_edge_hash(parent, child) & (p->edge_nslots - 1);
+       p->edge_slots[i];
+       i = (i + 1) & (p->edge_nslots - 1));
+  p->edge_slots[i] = ++p->nedges;
+
+  return edge;
+}
+
+/**
+ * Find or add the edge of an xhprof_disable() key: "parent==>child", or
+ * just "root".
+ */
+hp_prof_edge_t *hp_prof_edge_by_key(hp_prof_t *p, const char *key,
+                                    size_t len) {
+  const char *delim = NULL;
+  const char *s;
+  int64_t     parent = HP_PROF_NONE;
+  int64_t     child;
+
+  for (s = key; s + 3 <= key + len; s++) {
+    if (!memcmp(s, HP_PROF_DELIM, 3)) {
+      delim = s;
+      break;
+    }
+  }
+
+  if (delim) {
+    if ((parent = hp_prof_string(p, key, delim - key)) < 0) {
+      return NULL;
+    }
+    child = hp_prof_string(p, delim + 3, len - (delim + 3 - key));
+  } else {
+    child = hp_prof_string(p, key, len);
+  }
+
+  if (child < 0) {
+    return NULL;
+  }
+  return hp_prof_edge(p, (uint32_t)parent, (uint32_t)child);
+}
+
+/**
+ * Format the xhprof_disable() key of an edge into buf.
+ *
+ * @return the length of the key, truncated to size - 1
+ */
+size_t hp_prof_edge_key(const hp_prof_t *p, const hp_prof_edge_t *edge,
+                        char *buf, size_t size) {
+  size_t len = 0;
+
+  if (!size) {
+    return 0;
+  }
+
+#define HP_PROF_KEY_APPEND(s, n)                                        \
+  do {                                                                  \
+    size_t _n = (n) < size - 1 - len ? (n) : size - 1 - len;            \
+    memcpy(buf + len, (s), _n);                                         \
+    len += _n;                                                          \
+  } while (0)
+
+  if (edge->parent != HP_PROF_NONE) {
+    HP_PROF_KEY_APPEND(p->strings.strs[edge->parent],
+                       p->strings.lens[edge->parent]);
+    HP_PROF_KEY_APPEND(HP_PROF_DELIM, 3);
+  }
+  HP_PROF_KEY_APPEND(p->strings.strs[edge->child],
+                     p->strings.lens[edge->child]);
+
+#undef HP_PROF_KEY_APPEND
+
+  buf[len] = 0;
+  return len;
+}
+
+/**
+ * Add the edges and runs of src to dst. Tags of src are only copied for
+ * keys dst doesn't have.
+ *
+ * @return 0, or -1 when out of memory
+ */
+int hp_prof_merge(hp_prof_t *dst, const hp_prof_t *src) {
+  int       metric[HP_PROF_MAX_METRICS];
+  uint32_t *strmap;
+  uint32_t  i, m;
+  int       ret = -1;
+
+  for (m = 0; m < src->metrics.count; m++) {
+    metric[m] = hp_prof_metric(dst, src->metrics.strs[m]);
+  }
+
+  if (!(strmap = malloc((src->strings.count + 1) * sizeof(uint32_t)))) {
+    return -1;
+  }
+  for (i = 0; i < src->strings.count; i++) {
+    int64_t s = hp_prof_string(dst, src->strings.strs[i],
+                               src->strings.lens[i]);
+    if (s < 0) {
+      goto out;
+    }
+    strmap[i] = (uint32_t)s;
+  }
+
+  for (i = 0; i < src->nedges; i++) {
+    const hp_prof_edge_t *from = &src->edges[i];
+    hp_prof_edge_t       *to;
+
+    to = hp_prof_edge(dst,
+                      from->parent == HP_PROF_NONE
+                        ? HP_PROF_NONE : strmap[from->parent],
+                      strmap[from->child]);
+    if (!to) {
+      goto out;
+    }
+
+    for (m = 0; m < src->metrics.count; m++) {
+      if ((from->mask & (1u << m)) && metric[m] >= 0) {
+        to->v[metric[m]] += from->v[m];
+        to->mask         |= 1u << metric[m];
+      }
+    }
+  }
+
+  for (i = 0; i < src->ntags; i++) {
+    int64_t  k = strmap[src->tags[2 * i]];
+    uint32_t j;
+
+    for (j = 0; j < dst->ntags && dst->tags[2 * j] != (uint32_t)k; j++);
+    if (j == dst->ntags
+        && hp_prof_tag(dst, src->strings.strs[src->tags[2 * i]],
+                       src->strings.strs[src->tags[2 * i + 1]]) < 0) {
+      goto out;
+    }
+  }
+
+  dst->runs += src->runs;
+  ret = 0;
+
+out:
+  free(strmap);
+  return ret;
+}
+
+/**
+ * Turn the totals of p into averages per run, rounded to the nearest
+ * integer. runs is kept, and the tag HP_PROF_TAG_PER_RUN tells averages
+ * from totals: don't merge such a profile with others.
+ *
+ * @return 0, or -1 when out of memory
+ */
+int hp_prof_normalize(hp_prof_t *p) {
+  int64_t  runs = p->runs;
+  uint32_t i, m;
+
+  if (runs > 1) {
+    for (i = 0; i < p->nedges; i++) {
+      for (m = 0; m < HP_PROF_MAX_METRICS; m++) {
+        int64_t v = p->edges[i].v[m];
+
+        p->edges[i].v[m] = (v < 0 ? v - runs / 2 : v + runs / 2) / runs;
+      }
+    }
+  }
+
+  return hp_prof_tag(p, HP_PROF_TAG_PER_RUN, "1");
+}
+
+/**
+ * Read a stored profile: all the frames of the file merged into p, which
+ * is initialized here.
+ *
+ * @return 0, or one of the HP_PROF_ERR_* codes (HP_PROF_ERR_SHORT for a
+ *         truncated file, or one that can't be read)
+ */
+int hp_prof_load(const char *path, hp_prof_t *p) {
+  hp_prof_buf_t  buf;
+  unsigned char  chunk[65536];
+  FILE          *fp;
+  size_t         n, pos = 0;
+  int            ret = 0;
+
+  hp_prof_init(p);
+  if (!(fp = fopen(path, "rb"))) {
+    return HP_PROF_ERR_SHORT;
+  }
+
+  memset(&buf, 0, sizeof(buf));
+  while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    if (hp_prof_buf_append(&buf, chunk, n) < 0) {
+      ret = HP_PROF_ERR_SHORT;
+      break;
+    }
+  }
+  if (ferror(fp)) {
+    ret = HP_PROF_ERR_SHORT;
+  }
+  fclose(fp);
+
+  p->runs = 0;
+  while (!ret && pos < buf.len) {
+    hp_prof_t frame;
+    size_t    used;
+
+    hp_prof_init(&frame);
+    if (!(ret = hp_prof_read(buf.data + pos, buf.len - pos, &frame, &used))) {
+      if (!p->time_us) {
+        p->time_us = frame.time_us;
+        p->pid     = frame.pid;
+        p->seq     = frame.seq;
+      }
+      if (hp_prof_merge(p, &frame) < 0) {
+        ret = HP_PROF_ERR_SHORT;
+      }
+      pos += used;
+    }
+    hp_prof_free(&frame);
+  }
+
+  hp_prof_buf_free(&buf);
+  if (ret) {
+    hp_prof_free(p);
+  }
+  return ret;
+}
+
+/**
+ * ***********************
+ * SERIALIZATION
+ * ***********************
+ */
+
+int hp_prof_buf_append(hp_prof_buf_t *buf, const void *data, size_t len) {
+  if (buf->len + len > buf->cap) {
+    size_t         cap = buf->cap ? buf->cap : 4096;
+    unsigned char *tmp;
+
+    while (cap < buf->len + len) {
+      cap *= 2;
+    }
+    if (!(tmp = realloc(buf->data, cap))) {
+      return -1;
+    }
+    buf->data = tmp;
+    buf->cap  = cap;
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+void hp_prof_buf_free(hp_prof_buf_t *buf) {
+  free(buf->data);
+  memset(buf, 0, sizeof(*buf));
+}
+
+static void hp_prof_put_u32(unsigned char *out, uint32_t v) {
+  out[0] = v & 0xff;
+  out[1] = (v >> 8) & 0xff;
+  out[2] = (v >> 16) & 0xff;
+  out[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t hp_prof_get_u32(const unsigned char *in) {
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8)
+         | ((uint32_t)in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static int hp_prof_buf_u32(hp_prof_buf_t *buf, uint32_t v) {
+  unsigned char tmp[4];
+
+  hp_prof_put_u32(tmp, v);
+  return hp_prof_buf_append(buf, tmp, 4);
+}
+
+static int hp_prof_buf_u64(hp_prof_buf_t *buf, uint64_t v) {
+  return hp_prof_buf_u32(buf, (uint32_t)v)
+         | hp_prof_buf_u32(buf, (uint32_t)(v >> 32));
+}
+
+static int hp_prof_buf_strtab(hp_prof_buf_t *buf, const hp_prof_strtab_t *t) {
+  uint32_t i;
+  int      err = hp_prof_buf_u32(buf, t->count);
+
+  for (i = 0; i < t->count; i++) {
+    err |= hp_prof_buf_u32(buf, t->lens[i]);
+    err |= hp_prof_buf_append(buf, t->strs[i], t->lens[i]);
+  }
+  return err;
+}
+
+/**
+ * Append p to out as one frame.
+ *
+ * @return 0, or -1 when out of memory
+ */
+int hp_prof_write(const hp_prof_t *p, hp_prof_buf_t *out) {
+  unsigned char header[HP_PROF_HEADER_LEN];
+  size_t        start = out->len;
+  uint32_t      i, m;
+  int           err   = 0;
+
+  memcpy(header, HP_PROF_MAGIC, 4);
+  header[4] = HP_PROF_VERSION;
+  header[5] = HP_PROF_KIND_PROFILE;
+  header[6] = header[7] = 0;
+  hp_prof_put_u32(header + 8, 0);
+  err |= hp_prof_buf_append(out, header, sizeof(header));
+
+  err |= hp_prof_buf_u64(out, p->time_us);
+  err |= hp_prof_buf_u32(out, p->pid);
+  err |= hp_prof_buf_u32(out, p->seq);
+  err |= hp_prof_buf_u32(out, p->runs);
+  err |= hp_prof_buf_strtab(out, &p->metrics);
+  err |= hp_prof_buf_strtab(out, &p->strings);
+
+  err |= hp_prof_buf_u32(out, p->ntags);
+  for (i = 0; i < 2 * p->ntags; i++) {
+    err |= hp_prof_buf_u32(out, p->tags[i]);
+  }
+
+  err |= hp_prof_buf_u32(out, p->nedges);
+  for (i = 0; i < p->nedges; i++) {
+    const hp_prof_edge_t *edge = &p->edges[i];
+
+    err |= hp_prof_buf_u32(out, edge->parent);
+    err |= hp_prof_buf_u32(out, edge->child);
+    err |= hp_prof_buf_u32(out, edge->mask);
+    for (m = 0; m < HP_PROF_MAX_METRICS; m++) {
+      if (edge->mask & (1u << m)) {
+        err |= hp_prof_buf_u64(out, (uint64_t)edge->v[m]);
+      }
+    }
+  }
+
+  if (err) {
+    out->len = start;
+    return -1;
+  }
+
+  hp_prof_put_u32(out->data + start + 8,
+                  (uint32_t)(out->len - start - HP_PROF_HEADER_LEN));
+  return 0;
+}
+
+typedef struct hp_prof_reader_t {
+  const unsigned char    *pos;
+  const unsigned char    *end;
+} hp_prof_reader_t;
+
+static int hp_prof_read_u32(hp_prof_reader_t *r, uint32_t *v) {
+  if (r->end - r->pos < 4) {
+    return -1;
+  }
+  *v = hp_prof_get_u32(r->pos);
+  r->pos += 4;
+  return 0;
+}
+
+static int hp_prof_read_u64(hp_prof_reader_t *r, uint64_t *v) {
+  uint32_t lo, hi;
+
+  if (hp_prof_read_u32(r, &lo) < 0 || hp_prof_read_u32(r, &hi) < 0) {
+    return -1;
+  }
+  *v = (uint64_t)lo | ((uint64_t)hi << 32);
+  return 0;
+}
+
+static int hp_prof_read_strtab(hp_prof_reader_t *r, hp_prof_strtab_t *t) {
+  uint32_t n, i, len;
+
+  if (hp_prof_read_u32(r, &n) < 0) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (hp_prof_read_u32(r, &len) < 0 || (size_t)(r->end - r->pos) < len
+        || hp_prof_strtab_add(t, (const char *)r->pos, len) != i) {
+      return -1;
+    }
+    r->pos += len;
+  }
+  return 0;
+}
+
+/**
+ * Parse the frame at the start of data into p, which must be empty.
+ *
+ * @param  used  set to the length of the frame
+ * @return 0, or one of the HP_PROF_ERR_* codes
+ */
+int hp_prof_read(const unsigned char *data, size_t len, hp_prof_t *p,
+                 size_t *used) {
+  hp_prof_reader_t r;
+  uint32_t         size, n, i, m;
+
+  if (len < HP_PROF_HEADER_LEN) {
+    return HP_PROF_ERR_SHORT;
+  }
+  if (memcmp(data, HP_PROF_MAGIC, 4) || data[4] != HP_PROF_VERSION
+      || data[5] != HP_PROF_KIND_PROFILE) {
+    return HP_PROF_ERR_FORMAT;
+  }
+  size = hp_prof_get_u32(data + 8);
+  if (len - HP_PROF_HEADER_LEN < size) {
+    return HP_PROF_ERR_SHORT;
+  }
+
+  r.pos = data + HP_PROF_HEADER_LEN;
+  r.end = r.pos + size;
+
+  if (hp_prof_read_u64(&r, &p->time_us) < 0
+      || hp_prof_read_u32(&r, &p->pid) < 0
+      || hp_prof_read_u32(&r, &p->seq) < 0
+      || hp_prof_read_u32(&r, &p->runs) < 0
+      || hp_prof_read_strtab(&r, &p->metrics) < 0
+      || p->metrics.count > HP_PROF_MAX_METRICS
+      || hp_prof_read_strtab(&r, &p->strings) < 0
+      || hp_prof_read_u32(&r, &n) < 0) {
+    goto corrupt;
+  }
+
+  for (i = 0; i < n; i++) {
+    uint32_t k, v;
+
+    if (hp_prof_read_u32(&r, &k) < 0 || hp_prof_read_u32(&r, &v) < 0
+        || k >= p->strings.count || v >= p->strings.count
+        || hp_prof_tag(p, p->strings.strs[k], p->strings.strs[v]) < 0) {
+      goto corrupt;
+    }
+  }
+
+  if (hp_prof_read_u32(&r, &n) < 0) {
+    goto corrupt;
+  }
+  for (i = 0; i < n; i++) {
+    uint32_t        parent, child, mask;
+    hp_prof_edge_t *edge;
+
+    if (hp_prof_read_u32(&r, &parent) < 0
+        || hp_prof_read_u32(&r, &child) < 0
+        || hp_prof_read_u32(&r, &mask) < 0
+        || (parent != HP_PROF_NONE && parent >= p->strings.count)
+        || child >= p->strings.count
+        || (p->metrics.count < 32 && mask >> p->metrics.count)
+        || !(edge = hp_prof_edge(p, parent, child))) {
+      goto corrupt;
+    }
+
+    edge->mask |= mask;
+    for (m = 0; m < p->metrics.count; m++) {
+      uint64_t v;
+
+      if (mask & (1u << m)) {
+        if (hp_prof_read_u64(&r, &v) < 0) {
+          goto corrupt;
+        }
+        edge->v[m] += (int64_t)v;
+      }
+    }
+  }
+
+  if (r.pos != r.end) {
+    goto corrupt;
+  }
+
+  *used = HP_PROF_HEADER_LEN + size;
+  return 0;
+
+corrupt:
+  hp_prof_free(p);
+  return HP_PROF_ERR_FORMAT;
+}
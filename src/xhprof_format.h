@@ -0,0 +1,139 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+ * Serialized profiles.
+ *
+ * This file and xhprof_format.c don't depend on PHP, so the command line
+ * tools in tools/ can share them with the extension.
+ *
+ * A stream (a file, or what is sent to a collector) is a sequence of
+ * frames, so profiles can simply be appended. All integers are little
+ * endian.
+ *
+ *   frame   := "XHPF" u8 version u8 kind u16 0 u32 len payload[len]
+ *   payload := u64 time_us u32 pid u32 seq u32 runs
+ *              u32 nmetrics  str[nmetrics]       metric names
+ *              u32 nstrings  str[nstrings]       function names
+ *              u32 ntags     (u32 key u32 value)[ntags]
+ *              u32 nedges    edge[nedges]
+ *   str     := u32 len bytes[len]
+ *   edge    := u32 parent u32 child u32 mask i64 value[popcount(mask)]
+ *
+ * Tag keys and values, and the ends of an edge, are indexes in the
+ * function name table. An edge has parent HP_PROF_NONE for a root like
+ * "main()". Bit i of mask says metric i is present.
+ */
+#ifndef XHPROF_FORMAT_H
+#define XHPROF_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HP_PROF_MAGIC          "XHPF"
+#define HP_PROF_VERSION        1
+#define HP_PROF_KIND_PROFILE   1
+#define HP_PROF_HEADER_LEN     12
+
+/* Metric columns a profile can have */
+#define HP_PROF_MAX_METRICS    16
+
+/* No string: the parent of a root edge */
+#define HP_PROF_NONE           0xffffffffu
+
+/* Separator of the ends of an edge in xhprof_disable() keys */
+#define HP_PROF_DELIM          "==>"
+
+/* Tag of a profile holding averages per run, see hp_prof_normalize() */
+#define HP_PROF_TAG_PER_RUN    "xhprof.per_run"
+
+/* Errors of hp_prof_read() */
+#define HP_PROF_ERR_SHORT      -1      /* need more data                */
+#define HP_PROF_ERR_FORMAT     -2      /* not a profile, or corrupted   */
+
+/* A string table: strings interned to dense indexes */
+typedef struct hp_prof_strtab_t {
+  char                  **strs;
+  uint32_t               *lens;
+  uint32_t                count;
+  uint32_t                cap;
+  uint32_t               *slots;     /* open addressing, index + 1      */
+  uint32_t                nslots;
+} hp_prof_strtab_t;
+
+/* A caller==>callee edge and its metrics */
+typedef struct hp_prof_edge_t {
+  uint32_t                parent;
+  uint32_t                child;
+  uint32_t                mask;
+  int64_t                 v[HP_PROF_MAX_METRICS];
+} hp_prof_edge_t;
+
+typedef struct hp_prof_t {
+  uint64_t                time_us;   /* when it was taken               */
+  uint32_t                pid;
+  uint32_t                seq;       /* flush number within the process */
+  uint32_t                runs;      /* requests or runs merged in it   */
+  hp_prof_strtab_t        metrics;
+  hp_prof_strtab_t        strings;
+  uint32_t               *tags;      /* key, value pairs                */
+  uint32_t                ntags;
+  uint32_t                tags_cap;
+  hp_prof_edge_t         *edges;
+  uint32_t                nedges;
+  uint32_t                edges_cap;
+  uint32_t               *edge_slots;
+  uint32_t                edge_nslots;
+} hp_prof_t;
+
+/* A growable byte buffer */
+typedef struct hp_prof_buf_t {
+  unsigned char          *data;
+  size_t                  len;
+  size_t                  cap;
+} hp_prof_buf_t;
+
+void     hp_prof_init(hp_prof_t *p);
+void     hp_prof_free(hp_prof_t *p);
+
+int64_t  hp_prof_string(hp_prof_t *p, const char *s, size_t len);
+int64_t  hp_prof_string_find(const hp_prof_t *p, const char *s, size_t len);
+int      hp_prof_metric(hp_prof_t *p, const char *name);
+int      hp_prof_metric_find(const hp_prof_t *p, const char *name);
+int      hp_prof_tag(hp_prof_t *p, const char *key, const char *value);
+
+hp_prof_edge_t *hp_prof_edge(hp_prof_t *p, uint32_t parent, uint32_t child);
+hp_prof_edge_t *hp_prof_edge_find(const hp_prof_t *p, uint32_t parent,
+                                  uint32_t child);
+hp_prof_edge_t *hp_prof_edge_by_key(hp_prof_t *p, const char *key,
+                                    size_t len);
+size_t   hp_prof_edge_key(const hp_prof_t *p, const hp_prof_edge_t *edge,
+                          char *buf, size_t size);
+
+int      hp_prof_merge(hp_prof_t *dst, const hp_prof_t *src);
+int      hp_prof_normalize(hp_prof_t *p);
+int      hp_prof_load(const char *path, hp_prof_t *p);
+
+int      hp_prof_write(const hp_prof_t *p, hp_prof_buf_t *out);
+int      hp_prof_read(const unsigned char *data, size_t len, hp_prof_t *p,
+                      size_t *used);
+
+int      hp_prof_buf_append(hp_prof_buf_t *buf, const void *data, size_t len);
+void     hp_prof_buf_free(hp_prof_buf_t *buf);
+
+#endif /* XHPROF_FORMAT_H */
@@ -0,0 +1,374 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xhprof_report.h"
+
+const char *hp_report_metric_names[HP_REPORT_METRICS] = {
+  "ct", "wt", "cpu", "mu", "pmu", "io"
+};
+
+/**
+ * @return the HP_REPORT_* index of a metric name, or -1
+ */
+int hp_report_metric(const char *name) {
+  int m;
+
+  for (m = 0; m < HP_REPORT_METRICS; m++) {
+    if (!strcmp(name, hp_report_metric_names[m])) {
+      return m;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Compute the inclusive and exclusive metrics of every function of p.
+ *
+ * @return an array indexed like p->strings (tag strings and functions that
+ *         are never called stay zero), to be freed, or NULL when out of
+ *         memory
+ */
+hp_report_fn_t *hp_report_functions(const hp_prof_t *p) {
+  hp_report_fn_t *fns = calloc(p->strings.count + 1, sizeof(hp_report_fn_t));
+  int             col[HP_REPORT_METRICS];
+  uint32_t        i;
+  int             m;
+
+  if (!fns) {
+    return NULL;
+  }
+
+  for (m = 0; m < HP_REPORT_METRICS; m++) {
+    col[m] = hp_prof_metric_find(p, hp_report_metric_names[m]);
+  }
+
+  for (i = 0; i < p->nedges; i++) {
+    const hp_prof_edge_t *edge = &p->edges[i];
+
+    for (m = 0; m < HP_REPORT_METRICS; m++) {
+      int64_t v;
+
+      if (col[m] < 0 || !(edge->mask & (1u << col[m]))) {
+        continue;
+      }
+      v = edge->v[col[m]];
+
+      fns[edge->child].incl[m] += v;
+      fns[edge->child].excl[m] += v;
+      if (edge->parent != HP_PROF_NONE && m != HP_REPORT_CT) {
+        fns[edge->parent].excl[m] -= v;
+      }
+    }
+  }
+
+  return fns;
+}
+
+static int64_t hp_report_fn_value(const hp_report_fn_t *fn, int metric,
+                                  int excl) {
+  return excl ? fn->excl[metric] : fn->incl[metric];
+}
+
+/**
+ * Find the k functions with the highest inclusive or exclusive value of a
+ * metric, keeping the best k seen so far in a min-heap.
+ *
+ * @param  fns   from hp_report_functions(), nfns is the string count
+ * @param  top   receives the indexes of the functions, highest first
+ * @return how many were found: k, or fewer if fewer functions were called
+ */
+size_t hp_report_top(const hp_report_fn_t *fns, uint32_t nfns, int metric,
+                     int excl, uint32_t *top, size_t k) {
+  size_t   n = 0, i, j;
+  uint32_t f;
+
+#define HP_REPORT_TOP_V(i) hp_report_fn_value(&fns[top[i]], metric, excl)
+
+  if (!k) {
+    return 0;
+  }
+
+  for (f = 0; f < nfns; f++) {
+    int64_t v = hp_report_fn_value(&fns[f], metric, excl);
+
+    if (!fns[f].incl[HP_REPORT_CT]) {
+      continue;                      /* not a function, or never called */
+    }
+
+    if (n < k) {
+      /* sift up */
+      for (i = n++; i && HP_REPORT_TOP_V((i - 1) / 2) > v; i = (i - 1) / 2) {
+        top[i] = top[(i - 1) / 2];
+      }
+      top[i] = f;
+    } else if (v > HP_REPORT_TOP_V(0)) {
+      /* replace the smallest and sift down */
+      for (i = 0; (j = 2 * i + 1) < n; i = j) {
+        if (j + 1 < n && HP_REPORT_TOP_V(j + 1) < HP_REPORT_TOP_V(j)) {
+          j++;
+        }
+        if (HP_REPORT_TOP_V(j) >= v) {
+          break;
+        }
+        top[i] = top[j];
+      }
+      top[i] = f;
+    }
+  }
+
+  /* heap sort, smallest to the end */
+  for (i = n; i > 1; i--) {
+    uint32_t last = top[i - 1];
+    int64_t  v    = hp_report_fn_value(&fns[last], metric, excl);
+
+    top[i - 1] = top[0];
+    for (j = 0; 2 * j + 1 < i - 1; ) {
+      size_t c = 2 * j + 1;
+
+      if (c + 1 < i - 1 && HP_REPORT_TOP_V(c + 1) < HP_REPORT_TOP_V(c)) {
+        c++;
+      }
+      if (HP_REPORT_TOP_V(c) >= v) {
+        break;
+      }
+      top[j] = top[c];
+      j = c;
+    }
+    top[j] = last;
+  }
+
+#undef HP_REPORT_TOP_V
+
+  return n;
+}
+
+static int64_t hp_report_diff_impact(const hp_report_diff_t *row, int m) {
+  int64_t d = row->is_edge ? row->after[m] - row->before[m]
+                           : row->after_excl[m] - row->before_excl[m];
+
+  return d < 0 ? -d : d;
+}
+
+static int hp_report_diff_cmp(const void *a, const void *b) {
+  int64_t x = ((const hp_report_diff_t *)a)->impact;
+  int64_t y = ((const hp_report_diff_t *)b)->impact;
+
+  if (x != y) {
+    return x < y ? 1 : -1;
+  }
+  return strcmp(((const hp_report_diff_t *)a)->symbol,
+                ((const hp_report_diff_t *)b)->symbol);
+}
+
+static hp_report_diff_t *hp_report_diff_row(hp_report_diff_t **rows,
+                                            size_t *nrows, size_t *cap,
+                                            const char *symbol) {
+  hp_report_diff_t *row;
+
+  if (*nrows == *cap) {
+    size_t            n   = *cap ? *cap * 2 : 1024;
+    hp_report_diff_t *tmp = realloc(*rows, n * sizeof(hp_report_diff_t));
+
+    if (!tmp) {
+      return NULL;
+    }
+    *rows = tmp;
+    *cap  = n;
+  }
+
+  row = &(*rows)[*nrows];
+  memset(row, 0, sizeof(*row));
+  if (!(row->symbol = strdup(symbol))) {
+    return NULL;
+  }
+  (*nrows)++;
+  return row;
+}
+
+/**
+ * @return what to divide the totals of p by for averages per run: 1 when
+ *         p holds averages already (see hp_prof_normalize())
+ */
+static int64_t hp_report_runs(const hp_prof_t *p) {
+  int64_t  k = hp_prof_string_find(p, HP_PROF_TAG_PER_RUN,
+                                   sizeof(HP_PROF_TAG_PER_RUN) - 1);
+  uint32_t i;
+
+  for (i = 0; k >= 0 && i < p->ntags; i++) {
+    if (p->tags[2 * i] == (uint32_t)k) {
+      return 1;
+    }
+  }
+  return p->runs > 1 ? p->runs : 1;
+}
+
+/* A total as an average per run, rounded like hp_prof_normalize() */
+static int64_t hp_report_per_run(int64_t v, int64_t runs) {
+  return runs > 1 ? (v < 0 ? v - runs / 2 : v + runs / 2) / runs : v;
+}
+
+/**
+ * Compare two profiles, function by function and edge by edge. Only the
+ * rows are built; neither profile is copied. Both sides are compared per
+ * run, so profiles merged from different numbers of requests compare. The
+ * rows are sorted by the absolute change of the given metric, exclusive
+ * for functions, so the functions that got slower or faster themselves
+ * come first.
+ *
+ * @param  metric  HP_REPORT_* index to sort by
+ * @return 0, or -1 when out of memory
+ */
+int hp_report_diff(const hp_prof_t *before, const hp_prof_t *after,
+                   int metric, hp_report_diff_t **rows, size_t *nrows) {
+  const hp_prof_t *side[2] = { before, after };
+  hp_report_fn_t  *fns[2]  = { NULL, NULL };
+  hp_prof_t        index;            /* the union, rows numbered by edge */
+  hp_report_diff_t *out    = NULL;
+  size_t           n = 0, cap = 0;
+  int64_t          runs;
+  int              s, m, ret = -1;
+  uint32_t         i;
+
+  hp_prof_init(&index);
+
+  for (s = 0; s < 2; s++) {
+    const hp_prof_t *p = side[s];
+
+    if (!(fns[s] = hp_report_functions(p))) {
+      goto out;
+    }
+    runs = hp_report_runs(p);
+
+    /* Functions: keyed by a root edge to their name in index */
+    for (i = 0; i < p->nedges; i++) {
+      const hp_prof_edge_t *edge = &p->edges[i];
+      hp_prof_edge_t       *slot;
+      hp_report_diff_t     *row;
+      int64_t               name;
+
+      name = hp_prof_string(&index, p->strings.strs[edge->child],
+                            p->strings.lens[edge->child]);
+      if (name < 0 || !(slot = hp_prof_edge(&index, HP_PROF_NONE - 1,
+                                            (uint32_t)name))) {
+        goto out;
+      }
+      if (!slot->mask) {
+        if (!(row = hp_report_diff_row(&out, &n, &cap,
+                                       p->strings.strs[edge->child]))) {
+          goto out;
+        }
+        slot->mask = 1;
+        slot->v[0] = (int64_t)(n - 1);
+      }
+      if (!(slot->mask & (2u << s))) {
+        row = &out[slot->v[0]];
+        slot->mask |= 2u << s;
+        for (m = 0; m < HP_REPORT_METRICS; m++) {
+          (s ? row->after : row->before)[m]
+            = hp_report_per_run(fns[s][edge->child].incl[m], runs);
+          (s ? row->after_excl : row->before_excl)[m]
+            = hp_report_per_run(fns[s][edge->child].excl[m], runs);
+        }
+      }
+    }
+
+    /* Edges: keyed by the names of both ends in index */
+    for (i = 0; i < p->nedges; i++) {
+      const hp_prof_edge_t *edge   = &p->edges[i];
+      int64_t               parent = HP_PROF_NONE;
+      hp_prof_edge_t       *slot;
+      hp_report_diff_t     *row;
+      int64_t               name;
+
+      if (edge->parent != HP_PROF_NONE) {
+        parent = hp_prof_string(&index, p->strings.strs[edge->parent],
+                                p->strings.lens[edge->parent]);
+      }
+      name = hp_prof_string(&index, p->strings.strs[edge->child],
+                            p->strings.lens[edge->child]);
+      if (parent < 0 || name < 0
+          || !(slot = hp_prof_edge(&index, (uint32_t)parent,
+                                   (uint32_t)name))) {
+        goto out;
+      }
+      if (!slot->mask) {
+        size_t size = p->strings.lens[edge->child] + sizeof(HP_PROF_DELIM)
+                      + (edge->parent != HP_PROF_NONE
+                         ? p->strings.lens[edge->parent] : 0);
+        char  *key  = malloc(size);
+
+        if (!key) {
+          goto out;
+        }
+        hp_prof_edge_key(p, edge, key, size);
+        row = hp_report_diff_row(&out, &n, &cap, key);
+        free(key);
+        if (!row) {
+          goto out;
+        }
+        row->is_edge = 1;
+        slot->mask   = 1;
+        slot->v[0]   = (int64_t)(n - 1);
+      }
+      row = &out[slot->v[0]];
+      for (m = 0; m < HP_REPORT_METRICS; m++) {
+        int col = hp_prof_metric_find(p, hp_report_metric_names[m]);
+
+        if (col >= 0 && (edge->mask & (1u << col))) {
+          (s ? row->after : row->before)[m]
+            += hp_report_per_run(edge->v[col], runs);
+        }
+      }
+    }
+  }
+
+  if (metric < 0 || metric >= HP_REPORT_METRICS) {
+    metric = HP_REPORT_WT;
+  }
+  for (i = 0; i < n; i++) {
+    out[i].impact = hp_report_diff_impact(&out[i], metric);
+  }
+  qsort(out, n, sizeof(hp_report_diff_t), hp_report_diff_cmp);
+
+  *rows  = out;
+  *nrows = n;
+  out    = NULL;
+  ret    = 0;
+
+out:
+  hp_report_diff_free(out, n);
+  free(fns[0]);
+  free(fns[1]);
+  hp_prof_free(&index);
+  return ret;
+}
+
+void hp_report_diff_free(hp_report_diff_t *rows, size_t nrows) {
+  size_t i;
+
+  if (!rows) {
+    return;
+  }
+  for (i = 0; i < nrows; i++) {
+    free(rows[i].symbol);
+  }
+  free(rows);
+}
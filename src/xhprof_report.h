@@ -0,0 +1,67 @@
+/*
+  +----------------------------------------------------------------------+
+  | PHP Version 7                                                        |
+  +----------------------------------------------------------------------+
+  | Copyright (c) 1997-2016 The PHP Group                                |
+  +----------------------------------------------------------------------+
+  | This source file is subject to version 3.01 of the PHP license,      |
+  | that is bundled with this package in the file LICENSE, and is        |
+  | available through the world-wide-web at the following url:           |
+  | http://www.php.net/license/3_01.txt                                  |
+  | If you did not receive a copy of the PHP license and are unable to   |
+  | obtain it through the world-wide-web, please send a note to          |
+  | license@php.net so we can mail you a copy immediately.               |
+  +----------------------------------------------------------------------+
+  | Author: midoks(midoks@163.com)                                       |
+  +----------------------------------------------------------------------+
+*/
+
+/*
+ * Reports computed from profiles (see xhprof_format.h): per-function
+ * inclusive and exclusive metrics, and the difference of two profiles.
+ * Like xhprof_format.c this doesn't depend on PHP.
+ */
+#ifndef XHPROF_REPORT_H
+#define XHPROF_REPORT_H
+
+#include "xhprof_format.h"
+
+/* The metrics reports are about, in this order */
+#define HP_REPORT_CT           0
+#define HP_REPORT_WT           1
+#define HP_REPORT_CPU          2
+#define HP_REPORT_MU           3
+#define HP_REPORT_PMU          4
+#define HP_REPORT_IO           5
+#define HP_REPORT_METRICS      6
+
+extern const char *hp_report_metric_names[HP_REPORT_METRICS];
+
+/* A function: the sum of the edges into it (inclusive), less the edges out
+ * of it (exclusive). ct is the same in both. */
+typedef struct hp_report_fn_t {
+  int64_t                 incl[HP_REPORT_METRICS];
+  int64_t                 excl[HP_REPORT_METRICS];
+} hp_report_fn_t;
+
+/* A row of a diff: a function, or an edge "parent==>child" */
+typedef struct hp_report_diff_t {
+  char                   *symbol;
+  int                     is_edge;
+  int64_t                 before[HP_REPORT_METRICS];
+  int64_t                 after[HP_REPORT_METRICS];
+  int64_t                 before_excl[HP_REPORT_METRICS];  /* functions */
+  int64_t                 after_excl[HP_REPORT_METRICS];
+  int64_t                 impact;      /* the change rows are sorted by */
+} hp_report_diff_t;
+
+int  hp_report_metric(const char *name);
+hp_report_fn_t *hp_report_functions(const hp_prof_t *p);
+size_t hp_report_top(const hp_report_fn_t *fns, uint32_t nfns, int metric,
+                     int excl, uint32_t *top, size_t k);
+
+int  hp_report_diff(const hp_prof_t *before, const hp_prof_t *after,
+                    int metric, hp_report_diff_t **rows, size_t *nrows);
+void hp_report_diff_free(hp_report_diff_t *rows, size_t nrows);
+
+#endif /* XHPROF_REPORT_H */